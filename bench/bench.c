@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <time.h>
+
+#include <vasq/logger.h>
+
+#define NUM_ITERATIONS 1000000
+
+typedef void
+benchFunc(vasqLogger *logger);
+
+static const struct timespec fixed_time = {.tv_sec = 1613312839, .tv_nsec = 123456789};
+
+static void
+discard(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    (void)user;
+    (void)level;
+    (void)text;
+    (void)size;
+}
+
+static void
+fixed_clock(void *user, struct timespec *now)
+{
+    (void)user;
+    *now = fixed_time;
+}
+
+static vasqLogger *
+create_logger(const char *format, vasqFormatter *formatter)
+{
+    vasqHandler handler = {.func = discard};
+    vasqLoggerOptions options = {.name = "bench", .clock = fixed_clock, .formatter = formatter};
+
+    return vasqLoggerCreate(VASQ_LL_INFO, format, &handler, &options);
+}
+
+static void
+run(const char *name, vasqLogger *logger, benchFunc *func)
+{
+    long long elapsed;
+    struct timespec start, end;
+
+    if (!logger) {
+        perror("vasqLoggerCreate");
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int k = 0; k < NUM_ITERATIONS; k++) {
+        func(logger);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    printf("%-32s %8.1f ns/message\n", name, (double)elapsed / NUM_ITERATIONS);
+
+    vasqLoggerFree(logger);
+}
+
+static void
+log_message(vasqLogger *logger)
+{
+    VASQ_INFO(logger, "Request %u finished in %i us", 12345u, 678);
+}
+
+#define BENCH_FORMAT "%I [%L]%_ %N %p:%T %F:%l: %M\n"
+
+VASQ_DEFINE_FORMAT(bench_format, VASQ_FMT_ISO_TIME, VASQ_FMT_LITERAL(" ["), VASQ_FMT_LEVEL,
+                   VASQ_FMT_LITERAL("]"), VASQ_FMT_PADDING, VASQ_FMT_LITERAL(" "), VASQ_FMT_NAME,
+                   VASQ_FMT_LITERAL(" "), VASQ_FMT_PID, VASQ_FMT_LITERAL(":"), VASQ_FMT_TID,
+                   VASQ_FMT_LITERAL(" "), VASQ_FMT_FILE, VASQ_FMT_LITERAL(":"), VASQ_FMT_LINE,
+                   VASQ_FMT_LITERAL(": "), VASQ_FMT_MESSAGE, VASQ_FMT_LITERAL("\n"))
+
+int
+main()
+{
+    run("format string", create_logger(BENCH_FORMAT, NULL), log_message);
+    run("VASQ_DEFINE_FORMAT", create_logger(NULL, bench_format), log_message);
+
+    return 0;
+}
@@ -0,0 +1,19 @@
+BENCH_BINARY := $(BENCH_DIR)/bench
+BENCH_SOURCE_FILES := $(wildcard $(BENCH_DIR)/*.c)
+BENCH_OBJECT_FILES := $(patsubst %.c,%.o,$(BENCH_SOURCE_FILES))
+
+$(BENCH_DIR)/%.o: $(BENCH_DIR)/%.c $(VASQ_HEADER_FILES)
+	$(CC) $(CFLAGS) $(VASQ_INCLUDE_FLAGS) -c $< -o $@
+
+$(BENCH_BINARY): $(BENCH_OBJECT_FILES) $(VASQ_STATIC_LIBRARY)
+	$(CC) $(CFLAGS) $(BENCH_OBJECT_FILES) $(VASQ_STATIC_LIBRARY) -pthread -o $@
+
+bench: $(BENCH_BINARY)
+	@$<
+
+bench_clean:
+	@rm -f $(BENCH_BINARY) $(BENCH_OBJECT_FILES)
+
+.PHONY: bench_clean
+
+CLEAN_TARGETS += bench_clean
@@ -3,11 +3,107 @@
 // Causes all logging logic to be removed during preprocessing.
 // #define VASQ_NO_LOGGING
 
-// The maximum number of bytes which will be written by a log statement.
+// The default maximum number of bytes which will be written by a log statement.  This can be changed for
+// each logger via the max_message_size option.
 #ifndef VASQ_LOGGING_LENGTH
 #define VASQ_LOGGING_LENGTH 1024
 #endif
 
+// The largest buffer which will be allocated for a message logged with VASQ_LOGGER_FLAG_SPILL.  Anything
+// longer is truncated.
+#ifndef VASQ_SPILL_LIMIT
+#define VASQ_SPILL_LIMIT 1048576
+#endif
+
+// The default size in bytes of the ring buffer of an asynchronous handler.
+#ifndef VASQ_ASYNC_SIZE
+#define VASQ_ASYNC_SIZE 262144
+#endif
+
+// The maximum number of milliseconds for which freeing a logger with an asynchronous handler waits for the
+// queued messages to be written.
+#ifndef VASQ_ASYNC_DRAIN_TIMEOUT
+#define VASQ_ASYNC_DRAIN_TIMEOUT 1000
+#endif
+
+// The default value of the block_timeout option of an asynchronous handler.  A logging thread waits at most
+// this many milliseconds for room in the ring buffer.
+#ifndef VASQ_ASYNC_BLOCK_TIMEOUT
+#define VASQ_ASYNC_BLOCK_TIMEOUT 10
+#endif
+
+// The default value of the dedup_window logger option.  A run of repeated messages is reported by the first
+// repeat which arrives this many seconds after the run started.  There is no timer, so otherwise a run is
+// only reported by the logger's next different message or by vasqLoggerFree.
+#ifndef VASQ_DEDUP_WINDOW
+#define VASQ_DEDUP_WINDOW 30
+#endif
+
+// The number of milliseconds over which a logger with a CPU budget measures the time spent logging before
+// deciding whether to change its level.
+#ifndef VASQ_BUDGET_INTERVAL
+#define VASQ_BUDGET_INTERVAL 250
+#endif
+
+// The maximum number of seconds for which the logger will reuse a cached UTC offset before consulting the
+// time zone rules again.  The cache is always refreshed at DST transitions.
+#ifndef VASQ_TIMEZONE_REFRESH
+#define VASQ_TIMEZONE_REFRESH 3600
+#endif
+
+// The maximum number of fields which a thread can push with vasqContextPush.
+#ifndef VASQ_CONTEXT_DEPTH
+#define VASQ_CONTEXT_DEPTH 16
+#endif
+
+// The maximum number of bytes of a thread's rendered context fields.
+#ifndef VASQ_CONTEXT_SIZE
+#define VASQ_CONTEXT_SIZE 256
+#endif
+
+// The maximum number of bytes of a child logger's rendered fields (including those of its ancestors).
+#ifndef VASQ_CHILD_FIELDS_SIZE
+#define VASQ_CHILD_FIELDS_SIZE 128
+#endif
+
+// The maximum number of bytes of a cached %x value.  Longer values are truncated.
+#ifndef VASQ_DATA_CACHE_SIZE
+#define VASQ_DATA_CACHE_SIZE 128
+#endif
+
+// The number of %x tokens per logger whose values can be cached.  Any %x beyond this limit always calls the
+// processor.
+#ifndef VASQ_DATA_CACHE_SLOTS
+#define VASQ_DATA_CACHE_SLOTS 4
+#endif
+
+// The maximum number of shared objects (including the executable) whose call sites can be registered.  The
+// call sites of any others are left enabled and can't be enumerated.
+#ifndef VASQ_SITE_TABLES
+#define VASQ_SITE_TABLES 32
+#endif
+
+// The number of loggers which can be registered in a control file.
+#ifndef VASQ_CONTROL_LOGGERS
+#define VASQ_CONTROL_LOGGERS 32
+#endif
+
+// The number of call site rules a control file holds.  A process which logs nothing while more rules than
+// this are added misses the oldest ones.
+#ifndef VASQ_CONTROL_RULES
+#define VASQ_CONTROL_RULES 16
+#endif
+
+// The number of bytes of messages which a thread can hold back between vasqTailStart and vasqTailFlush.
+#ifndef VASQ_TAIL_SIZE
+#define VASQ_TAIL_SIZE 16384
+#endif
+
+// The number of messages which a thread can hold back between vasqTailStart and vasqTailFlush.
+#ifndef VASQ_TAIL_MESSAGES
+#define VASQ_TAIL_MESSAGES 256
+#endif
+
 // The maximum number of bytes displayed by a hex dump.  Any bytes past this limit are replaced by an
 // ellipsis.
 #ifndef VASQ_HEXDUMP_SIZE
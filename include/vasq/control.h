@@ -0,0 +1,54 @@
+/**
+ * @file control.h
+ * @author Daniel Walker
+ * @brief Defines the layout of a control file shared between a process and vasqctl.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "config.h"
+#include "definitions.h"
+
+#define VASQ_CONTROL_MAGIC        0x51534156 /* "VASQ" */
+#define VASQ_CONTROL_VERSION      1
+#define VASQ_CONTROL_NAME_SIZE    32
+#define VASQ_CONTROL_PATTERN_SIZE 64
+
+/**
+ * @brief A logger registered in a control file.
+ */
+typedef struct vasqControlLogger {
+    char name[VASQ_CONTROL_NAME_SIZE]; /**< The logger's name.  Empty if the slot is unused. */
+    int32_t level;                     /**< The logger's level. */
+    uint32_t pending;                  /**< Set by vasqctl when it changes level. */
+} vasqControlLogger;
+
+/**
+ * @brief A request to set the state of the call sites matching a filter.  See vasqCallSitesSetState.
+ */
+typedef struct vasqControlRule {
+    uint32_t sequence;                        /**< The rule's sequence number.  0 if the slot is unused. */
+    int32_t state;                            /**< The new vasqSiteState. */
+    uint32_t first_line;                      /**< The first line to match. */
+    uint32_t last_line;                       /**< The last line to match or 0 for no limit. */
+    char file[VASQ_CONTROL_PATTERN_SIZE];     /**< A glob for the file name or empty for every file. */
+    char function[VASQ_CONTROL_PATTERN_SIZE]; /**< A function name or empty for every function. */
+} vasqControlRule;
+
+/**
+ * @brief The contents of a control file.
+ *
+ * The process fills in the loggers.  vasqctl changes a logger's level or adds a rule (in slot sequence %
+ * VASQ_CONTROL_RULES) and then increments generation.  The process notices the new generation the next time
+ * it logs a message and applies the changes.
+ */
+typedef struct vasqControlPage {
+    uint32_t magic;                                  /**< VASQ_CONTROL_MAGIC. */
+    uint32_t version;                                /**< VASQ_CONTROL_VERSION. */
+    uint32_t pid;                                    /**< The ID of the process which owns the file. */
+    uint32_t generation;                             /**< Incremented by vasqctl after every change. */
+    uint32_t next_sequence;                          /**< The sequence number of the next rule. */
+    vasqControlLogger loggers[VASQ_CONTROL_LOGGERS]; /**< The registered loggers. */
+    vasqControlRule rules[VASQ_CONTROL_RULES];       /**< The most recent rules. */
+} vasqControlPage;
@@ -1,6 +1,6 @@
 #pragma once
 
-#define VASQ_VERSION "7.1.0"
+#define VASQ_VERSION "7.2.0"
 
 #ifndef NO_OP
 #define NO_OP ((void)0)
@@ -8,10 +8,13 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 
+#include "config.h"
 #include "definitions.h"
 
 #ifndef VASQ_NO_LOGGING
@@ -27,12 +30,56 @@ typedef enum vasqLogLevel {
     VASQ_LL_WARNING,   /**< Warning */
     VASQ_LL_INFO,      /**< Info */
     VASQ_LL_DEBUG,     /**< Debug */
+    VASQ_LL_TRACE,     /**< Trace */
 } vasqLogLevel;
 
 #define VASQ_CONTEXT_PARAMS __FILE__, __func__, __LINE__
 
+/**
+ * @brief The most verbose level whose messages are compiled.  The logging macros for more verbose levels
+ * expand to code which the compiler eliminates.  Define this before including this header to set it for a
+ * translation unit.
+ */
+#ifndef VASQ_MIN_LEVEL
+#define VASQ_MIN_LEVEL VASQ_LL_TRACE
+#endif
+
+/**
+ * @brief Value of vasqCallSite's base_offset when the offset of the file's basename isn't known.
+ */
+#define VASQ_BASE_OFFSET_UNKNOWN ((unsigned int)-1)
+
+#ifdef __FILE_NAME__
+#define VASQ_FILE_BASE_OFFSET (sizeof(__FILE__) - sizeof(__FILE_NAME__))
+#else
+#define VASQ_FILE_BASE_OFFSET VASQ_BASE_OFFSET_UNKNOWN
+#endif
+
 typedef struct vasqLogger vasqLogger;
 
+/**
+ * @brief The initial member of both loggers and child loggers.  Its fields should not be accessed directly.
+ */
+typedef struct vasqLoggerHead {
+    vasqLogger *root;          /**< The logger which owns the format and handler. */
+    const char *fields;        /**< The rendered fields added by child loggers. */
+    const char *json_fields;   /**< The same fields rendered as JSON. */
+    size_t fields_length;      /**< The length of fields. */
+    size_t json_fields_length; /**< The length of json_fields. */
+    vasqLogLevel level;        /**< The maximum log level.  Only the root's is used. */
+    vasqLogLevel sample_level; /**< The least verbose level which is sampled.  Only the root's is used. */
+    uint32_t sample_threshold; /**< The largest sampling hash which is kept.  Only the root's is used. */
+} vasqLoggerHead;
+
+/**
+ * @brief A logger which adds fixed fields to the messages of its parent.  See vasqChildLoggerInit.
+ */
+typedef struct vasqChildLogger {
+    vasqLoggerHead head;
+    char fields[VASQ_CHILD_FIELDS_SIZE];
+    char json_fields[VASQ_CHILD_FIELDS_SIZE];
+} vasqChildLogger;
+
 /*
     Format symbols:
 
@@ -47,10 +94,15 @@ typedef struct vasqLogger vasqLogger;
     %h : Hour
     %m : Minute
     %s : Second
+    %3 : Milliseconds within the second (3 digits)
+    %6 : Microseconds within the second (6 digits)
+    %9 : Nanoseconds within the second (9 digits)
+    %I : ISO-8601 local timestamp with milliseconds and UTC offset
     %F : File name
     %f : Function name
     %l : Line number
     %x : User data
+    %C : Context fields (see vasqContextPush and vasqChildLoggerInit)
     %% : Literal percent sign
 */
 
@@ -96,6 +148,89 @@ typedef struct vasqLoggerHandler {
 int
 vasqFdHandlerCreate(int fd, unsigned int flags, vasqHandler *handler);
 
+/**
+ * @brief What an asynchronous handler does with a message when its ring buffer is full.
+ */
+typedef enum vasqAsyncPolicy {
+    VASQ_ASYNC_DROP_NEWEST = 0, /**< Drop the message being logged. */
+    VASQ_ASYNC_DROP_OLDEST,     /**< Discard the oldest queued messages to make room. */
+    VASQ_ASYNC_BLOCK,           /**< Wait up to block_timeout milliseconds for room and then drop. */
+    VASQ_ASYNC_DROP_VERBOSE,    /**< Drop messages more verbose than drop_level and block for the rest. */
+} vasqAsyncPolicy;
+
+/**
+ * @brief Options passed to vasqAsyncHandlerCreate.
+ */
+typedef struct vasqAsyncOptions {
+    size_t size;                /**< The size of the ring buffer in bytes.  Defaults to VASQ_ASYNC_SIZE. */
+    vasqAsyncPolicy policy;     /**< What to do when the ring buffer is full. */
+    unsigned int block_timeout; /**< Milliseconds to wait for room.  Defaults to VASQ_ASYNC_BLOCK_TIMEOUT. */
+    vasqLogLevel drop_level;    /**< The most verbose level which VASQ_ASYNC_DROP_VERBOSE doesn't drop. */
+    unsigned int flags;         /**< Bitwise-or-combined flags. */
+} vasqAsyncOptions;
+
+#define VASQ_ASYNC_FLAG_PRIORITY_LANE 0x00000001  /// Queue ALWAYS, CRITICAL, and ERROR messages separately.
+#define VASQ_ASYNC_FLAG_SYNC_CRITICAL 0x00000002  /// Write ALWAYS and CRITICAL messages synchronously.
+
+/**
+ * @brief Counters of an asynchronous handler.  Raw messages are counted at the ALWAYS level.  See
+ * vasqAsyncHandlerStats.
+ */
+typedef struct vasqAsyncStats {
+    unsigned long written; /**< The number of messages passed to the wrapped handler. */
+    unsigned long dropped; /**< The total number of messages dropped or discarded. */
+    unsigned long dropped_messages[VASQ_LL_TRACE + 1];   /**< The messages dropped at each level. */
+    unsigned long long dropped_bytes[VASQ_LL_TRACE + 1]; /**< The bytes dropped at each level. */
+} vasqAsyncStats;
+
+/**
+ * @brief Creates a handler which queues messages in a lock-free ring buffer and passes them to another
+ * handler from a background thread.
+ *
+ * Logging threads only copy their messages into the ring buffer.  What happens to a message which doesn't
+ * fit depends on the policy option but a logging thread never waits for more than block_timeout
+ * milliseconds.  Every dropped message is counted and, once the background thread has emptied the ring
+ * buffer, it passes a line at the WARNING level saying how many messages were dropped to the wrapped
+ * handler.  When the logger is freed, the queued messages are written for up to VASQ_ASYNC_DRAIN_TIMEOUT
+ * milliseconds before the thread is stopped and the wrapped handler is cleaned up.  In a child process
+ * created by fork, messages are passed to the wrapped handler synchronously.
+ *
+ * With VASQ_ASYNC_FLAG_PRIORITY_LANE, ALWAYS, CRITICAL, and ERROR messages are queued in a separate ring
+ * buffer, which gets a quarter of the space and which the background thread always empties first.  With
+ * VASQ_ASYNC_FLAG_SYNC_CRITICAL, ALWAYS and CRITICAL messages are passed to the wrapped handler by the
+ * logging thread, so the wrapped handler must be safe to call from several threads at once.
+ *
+ * @param handler       The handler to be wrapped.  The new handler takes ownership of it if successful.
+ * @param options       A pointer to an options structure.  If options is NULL, then default options are used.
+ * @param async[out]    The handler to be populated.
+ *
+ * @return              0 if successful.  Otherwise, -1 is returned and errno is set.
+ */
+int
+vasqAsyncHandlerCreate(const vasqHandler *handler, const vasqAsyncOptions *options, vasqHandler *async);
+
+/**
+ * @brief Waits until every message queued before the call has been passed to the wrapped handler (or
+ * discarded) and every drop before the call has been reported.
+ *
+ * @param async     A handler created by vasqAsyncHandlerCreate.
+ *
+ * @return          0 if successful.  Otherwise, -1 is returned and errno is set.
+ */
+int
+vasqAsyncHandlerFlush(const vasqHandler *async);
+
+/**
+ * @brief Reads the counters of an asynchronous handler.
+ *
+ * @param async     A handler created by vasqAsyncHandlerCreate.
+ * @param stats     The structure to be filled in.
+ *
+ * @return          0 if successful.  Otherwise, -1 is returned and errno is set.
+ */
+int
+vasqAsyncHandlerStats(const vasqHandler *async, vasqAsyncStats *stats) VASQ_NONNULL(2);
+
 /**
  * @brief Function type for processing the %x logger format token.
  *
@@ -109,32 +244,246 @@ vasqFdHandlerCreate(int fd, unsigned int flags, vasqHandler *handler);
 typedef void
 vasqDataProcessor(void *user, size_t idx, vasqLogLevel level, char **dst, size_t *remaining);
 
+/**
+ * @brief How often a logger calls its data processor.
+ *
+ * In all modes other than VASQ_DATA_DYNAMIC, the rendered value is cached by the logger and copied into each
+ * message.  The value therefore must not depend on the level passed to the processor.
+ */
+typedef enum vasqDataMode {
+    VASQ_DATA_DYNAMIC = 0, /**< Call the processor for every %x of every message.  This is the default. */
+    VASQ_DATA_STATIC,      /**< Call the processor once per %x for the lifetime of the logger. */
+    VASQ_DATA_PER_THREAD,  /**< Call the processor once per %x per thread. */
+    VASQ_DATA_VERSIONED,   /**< Call the processor once per %x per thread per generation.  See
+                              vasqLoggerBumpDataGeneration. */
+} vasqDataMode;
+
+/**
+ * @brief Function type for reading the current time for the time format tokens.
+ *
+ * @param user      User-provided data.
+ * @param now[out]  The current time as an offset from the Unix epoch.
+ */
+typedef void
+vasqClockFunc(void *user, struct timespec *now);
+
+/**
+ * @brief Reads CLOCK_REALTIME.  This is the default clock.
+ */
+vasqClockFunc vasqClockRealtime;
+
+/**
+ * @brief Reads CLOCK_REALTIME_COARSE if it's available and CLOCK_REALTIME otherwise.  This is cheaper than
+ * vasqClockRealtime but only has a resolution of a few milliseconds.
+ */
+vasqClockFunc vasqClockRealtimeCoarse;
+
+/**
+ * @brief Reads the CPU's cycle counter (the TSC on x86 and CNTVCT_EL0 on AArch64) and converts it to real
+ * time.  The counter is calibrated once per process (by vasqLoggerCreate if a logger uses this clock) and
+ * anchored to CLOCK_REALTIME once per second per thread.  Falls back to vasqClockRealtime on other
+ * architectures.
+ */
+vasqClockFunc vasqClockCycles;
+
+/**
+ * @brief The state of a message being formatted.  Only used through vasqFormatLiteral and vasqFormatToken.
+ */
+typedef struct vasqFormatContext vasqFormatContext;
+
+/**
+ * @brief Function type which formats a message in place of a logger's format string.  See
+ * VASQ_DEFINE_FORMAT.
+ *
+ * @param ctx       The message being formatted.
+ * @param dst       A pointer to the destination pointer as used in vasqIncSnprintf (see safe_snprintf.h).
+ * @param remaining A pointer to the remaining number of characters in the destination buffer as used in
+ * vasqIncSnprintf (see safe_snprintf.h).
+ */
+typedef void
+vasqFormatter(vasqFormatContext *ctx, char **dst, size_t *remaining);
+
+/**
+ * @brief Append literal text to a buffer in the manner of vasqIncSnprintf.
+ *
+ * @param dst       A pointer to the destination pointer.
+ * @param remaining A pointer to the remaining number of characters in the destination buffer.
+ * @param text      The text to append.
+ * @param length    The number of characters to append.
+ */
+static inline void
+vasqFormatLiteral(char **dst, size_t *remaining, const char *text, size_t length)
+{
+    if (length >= *remaining) {
+        if (*remaining == 0) {
+            return;
+        }
+        length = *remaining - 1;
+    }
+
+    memcpy(*dst, text, length);
+    *dst += length;
+    **dst = '\0';
+    *remaining -= length;
+}
+
+/**
+ * @brief Append the expansion of a format token to a message.
+ *
+ * @param ctx       The message being formatted.
+ * @param token     The character which would follow the % in a format string.  Unknown tokens are ignored as
+ * are any occurrences of 'M' after the first.
+ */
+void
+vasqFormatToken(vasqFormatContext *ctx, char token) VASQ_NONNULL(1);
+
+/**
+ * @brief Append the expansion of a single format token to a message.  These are called by the VASQ_FMT_*
+ * macros and are equivalent to vasqFormatToken with the corresponding token (e.g., vasqFormatMessage for 'M'
+ * and vasqFormatContextFields for 'C') but without its dispatch.
+ *
+ * @param ctx       The message being formatted.
+ */
+void
+vasqFormatMessage(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatPid(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatTid(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatLevel(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatPadding(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatName(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatEpoch(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatTimestamp(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatHour(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatMinute(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatSecond(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatMilliseconds(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatMicroseconds(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatNanoseconds(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatIsoTime(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatFile(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatFunction(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatLine(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatData(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+void
+vasqFormatContextFields(vasqFormatContext *ctx) VASQ_NONNULL(1);
+
+/**
+ * @brief Define a formatter function from a fixed sequence of elements.
+ *
+ * Each element is one of the VASQ_FMT_* macros.  E.g.,
+ *
+ *     VASQ_DEFINE_FORMAT(my_format, VASQ_FMT_LITERAL("["), VASQ_FMT_LEVEL, VASQ_FMT_LITERAL("] "),
+ *                        VASQ_FMT_MESSAGE, VASQ_FMT_LITERAL("\n"))
+ *
+ * defines a static function equivalent to the format string "[%L] %M\n" which can be passed as the
+ * formatter option to vasqLoggerCreate.  The function body is a straight sequence of direct calls to each
+ * token's function (e.g., vasqFormatLevel) with the literals copied inline so no format string has to be
+ * interpreted and no token has to be dispatched at run time.
+ */
+#define VASQ_DEFINE_FORMAT(name, ...)                                                         \
+    static void name(vasqFormatContext *_vasq_ctx, char **_vasq_dst, size_t *_vasq_remaining) \
+    {                                                                                         \
+        __VA_ARGS__;                                                                          \
+    }
+
+#define VASQ_FMT_LITERAL(text) vasqFormatLiteral(_vasq_dst, _vasq_remaining, "" text, sizeof(text) - 1)
+#define VASQ_FMT_TOKEN(token)  vasqFormatToken(_vasq_ctx, token)
+#define VASQ_FMT_MESSAGE        vasqFormatMessage(_vasq_ctx)
+#define VASQ_FMT_PID            vasqFormatPid(_vasq_ctx)
+#define VASQ_FMT_TID            vasqFormatTid(_vasq_ctx)
+#define VASQ_FMT_LEVEL          vasqFormatLevel(_vasq_ctx)
+#define VASQ_FMT_PADDING        vasqFormatPadding(_vasq_ctx)
+#define VASQ_FMT_NAME           vasqFormatName(_vasq_ctx)
+#define VASQ_FMT_EPOCH          vasqFormatEpoch(_vasq_ctx)
+#define VASQ_FMT_TIMESTAMP      vasqFormatTimestamp(_vasq_ctx)
+#define VASQ_FMT_HOUR           vasqFormatHour(_vasq_ctx)
+#define VASQ_FMT_MINUTE         vasqFormatMinute(_vasq_ctx)
+#define VASQ_FMT_SECOND         vasqFormatSecond(_vasq_ctx)
+#define VASQ_FMT_MILLISECONDS   vasqFormatMilliseconds(_vasq_ctx)
+#define VASQ_FMT_MICROSECONDS   vasqFormatMicroseconds(_vasq_ctx)
+#define VASQ_FMT_NANOSECONDS    vasqFormatNanoseconds(_vasq_ctx)
+#define VASQ_FMT_ISO_TIME       vasqFormatIsoTime(_vasq_ctx)
+#define VASQ_FMT_FILE           vasqFormatFile(_vasq_ctx)
+#define VASQ_FMT_FUNCTION       vasqFormatFunction(_vasq_ctx)
+#define VASQ_FMT_LINE           vasqFormatLine(_vasq_ctx)
+#define VASQ_FMT_DATA           vasqFormatData(_vasq_ctx)
+#define VASQ_FMT_CONTEXT        vasqFormatContextFields(_vasq_ctx)
+
 /**
  * @brief Options passed to vasqLoggerCreate.
  *
- * @note Currently, the only available flag is VASQ_LOGGER_FLAG_HEX_DUMP_INFO.
+ * @note The available flags are VASQ_LOGGER_FLAG_HEX_DUMP_INFO, VASQ_LOGGER_FLAG_SPILL,
+ * VASQ_LOGGER_FLAG_JSON, and VASQ_LOGGER_FLAG_DEDUP.
  */
 typedef struct vasqLoggerOptions {
     char *name;                   /**< The logger's name.  If set, will be strdup'ed. */
     vasqDataProcessor *processor; /**< The processor to be used for %x format tokens. */
     void *user;                   /**< User-provided data. */
     unsigned int flags;           /**< Bitwise-or-combined flags. */
+    vasqClockFunc *clock;         /**< The clock used by the time tokens.  Defaults to vasqClockRealtime. */
+    void *clock_user;             /**< User-provided data passed to the clock. */
+    vasqFormatter *formatter;     /**< If set, used instead of the format string. */
+    vasqDataMode data_mode;       /**< How often the processor is called. */
+    size_t max_message_size;      /**< The size of the output buffer.  Defaults to VASQ_LOGGING_LENGTH. */
+    unsigned int dedup_window;    /**< Seconds before a run of repeats is reported.  See VASQ_DEDUP_WINDOW. */
 } vasqLoggerOptions;
 
 #define VASQ_LOGGER_FLAG_CLOEXEC       0x00000001  /// Set FD_CLOEXEC on a file descriptor.
 #define VASQ_LOGGER_FLAG_HEX_DUMP_INFO 0x00000002  /// Emit hex dumps at the INFO level.
+#define VASQ_LOGGER_FLAG_SPILL         0x00000004  /// Pass long messages to the handler in chunks.
+#define VASQ_LOGGER_FLAG_JSON          0x00000008  /// Emit each message as a JSON object.
+#define VASQ_LOGGER_FLAG_DEDUP         0x00000010  /// Replace repeated messages with a count.
 
 /**
  * @brief Allocate and initialize a logger.
  *
  * @param level     The maximum log level that this logger will handle.
- * @param format    The format string for the log messages.
+ * @param format    The format string for the log messages.  Ignored (and may be NULL) if the formatter option
+ * is set.
  * @param handler   A pointer to the handler to be used.
  * @param options   A pointer to an options structure.  If options is NULL, then default options are used.
  *
  * @return          A pointer to the logger if successful. If not, then NULL is returned and errno is set.
  *
- * @note Currently, the only available flag for options is VASQ_LOGGER_FLAG_HEX_DUMP_INFO.
+ * @note The available flags for options are VASQ_LOGGER_FLAG_HEX_DUMP_INFO, VASQ_LOGGER_FLAG_SPILL,
+ * VASQ_LOGGER_FLAG_JSON, and VASQ_LOGGER_FLAG_DEDUP.
  */
 vasqLogger *
 vasqLoggerCreate(vasqLogLevel level, const char *format, const vasqHandler *handler,
@@ -160,15 +509,155 @@ vasqLoggerFree(vasqLogger *logger);
 vasqLogLevel
 vasqLoggerLevel(vasqLogger *logger);
 
+/**
+ * @brief Invalidate the cached %x values of a logger whose data mode is VASQ_DATA_VERSIONED.  Each thread
+ * will call the processor again the next time it logs a message.
+ *
+ * @param logger    The logger handle.  This function does nothing if logger is NULL.
+ */
+void
+vasqLoggerBumpDataGeneration(vasqLogger *logger);
+
 /**
  * @brief Set the maximum log level for a logger.
  *
+ * This function can be called while other threads are logging.  They'll see the new level shortly after.
+ *
  * @param logger    The logger handle.
  * @param level     The new maximum log level.
  */
 void
 vasqSetLoggerLevel(vasqLogger *logger, vasqLogLevel level);
 
+/**
+ * @brief Sample the verbose messages of a logger by the calling thread's sampling key.
+ *
+ * A message whose level is at least as verbose as level is only emitted if the hash of the thread's sampling
+ * key (see vasqSetSamplingKey) falls within the given fraction of all hashes.  Since the hash only depends
+ * on the key, either all or none of a request's sampled messages are emitted.  Messages logged by a thread
+ * with no sampling key and messages from call sites set to VASQ_SITE_ENABLED aren't sampled.
+ *
+ * This function can be called while other threads are logging.
+ *
+ * @param logger    The logger handle.
+ * @param level     The least verbose level to sample or VASQ_LL_NONE to stop sampling.
+ * @param ratio     The fraction of sampling keys to keep, from 0 to 1.
+ *
+ * @return          0 if successful and -1 otherwise.  errno is set to EINVAL if logger is NULL or if level or
+ * ratio is invalid.
+ */
+int
+vasqSetLoggerSampling(vasqLogger *logger, vasqLogLevel level, double ratio);
+
+/**
+ * @brief The state of a logger's CPU budget.  See vasqLoggerBudgetStats.
+ */
+typedef struct vasqBudgetStats {
+    vasqLogLevel level;          /**< The effective maximum log level. */
+    unsigned int steps;          /**< The number of levels by which the effective level has been lowered. */
+    unsigned int load;           /**< The recent share of wall time spent logging in tenths of a percent. */
+    unsigned long degradations;  /**< The number of times that the level has been lowered. */
+    unsigned long restorations;  /**< The number of times that the level has been raised again. */
+} vasqBudgetStats;
+
+/**
+ * @brief Limit the share of wall time which a logger spends formatting and handling messages.
+ *
+ * The time spent in the logger is measured over intervals of VASQ_BUDGET_INTERVAL milliseconds (see
+ * vasq/config.h).  While the recent average exceeds the budget, the logger's effective level is lowered
+ * one step per interval, but never below floor.  Once it falls below half of the budget, the level is
+ * raised again one step per interval.  Each change is announced by a message at the ALWAYS level.  The
+ * measurements and changes happen as messages are logged, so the level isn't raised until something is
+ * logged.
+ *
+ * Time spent by all threads is counted so a budget above 100 percent is meaningful.  vasqLoggerLevel returns
+ * the effective level while vasqSetLoggerLevel sets the level to be restored.
+ *
+ * @param logger    The logger handle.
+ * @param percent   The budget as a percentage of wall time or 0 to remove the budget and restore the level.
+ * @param floor     The least verbose level to which the level can be lowered.
+ *
+ * @return          0 if successful and -1 otherwise.  errno is set to EINVAL if logger is NULL or if floor is
+ * invalid.
+ */
+int
+vasqSetLoggerBudget(vasqLogger *logger, unsigned int percent, vasqLogLevel floor);
+
+/**
+ * @brief Read the state of a logger's CPU budget.
+ *
+ * @param logger    The logger handle.
+ * @param stats     The structure to be filled in.
+ *
+ * @return          0 if successful and -1 otherwise.  errno is set to EINVAL if logger is NULL.
+ */
+int
+vasqLoggerBudgetStats(vasqLogger *logger, vasqBudgetStats *stats) VASQ_NONNULL(2);
+
+/**
+ * @brief Hold back the verbose messages of a logger until the request they belong to fails.
+ *
+ * Between calls to vasqTailStart and either vasqTailFlush or vasqTailStop, a thread's messages whose level is
+ * at least as verbose as level are formatted into a per-thread buffer instead of being passed to the
+ * handler.  A message whose level is at least as severe as flush_level calls vasqTailFlush before it's
+ * emitted.  Outside of those calls, messages are emitted as usual.
+ *
+ * This function can be called while other threads are logging.
+ *
+ * @param logger        The logger handle.
+ * @param level         The least verbose level to hold back or VASQ_LL_NONE to stop holding back messages.
+ * @param flush_level   The most verbose level which flushes the buffer or VASQ_LL_NONE if only
+ * vasqTailFlush flushes it.  This must be less verbose than level.
+ *
+ * @return              0 if successful and -1 otherwise.  errno is set to EINVAL if logger is NULL or if
+ * either level is invalid.
+ */
+int
+vasqSetLoggerTail(vasqLogger *logger, vasqLogLevel level, vasqLogLevel flush_level);
+
+/**
+ * @brief Start holding back the calling thread's verbose messages (e.g., at the start of a request).  Any
+ * messages which were already held back are discarded.  See vasqSetLoggerTail.
+ */
+void
+vasqTailStart(void);
+
+/**
+ * @brief Pass the calling thread's held back messages to their handlers and stop holding back messages.
+ *
+ * Consecutive messages for the same handler are passed in a single call with the most severe of their
+ * levels.  If more messages were held back than fit in the buffer (see VASQ_TAIL_SIZE and
+ * VASQ_TAIL_MESSAGES in vasq/config.h), then only the most recent ones are passed.  The loggers which
+ * produced the messages must not have been freed.
+ */
+void
+vasqTailFlush(void);
+
+/**
+ * @brief Discard the calling thread's held back messages and stop holding back messages (e.g., at the end of
+ * a successful request).
+ */
+void
+vasqTailStop(void);
+
+/**
+ * @brief The hash of the calling thread's sampling key or 0 if none is set.  This shouldn't be accessed
+ * directly.
+ */
+extern __thread uint32_t _vasq_sample_hash;
+
+/**
+ * @brief Set the calling thread's sampling key (e.g., a request or trace ID).  The key is hashed once here
+ * so that checking whether a message is sampled only costs a comparison.  See vasqSetLoggerSampling.
+ *
+ * The hash is the same in every process so that services sharing a trace ID make the same decision.
+ *
+ * @param key   The key or NULL to clear the thread's key.
+ * @param size  The size of the key in bytes.
+ */
+void
+vasqSetSamplingKey(const void *key, size_t size);
+
 /**
  * @brief Return the logger's name.
  *
@@ -179,6 +668,65 @@ vasqSetLoggerLevel(vasqLogger *logger, vasqLogLevel level);
 const char *
 vasqLoggerName(vasqLogger *logger);
 
+/**
+ * @brief Initialize a child logger which emits its parent's messages with an additional field.
+ *
+ * The field is rendered as key=value by the %C format token following the fields of the parent (if it is
+ * itself a child logger).  No memory is allocated and the child doesn't need to be freed.  However, it must
+ * not outlive the parent nor be copied.  The child shares the parent's level, handler, and options.
+ *
+ * @param child     The child logger to be initialized.
+ * @param parent    The parent logger.
+ * @param key       The field's key.
+ * @param format    A format string (corresponding to vasqSafeSnprintf's syntax) for the field's value.
+ *
+ * @return          The child as a logger handle if successful.  Otherwise, NULL is returned and errno is set.
+ * ENOSPC indicates that the fields would exceed VASQ_CHILD_FIELDS_SIZE and EINVAL that the format has a
+ * token which vasqSafeSnprintf doesn't support.
+ */
+vasqLogger *
+vasqChildLoggerInit(vasqChildLogger *child, vasqLogger *parent, const char *key, const char *format, ...)
+    VASQ_FORMAT(4);
+
+/**
+ * @brief Push a field onto the calling thread's context.  The field is rendered as key=value by the %C format
+ * token in all messages logged by this thread until it's popped.
+ *
+ * @param key       The field's key.
+ * @param format    A format string (corresponding to vasqSafeSnprintf's syntax) for the field's value.
+ *
+ * @return          0 if successful.  Otherwise, -1 is returned and errno is set.  ENOSPC indicates that
+ * either VASQ_CONTEXT_DEPTH or VASQ_CONTEXT_SIZE would be exceeded.  EINVAL indicates that the format has a
+ * token which vasqSafeSnprintf doesn't support.
+ */
+int
+vasqContextPush(const char *key, const char *format, ...) VASQ_FORMAT(2);
+
+/**
+ * @brief Pop the most recently pushed field from the calling thread's context.  Does nothing if the context
+ * is empty.
+ */
+void
+vasqContextPop(void);
+
+/**
+ * @brief Remove all fields from the calling thread's context.
+ */
+void
+vasqContextClear(void);
+
+/**
+ * @brief Reload the local time zone rules used by the time format tokens.
+ *
+ * The logger converts timestamps to local time using a cached UTC offset rather than localtime_r.  The cache
+ * refreshes itself, with localtime_r, at DST transitions and every VASQ_TIMEZONE_REFRESH seconds.  Call this
+ * function if the TZ environment variable or the system time zone has changed and you want the change to take
+ * effect immediately.  Calling it at startup also means that the first log message won't have to populate the
+ * cache.
+ */
+void
+vasqRefreshTimeZone(void);
+
 /**
  * @brief Emit a logging message.
  *
@@ -195,41 +743,628 @@ void
 vasqLogStatement(vasqLogger *logger, vasqLogLevel level, const char *file_name, const char *function_name,
                  unsigned int line_no, const char *format, ...) VASQ_FORMAT(6);
 
+/**
+ * @brief How a call site's messages are filtered.  See vasqCallSitesSetState.
+ */
+typedef enum vasqSiteState {
+    VASQ_SITE_DEFAULT,  /**< Messages are emitted if the logger's level allows it. */
+    VASQ_SITE_ENABLED,  /**< Messages are emitted unless the logger's level is VASQ_LL_NONE. */
+    VASQ_SITE_DISABLED, /**< Messages are never emitted. */
+} vasqSiteState;
+
+/**
+ * @brief Describes the origin of a log statement.
+ *
+ * The logging macros create a static instance of this structure for every call site so that none of this
+ * information has to be computed or passed when the statement is executed.
+ */
+typedef struct vasqCallSite {
+    const char *file_name;     /**< The name of the file where the message originated. */
+    const char *function_name; /**< The name of the function where the message originated. */
+    const char *format;        /**< The format string for the message. */
+    unsigned int line_no;      /**< The line number where the message originated. */
+    unsigned int base_offset;  /**< The offset of the file's basename or VASQ_BASE_OFFSET_UNKNOWN. */
+    vasqLogLevel level;        /**< The level of the message. */
+    unsigned char enabled;     /**< Whether any logger might emit the message.  Maintained by the library. */
+    unsigned char state;       /**< The site's vasqSiteState. */
+} vasqCallSite;
+
+/*
+    On ELF platforms, a pointer to each call site declared by VASQ_CALL_SITE is placed in the vasq_call_sites
+    section.  A constructor registers the section of each shared object (and the executable) with the
+    library.
+*/
+#if defined(__GNUC__) && defined(__ELF__)
+#define _VASQ_SITE_SECTIONS
+#endif
+
+#ifdef _VASQ_SITE_SECTIONS
+#define _VASQ_REGISTER_SITE(name) \
+    static vasqCallSite *const name##_entry __attribute__((section("vasq_call_sites"), used)) = &name
+#else
+#define _VASQ_REGISTER_SITE(name) static vasqCallSite *const name##_entry __attribute__((unused)) = &name
+#endif
+
+/**
+ * @brief Declare a static call site descriptor for the current location.
+ *
+ * @param name      The name of the variable to declare.
+ * @param level     The level of the message.
+ * @param format    The format string for the message.  This must be a string literal (or NULL for a
+ *                  descriptor which the library ignores).
+ */
+#define VASQ_CALL_SITE(name, level, format)                                                                 \
+    static vasqCallSite name = {__FILE__, __func__, format, __LINE__, VASQ_FILE_BASE_OFFSET, level, true, \
+                                VASQ_SITE_DEFAULT};                                                         \
+    _VASQ_REGISTER_SITE(name)
+
+/**
+ * @brief A patchable jump emitted by a logging macro when VASQ_STATIC_BRANCHES is defined.  These are
+ * collected in the vasq_jump_table section and shouldn't be accessed directly.
+ */
+typedef struct vasqJumpEntry {
+    uintptr_t code;           /**< The address of the jump instruction. */
+    uintptr_t target;         /**< The address to which the instruction jumps when enabled. */
+    const vasqCallSite *site; /**< The call site descriptor. */
+    uintptr_t enabled;        /**< Whether the instruction is currently a jump rather than a no-op. */
+} vasqJumpEntry;
+
+/**
+ * @brief Register the call sites and jump entries of a shared object (or the executable).  This is called
+ * automatically by a constructor.
+ *
+ * A call site is enabled if its state is VASQ_SITE_ENABLED or if its state is VASQ_SITE_DEFAULT and its
+ * level doesn't exceed the maximum level of every logger.  Whenever that changes, the site's enabled field
+ * is updated and its jump (if any) is rewritten.  A shared object whose call sites have been registered must
+ * not be unloaded.
+ *
+ * @param sites         The first call site pointer.
+ * @param sites_end     The end of the call site pointers.
+ * @param jumps         The first jump entry or NULL.
+ * @param jumps_end     The end of the jump entries or NULL.
+ */
+void
+vasqRegisterCallSites(vasqCallSite *const *sites, vasqCallSite *const *sites_end, vasqJumpEntry *jumps,
+                      vasqJumpEntry *jumps_end);
+
+/*
+    If VASQ_STATIC_BRANCHES is defined before this header is included, then each logging macro starts with
+    an instruction which either jumps to the code emitting the message or does nothing.  It's rewritten at
+    runtime so that a disabled call site costs a no-op instead of a load and a branch.  This is only
+    available on x86-64 and aarch64 Linux.  Elsewhere, the macro is ignored.
+*/
+#if defined(VASQ_STATIC_BRANCHES) && defined(_VASQ_SITE_SECTIONS) && defined(__linux__) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+
+#ifdef __x86_64__
+// A 5-byte jump which is aligned so that it can be rewritten by a single 8-byte store.
+#define _VASQ_JUMP_INSTRUCTION ".balign 8\n1: .byte 0xe9\n.long %l[_vasq_enabled] - 2f\n2:\n"
+#else
+#define _VASQ_JUMP_INSTRUCTION "1: b %l[_vasq_enabled]\n"
+#endif
+
+/**
+ * @brief Evaluates to true if the call site is enabled.  This is determined by whether the jump has been
+ * rewritten.
+ */
+#define _VASQ_SITE_ACTIVE(site)                                         \
+    ({                                                                  \
+        __label__ _vasq_enabled;                                        \
+        bool _vasq_active = false;                                      \
+        __asm__ goto(_VASQ_JUMP_INSTRUCTION                             \
+                     ".pushsection vasq_jump_table, \"aw\"\n"           \
+                     ".balign 8\n.quad 1b, %l[_vasq_enabled], %c0, 1\n" \
+                     ".popsection\n"                                    \
+                     :                                                  \
+                     : "i"(&(site))                                     \
+                     :                                                  \
+                     : _vasq_enabled);                                  \
+        if (0) {                                                        \
+        _vasq_enabled:                                                  \
+            _vasq_active = true;                                        \
+        }                                                               \
+        _vasq_active;                                                   \
+    })
+
+extern vasqJumpEntry __start_vasq_jump_table[] __attribute__((weak, visibility("hidden")));
+extern vasqJumpEntry __stop_vasq_jump_table[] __attribute__((weak, visibility("hidden")));
+
+#define _VASQ_JUMPS     __start_vasq_jump_table
+#define _VASQ_JUMPS_END __stop_vasq_jump_table
+
+#else  // VASQ_STATIC_BRANCHES
+
+/**
+ * @brief Evaluates to true if the call site is enabled.
+ */
+#define _VASQ_SITE_ACTIVE(site) __atomic_load_n(&(site).enabled, __ATOMIC_RELAXED)
+
+#define _VASQ_JUMPS     NULL
+#define _VASQ_JUMPS_END NULL
+
+#endif  // VASQ_STATIC_BRANCHES
+
+#ifdef _VASQ_SITE_SECTIONS
+
+extern vasqCallSite *const __start_vasq_call_sites[] __attribute__((weak, visibility("hidden")));
+extern vasqCallSite *const __stop_vasq_call_sites[] __attribute__((weak, visibility("hidden")));
+
+static void __attribute__((constructor))
+_vasqRegisterCallSites(void)
+{
+    vasqRegisterCallSites(__start_vasq_call_sites, __stop_vasq_call_sites, _VASQ_JUMPS, _VASQ_JUMPS_END);
+}
+
+#endif  // _VASQ_SITE_SECTIONS
+
+/**
+ * @brief Function type for visiting call sites.  See vasqCallSitesForEach.
+ *
+ * @param user  User-provided data.
+ * @param site  The call site descriptor.
+ */
+typedef void
+vasqCallSiteFunc(void *user, const vasqCallSite *site);
+
+/**
+ * @brief Call a function for each registered call site.
+ *
+ * @param func  The function to call.  It may call vasqCallSitesSetState.
+ * @param user  User-provided data passed to func.
+ */
+void
+vasqCallSitesForEach(vasqCallSiteFunc *func, void *user) VASQ_NONNULL(1);
+
+/**
+ * @brief Selects call sites.  A call site must match every criterion.
+ */
+typedef struct vasqCallSiteFilter {
+    const char *file;        /**< A glob (see fnmatch) matched against either the file name or its basename.
+                                  NULL matches every file. */
+    const char *function;    /**< A function name.  NULL matches every function. */
+    unsigned int first_line; /**< The first line to match. */
+    unsigned int last_line;  /**< The last line to match.  0 means no limit. */
+} vasqCallSiteFilter;
+
+/**
+ * @brief Set the state of the registered call sites matching a filter.
+ *
+ * This function can be called while other threads are logging.  Call sites registered afterward (i.e., by
+ * a shared object loaded later) aren't affected.
+ *
+ * @param filter    The filter.  If NULL, then every call site matches.
+ * @param state     The new state.
+ *
+ * @return          The number of matching call sites.
+ */
+size_t
+vasqCallSitesSetState(const vasqCallSiteFilter *filter, vasqSiteState state);
+
+/**
+ * @brief Create a control file through which vasqctl can change the levels of registered loggers and the
+ * states of call sites.  See vasq/control.h.
+ *
+ * The file is mapped into memory.  Changes made by vasqctl are noticed by vasqLevelEnabled and
+ * vasqCallSiteEnabled (and so by the next enabled logging statement) and applied then.  A process can only
+ * have one control file open at a time.
+ *
+ * @param path  The path of the file.  If it exists, it's overwritten.
+ *
+ * @return      0 if successful and -1 otherwise.  errno is set to EBUSY if a control file is already open.
+ */
+int
+vasqControlOpen(const char *path) VASQ_NONNULL(1);
+
+/**
+ * @brief Close the control file and unregister its loggers.  The file isn't removed.  Its page stays mapped
+ * until the process exits since other threads could still be reading it.
+ */
+void
+vasqControlClose(void);
+
+/**
+ * @brief Register a logger in the control file under its name.  The logger is unregistered when it's
+ * freed.
+ *
+ * @param logger    The logger handle.  It must have a name and not be a child logger.
+ *
+ * @return          0 if successful and -1 otherwise.  errno is set to EBADF if no control file is open,
+ * EINVAL if the logger has no name or is a child, and ENOSPC if VASQ_CONTROL_LOGGERS loggers are already
+ * registered.
+ */
+int
+vasqControlRegister(vasqLogger *logger);
+
+/**
+ * @brief Emit a logging message described by a call site.
+ *
+ * This function has no effect if either logger is NULL or the logger's maximum log level is VASQ_LL_NONE.
+ *
+ * @param logger    The logger handle.
+ * @param site      The call site descriptor.  Its format string corresponds to vasqSafeSnprintf's syntax.
+ */
+void
+vasqLogSite(vasqLogger *logger, const vasqCallSite *site, ...) VASQ_NONNULL(2);
+
+/**
+ * @brief Same as vasqLogSite but takes a va_list instead of variable arguments.
+ */
+void
+vasqVLogSite(vasqLogger *logger, const vasqCallSite *site, va_list args) VASQ_NONNULL(2);
+
+/**
+ * @brief The generation of the open control file (or a placeholder if none is open) and the last generation
+ * whose changes were applied.  These shouldn't be accessed directly.
+ */
+extern const uint32_t *_vasq_control_generation;
+extern uint32_t _vasq_control_seen;
+
+/**
+ * @brief Apply any changes which vasqctl has made to the control file.  This is called by the logging macros
+ * when the file's generation changes and by every message which is logged, so it rarely needs to be called
+ * directly.
+ */
+void
+vasqControlPoll(void);
+
+/*
+    Compares the control file's generation with the last one applied.  This reads the shared page directly
+    so that changes are noticed without a system call or a polling thread.
+*/
+static inline void
+_vasqControlCheck(void)
+{
+    const uint32_t *generation = __atomic_load_n(&_vasq_control_generation, __ATOMIC_RELAXED);
+
+    if (__builtin_expect(__atomic_load_n(generation, __ATOMIC_RELAXED) !=
+                             __atomic_load_n(&_vasq_control_seen, __ATOMIC_RELAXED),
+                         0)) {
+        vasqControlPoll();
+    }
+}
+
+/*
+    vasqLevelEnabled without the control file check.
+*/
+static inline bool
+_vasqLevelAdmits(const vasqLogger *logger, vasqLogLevel level)
+{
+    const vasqLoggerHead *root;
+
+    if (!logger) {
+        return false;
+    }
+    root = (const vasqLoggerHead *)((const vasqLoggerHead *)logger)->root;
+    return level <= __atomic_load_n(&root->level, __ATOMIC_RELAXED) &&
+           (level < __atomic_load_n(&root->sample_level, __ATOMIC_RELAXED) ||
+            _vasq_sample_hash <= __atomic_load_n(&root->sample_threshold, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Determine if a message of a given level would be emitted by a logger.
+ *
+ * This is inlined into the logging macros so that a disabled message costs a few loads and a branch and its
+ * arguments aren't evaluated.  It also applies any changes made to the control file (see vasqControlOpen).
+ *
+ * @param logger    The logger handle.
+ * @param level     The level of the message.
+ *
+ * @return          true if logger is not NULL, level does not exceed its maximum log level, and the message
+ * isn't dropped by sampling (see vasqSetLoggerSampling) and false otherwise.
+ */
+static inline bool
+vasqLevelEnabled(const vasqLogger *logger, vasqLogLevel level)
+{
+    _vasqControlCheck();
+    return _vasqLevelAdmits(logger, level);
+}
+
+/**
+ * @brief Determine if a message from a call site would be emitted by a logger.  This takes the site's state
+ * into account and, like vasqLevelEnabled, applies any changes made to the control file.
+ *
+ * @param logger    The logger handle.
+ * @param site      The call site descriptor.
+ *
+ * @return          true if the message would be emitted and false otherwise.
+ */
+static inline bool
+vasqCallSiteEnabled(const vasqLogger *logger, const vasqCallSite *site)
+{
+    _vasqControlCheck();
+    switch (__atomic_load_n(&site->state, __ATOMIC_RELAXED)) {
+    case VASQ_SITE_ENABLED: return logger != NULL;
+    case VASQ_SITE_DISABLED: return false;
+    default: return _vasqLevelAdmits(logger, site->level);
+    }
+}
+
+/**
+ * @brief Does nothing but allows the compiler to check the arguments of a call site's format string.
+ */
+static inline void VASQ_FORMAT(1)
+_vasqFormatCheck(const char *format, ...)
+{
+    (void)format;
+}
+
+/*
+    Whether a statement's level and format are compile-time constants.  This must only be evaluated in a
+    static initializer so that every use in a statement agrees (the optimizer might otherwise fold it
+    differently in different places).  The call site's initializer then names the level and format in the arm
+    of a conditional which isn't taken.  GCC accepts that even if they aren't constants but other compilers
+    (e.g., clang) might not, so they never use call sites from VASQ_LOG.
+*/
+#if defined(__GNUC__) && !defined(__clang__)
+#define _VASQ_CONSTANT(level, format)    (__builtin_constant_p(level) && __builtin_constant_p(format))
+#define _VASQ_SITE_LEVEL(level, format)  (_VASQ_CONSTANT(level, format) ? (level) : VASQ_LL_NONE)
+#define _VASQ_SITE_FORMAT(level, format) (_VASQ_CONSTANT(level, format) ? (format) : NULL)
+#else
+#define _VASQ_CONSTANT(level, format)    false
+#define _VASQ_SITE_LEVEL(level, format)  VASQ_LL_NONE
+#define _VASQ_SITE_FORMAT(level, format) NULL
+#endif
+
+/**
+ * @brief Emit a message at a given level.
+ *
+ * If the level and the format are compile-time constants, then the message goes through a static call site
+ * descriptor (see VASQ_CALL_SITE).  Otherwise, the call site's descriptor is left empty (and ignored by the
+ * library) and the message is emitted by vasqLogStatement.  Either way, this is an expression of type void.
+ * Compilers other than GCC always take the latter path.
+ *
+ * Nothing is emitted (or evaluated) if the level is more verbose than VASQ_MIN_LEVEL.
+ */
+#define VASQ_LOG(logger, level, format, ...)                                                                 \
+    ({                                                                                                       \
+        if (0) {                                                                                             \
+            _vasqFormatCheck(format, ##__VA_ARGS__);                                                         \
+        }                                                                                                    \
+        static const bool _vasq_constant = _VASQ_CONSTANT(level, format);                                    \
+        VASQ_CALL_SITE(_vasq_site, _VASQ_SITE_LEVEL(level, format), _VASQ_SITE_FORMAT(level, format));       \
+        if (!_vasq_constant) {                                                                               \
+            vasqLogLevel _vasq_level = (level);                                                              \
+            if (_vasq_level <= VASQ_MIN_LEVEL) {                                                             \
+                vasqLogger *_vasq_logger = (logger);                                                         \
+                if (vasqLevelEnabled(_vasq_logger, _vasq_level)) {                                           \
+                    vasqLogStatement(_vasq_logger, _vasq_level, VASQ_CONTEXT_PARAMS, format, ##__VA_ARGS__); \
+                }                                                                                            \
+            }                                                                                                \
+        }                                                                                                    \
+        else if ((level) <= VASQ_MIN_LEVEL && _VASQ_SITE_ACTIVE(_vasq_site)) {                               \
+            vasqLogger *_vasq_logger = (logger);                                                             \
+            if (vasqCallSiteEnabled(_vasq_logger, &_vasq_site)) {                                            \
+                vasqLogSite(_vasq_logger, &_vasq_site, ##__VA_ARGS__);                                       \
+            }                                                                                                \
+        }                                                                                                    \
+        (void)0;                                                                                             \
+    })
+
+/**
+ * @brief The type of a structured field's value.
+ */
+typedef enum vasqFieldType {
+    VASQ_FT_STRING, /**< A null-terminated string. */
+    VASQ_FT_INT,    /**< A signed integer. */
+    VASQ_FT_UINT,   /**< An unsigned integer. */
+    VASQ_FT_BOOL,   /**< A boolean. */
+} vasqFieldType;
+
+/**
+ * @brief A typed key-value pair attached to a message.  Use the VASQ_FIELD_* macros to create one.
+ */
+typedef struct vasqField {
+    const char *key;    /**< The field's key. */
+    vasqFieldType type; /**< The type of the field's value. */
+    union {
+        const char *string;
+        long long integer;
+        unsigned long long uinteger;
+        bool boolean;
+    } value; /**< The field's value. */
+} vasqField;
+
+#define VASQ_FIELD_STR(key, value)  ((vasqField){key, VASQ_FT_STRING, {.string = (value)}})
+#define VASQ_FIELD_INT(key, value)  ((vasqField){key, VASQ_FT_INT, {.integer = (value)}})
+#define VASQ_FIELD_UINT(key, value) ((vasqField){key, VASQ_FT_UINT, {.uinteger = (value)}})
+#define VASQ_FIELD_BOOL(key, value) ((vasqField){key, VASQ_FT_BOOL, {.boolean = (value)}})
+
+/**
+ * @brief Expands to an array of fields followed by its length.  E.g.,
+ *
+ *     VASQ_LOG_FIELDS(logger, VASQ_LL_INFO,
+ *                     VASQ_FIELDS(VASQ_FIELD_INT("shard", 3), VASQ_FIELD_STR("state", state)),
+ *                     "Shard changed state");
+ */
+#define VASQ_FIELDS(...) \
+    (const vasqField[]){__VA_ARGS__}, sizeof((const vasqField[]){__VA_ARGS__}) / sizeof(vasqField)
+
+/**
+ * @brief Emit a logging message with structured fields.
+ *
+ * The fields are emitted by the %C format token after the context fields.  In the JSON output mode (see
+ * VASQ_LOGGER_FLAG_JSON), they're always emitted.
+ *
+ * @param logger        The logger handle.
+ * @param site          The call site descriptor.  Its format string corresponds to vasqSafeSnprintf's syntax.
+ * @param fields        An array of fields.
+ * @param num_fields    The number of fields.
+ */
+void
+vasqLogFields(vasqLogger *logger, const vasqCallSite *site, const vasqField *fields, size_t num_fields, ...)
+    VASQ_NONNULL(2);
+
+/**
+ * @brief Same as vasqLogFields but takes a va_list instead of variable arguments.
+ */
+void
+vasqVLogFields(vasqLogger *logger, const vasqCallSite *site, const vasqField *fields, size_t num_fields,
+               va_list args) VASQ_NONNULL(2);
+
+/**
+ * @brief Emit a message with structured fields at a given level using a static call site descriptor.
+ *
+ * @param fields    The fields as created by VASQ_FIELDS.
+ */
+#define VASQ_LOG_FIELDS(logger, level, fields, format, ...)                          \
+    do {                                                                             \
+        if (0) {                                                                     \
+            _vasqFormatCheck(format, ##__VA_ARGS__);                                 \
+        }                                                                            \
+        if ((level) <= VASQ_MIN_LEVEL) {                                             \
+            VASQ_CALL_SITE(_vasq_site, level, format);                               \
+            if (_VASQ_SITE_ACTIVE(_vasq_site)) {                                     \
+                vasqLogger *_vasq_logger = (logger);                                 \
+                if (vasqCallSiteEnabled(_vasq_logger, &_vasq_site)) {                \
+                    vasqLogFields(_vasq_logger, &_vasq_site, fields, ##__VA_ARGS__); \
+                }                                                                    \
+            }                                                                        \
+        }                                                                            \
+    } while (0)
+
+/**
+ * @brief The per-call-site state of the throttled logging macros.  Its fields should not be accessed
+ * directly.
+ */
+typedef struct vasqThrottle {
+    uint64_t state;           /**< The number of occurrences or, if rate limited, the next arrival time. */
+    unsigned long suppressed; /**< The number of messages suppressed since the site last logged. */
+} vasqThrottle;
+
+/**
+ * @brief Admit only the first message.
+ *
+ * @param throttle  The call site's throttle.
+ *
+ * @return          true if the message should be emitted and false otherwise.
+ */
+static inline bool
+vasqThrottleOnce(vasqThrottle *throttle)
+{
+    return __atomic_load_n(&throttle->state, __ATOMIC_RELAXED) == 0 &&
+           __atomic_exchange_n(&throttle->state, 1, __ATOMIC_RELAXED) == 0;
+}
+
+/**
+ * @brief Admit the first message and every nth one after it.  A rejected message is counted as suppressed.
+ *
+ * @param throttle  The call site's throttle.
+ * @param n         The period.  0 and 1 admit every message.
+ *
+ * @return          true if the message should be emitted and false otherwise.
+ */
+static inline bool
+vasqThrottleEveryN(vasqThrottle *throttle, unsigned int n)
+{
+    if (n <= 1 || __atomic_fetch_add(&throttle->state, 1, __ATOMIC_RELAXED) % n == 0) {
+        return true;
+    }
+    __atomic_add_fetch(&throttle->suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+/**
+ * @brief Admit messages at a sustained rate with bursts up to a given size (i.e., a token bucket).  A
+ * rejected message is counted as suppressed.
+ *
+ * @param throttle  The call site's throttle.
+ * @param rate      The number of messages per second.  0 means no limit.
+ * @param burst     The number of messages which can be emitted at once after the site has been quiet.
+ *
+ * @return          true if the message should be emitted and false otherwise.
+ */
+bool
+vasqThrottleRate(vasqThrottle *throttle, unsigned int rate, unsigned int burst) VASQ_NONNULL(1);
+
+/**
+ * @brief Emit a message from a call site saying how many of its messages have been suppressed and reset the
+ * count.  This is called by the throttled logging macros before the site's next message.
+ *
+ * @param logger    The logger handle.
+ * @param site      The call site descriptor.
+ * @param throttle  The call site's throttle.
+ */
+void
+vasqLogSuppressed(vasqLogger *logger, const vasqCallSite *site, vasqThrottle *throttle) VASQ_NONNULL(2, 3);
+
+/*
+    admit is evaluated (after the call site's level and state are checked) to decide whether the message is
+    emitted.  It can refer to the site's throttle as _vasq_throttle.
+*/
+#define _VASQ_LOG_THROTTLED(logger, level, admit, format, ...)                                \
+    do {                                                                                      \
+        if (0) {                                                                              \
+            _vasqFormatCheck(format, ##__VA_ARGS__);                                          \
+        }                                                                                     \
+        if ((level) <= VASQ_MIN_LEVEL) {                                                      \
+            VASQ_CALL_SITE(_vasq_site, level, format);                                        \
+            static vasqThrottle _vasq_throttle;                                               \
+            if (_VASQ_SITE_ACTIVE(_vasq_site)) {                                              \
+                vasqLogger *_vasq_logger = (logger);                                          \
+                if (vasqCallSiteEnabled(_vasq_logger, &_vasq_site) && (admit)) {              \
+                    if (__atomic_load_n(&_vasq_throttle.suppressed, __ATOMIC_RELAXED) > 0) {  \
+                        vasqLogSuppressed(_vasq_logger, &_vasq_site, &_vasq_throttle);        \
+                    }                                                                         \
+                    vasqLogSite(_vasq_logger, &_vasq_site, ##__VA_ARGS__);                    \
+                }                                                                             \
+            }                                                                                 \
+        }                                                                                     \
+    } while (0)
+
+/**
+ * @brief Emit a message only the first time that the call site is reached with the level enabled.
+ */
+#define VASQ_LOG_ONCE(logger, level, format, ...) \
+    _VASQ_LOG_THROTTLED(logger, level, vasqThrottleOnce(&_vasq_throttle), format, ##__VA_ARGS__)
+
+/**
+ * @brief Emit a message the first time that the call site is reached with the level enabled and every nth
+ * time after that.  Each message after the first is preceded by a message giving the number suppressed.
+ */
+#define VASQ_LOG_EVERY_N(logger, level, n, format, ...) \
+    _VASQ_LOG_THROTTLED(logger, level, vasqThrottleEveryN(&_vasq_throttle, n), format, ##__VA_ARGS__)
+
+/**
+ * @brief Emit at most rate messages per second from the call site with bursts of up to burst messages.  The
+ * next message emitted after some have been suppressed is preceded by a message giving their number.
+ */
+#define VASQ_LOG_RATE_LIMITED(logger, level, rate, burst, format, ...) \
+    _VASQ_LOG_THROTTLED(logger, level, vasqThrottleRate(&_vasq_throttle, rate, burst), format, ##__VA_ARGS__)
+
 /**
  * @brief Emit a message at the ALWAYS level.
  */
-#define VASQ_ALWAYS(logger, format, ...) \
-    vasqLogStatement(logger, VASQ_LL_ALWAYS, VASQ_CONTEXT_PARAMS, format, ##__VA_ARGS__)
+#define VASQ_ALWAYS(logger, format, ...) VASQ_LOG(logger, VASQ_LL_ALWAYS, format, ##__VA_ARGS__)
 
 /**
  * @brief Emit a message at the CRITICAL level.
  */
-#define VASQ_CRITICAL(logger, format, ...) \
-    vasqLogStatement(logger, VASQ_LL_CRITICAL, VASQ_CONTEXT_PARAMS, format, ##__VA_ARGS__)
+#define VASQ_CRITICAL(logger, format, ...) VASQ_LOG(logger, VASQ_LL_CRITICAL, format, ##__VA_ARGS__)
 
 /**
  * @brief Emit a message at the ERROR level.
  */
-#define VASQ_ERROR(logger, format, ...) \
-    vasqLogStatement(logger, VASQ_LL_ERROR, VASQ_CONTEXT_PARAMS, format, ##__VA_ARGS__)
+#define VASQ_ERROR(logger, format, ...) VASQ_LOG(logger, VASQ_LL_ERROR, format, ##__VA_ARGS__)
 
 /**
  * @brief Emit a message at the WARNING level.
  */
-#define VASQ_WARNING(logger, format, ...) \
-    vasqLogStatement(logger, VASQ_LL_WARNING, VASQ_CONTEXT_PARAMS, format, ##__VA_ARGS__)
+#define VASQ_WARNING(logger, format, ...) VASQ_LOG(logger, VASQ_LL_WARNING, format, ##__VA_ARGS__)
 
 /**
  * @brief Emit a message at the INFO level.
  */
-#define VASQ_INFO(logger, format, ...) \
-    vasqLogStatement(logger, VASQ_LL_INFO, VASQ_CONTEXT_PARAMS, format, ##__VA_ARGS__)
+#define VASQ_INFO(logger, format, ...) VASQ_LOG(logger, VASQ_LL_INFO, format, ##__VA_ARGS__)
 
 /**
  * @brief Emit a message at the DEBUG level.
  */
-#define VASQ_DEBUG(logger, format, ...) \
-    vasqLogStatement(logger, VASQ_LL_DEBUG, VASQ_CONTEXT_PARAMS, format, ##__VA_ARGS__)
+#define VASQ_DEBUG(logger, format, ...) VASQ_LOG(logger, VASQ_LL_DEBUG, format, ##__VA_ARGS__)
+
+/**
+ * @brief Emit a message at the TRACE level.
+ */
+#define VASQ_TRACE(logger, format, ...) VASQ_LOG(logger, VASQ_LL_TRACE, format, ##__VA_ARGS__)
 
 /**
  * @brief Logging equivalent of the perror function at the CRITICAL level.
@@ -296,8 +1431,101 @@ vasqHexDump(vasqLogger *logger, const char *file_name, const char *function_name
 
 /**
  * @brief Wrap vasqHexDump by automatically supplying the file name, function name, and line number.
+ *
+ * Nothing is emitted (or evaluated) if the DEBUG level is more verbose than VASQ_MIN_LEVEL.
+ */
+#define VASQ_HEXDUMP(logger, name, data, size)                               \
+    (((VASQ_LL_DEBUG) <= VASQ_MIN_LEVEL) ?                                   \
+         vasqHexDump(logger, VASQ_CONTEXT_PARAMS, name, data, size) : NO_OP)
+
+/**
+ * @brief Assembles a message from multiple pieces directly in the output buffer.  Its fields should not be
+ * accessed directly.
+ */
+typedef struct vasqLogBuilder {
+    vasqLogger *logger; /**< NULL if the message won't be emitted. */
+    vasqCallSite site;  /**< The origin of the message. */
+    char *buffer;       /**< The output buffer. */
+    char *message;      /**< The start of the appended pieces. */
+    char *dst;          /**< The current end of the message. */
+    size_t remaining;   /**< The remaining capacity of the buffer. */
+} vasqLogBuilder;
+
+/**
+ * @brief Start building a message.  Everything in the logger's format preceding %M is rendered immediately.
+ * The pieces appended afterward take the place of %M.  If the format has no %M, then they're appended to the
+ * end.
+ *
+ * If logger is NULL or the level isn't enabled, then the pieces are discarded and vasqLogBuilderCommit does
+ * nothing.  Otherwise, the builder holds the calling thread's output buffer until vasqLogBuilderCommit is
+ * called so every successful call to this function must be followed by a call to vasqLogBuilderCommit.  The
+ * message is limited to the logger's max_message_size even if VASQ_LOGGER_FLAG_SPILL is set.
+ *
+ * @param builder           The builder to be initialized.
+ * @param logger            The logger handle.
+ * @param level             The level of the message.
+ * @param file_name         The name of the file where the message originated.
+ * @param function_name     The name of the function where the message originated.
+ * @param line_no           The line number where the message originated.
+ *
+ * @return                  true if the message will be emitted and false otherwise.
+ */
+bool
+vasqLogBuilderBegin(vasqLogBuilder *builder, vasqLogger *logger, vasqLogLevel level, const char *file_name,
+                    const char *function_name, unsigned int line_no) VASQ_NONNULL(1, 4, 5);
+
+/**
+ * @brief Wrap vasqLogBuilderBegin by automatically supplying the file name, function name, and line number.
+ * If the level is more verbose than VASQ_MIN_LEVEL, then the builder is disabled.
+ */
+#define VASQ_LOG_BUILDER_BEGIN(builder, logger, level) \
+    vasqLogBuilderBegin(builder, ((level) <= VASQ_MIN_LEVEL) ? (logger) : NULL, level, VASQ_CONTEXT_PARAMS)
+
+/**
+ * @brief Append text to a message.
+ *
+ * @param builder   The builder.
+ * @param text      The text to append.
+ * @param length    The number of characters to append.
  */
-#define VASQ_HEXDUMP(logger, name, data, size) vasqHexDump(logger, VASQ_CONTEXT_PARAMS, name, data, size)
+void
+vasqLogBuilderAppend(vasqLogBuilder *builder, const char *text, size_t length) VASQ_NONNULL(1, 2);
+
+/**
+ * @brief Append a null-terminated string to a message.
+ */
+void
+vasqLogBuilderString(vasqLogBuilder *builder, const char *string) VASQ_NONNULL(1, 2);
+
+/**
+ * @brief Append a signed integer in decimal to a message.
+ */
+void
+vasqLogBuilderInt(vasqLogBuilder *builder, long long value) VASQ_NONNULL(1);
+
+/**
+ * @brief Append an unsigned integer in decimal to a message.
+ */
+void
+vasqLogBuilderUint(vasqLogBuilder *builder, unsigned long long value) VASQ_NONNULL(1);
+
+/**
+ * @brief Append binary data to a message as pairs of hex digits.
+ *
+ * @param builder   The builder.
+ * @param data      A pointer to the data.
+ * @param size      The number of bytes to append.
+ */
+void
+vasqLogBuilderHex(vasqLogBuilder *builder, const void *data, size_t size) VASQ_NONNULL(1, 2);
+
+/**
+ * @brief Render the rest of the logger's format and send the message to the handler.
+ *
+ * @param builder   The builder.
+ */
+void
+vasqLogBuilderCommit(vasqLogBuilder *builder) VASQ_NONNULL(1);
 
 #ifdef DEBUG
 
@@ -335,21 +1563,68 @@ extern bool _vasq_abort_caught;
 
 #else  // VASQ_NO_LOGGING
 
-#define vasqLogStatement(...)  NO_OP
-#define vasqVLogStatement(...) NO_OP
-#define VASQ_ALWAYS(...)       NO_OP
-#define VASQ_CRITICAL(...)     NO_OP
-#define VASQ_ERROR(...)        NO_OP
-#define VASQ_WARNING(...)      NO_OP
-#define VASQ_INFO(...)         NO_OP
-#define VASQ_DEBUG(...)        NO_OP
-#define VASQ_PCRITICAL(...)    NO_OP
-#define VASQ_PERROR(...)       NO_OP
-#define VASQ_PWARNING(...)     NO_OP
-#define vasqRawLog(...)        NO_OP
-#define vasqVRawLog(...)       NO_OP
-#define vasqHexDump(...)       NO_OP
-#define VASQ_HEXDUMP(...)      NO_OP
-#define VASQ_ASSERT(...)       NO_OP
-
+#define vasqAsyncHandlerCreate(...)       0
+#define vasqAsyncHandlerFlush(...)        0
+#define vasqAsyncHandlerStats(...)        (-1)
+#define vasqLoggerBumpDataGeneration(...) NO_OP
+#define vasqSetLoggerSampling(...)        0
+#define vasqSetLoggerBudget(...)          0
+#define vasqLoggerBudgetStats(...)        (-1)
+#define vasqSetLoggerTail(...)            0
+#define vasqChildLoggerInit(...)          NULL
+#define vasqContextPush(...)              0
+#define vasqContextPop()                  NO_OP
+#define vasqContextClear()                NO_OP
+#define vasqRefreshTimeZone()             NO_OP
+#define vasqRegisterCallSites(...)        NO_OP
+#define vasqCallSitesForEach(...)         NO_OP
+#define vasqCallSitesSetState(...)        0
+#define vasqControlOpen(...)              0
+#define vasqControlClose()                NO_OP
+#define vasqControlRegister(...)          0
+#define vasqControlPoll()                 NO_OP
+#define vasqSetSamplingKey(...)           NO_OP
+#define vasqTailStart()                   NO_OP
+#define vasqTailFlush()                   NO_OP
+#define vasqTailStop()                    NO_OP
+#define vasqLogStatement(...)             NO_OP
+#define vasqVLogStatement(...)            NO_OP
+#define vasqLevelEnabled(...)             false
+#define vasqCallSiteEnabled(...)          false
+#define vasqLogSite(...)                  NO_OP
+#define vasqVLogSite(...)                 NO_OP
+#define VASQ_LOG(...)                     NO_OP
+#define vasqLogFields(...)                NO_OP
+#define vasqVLogFields(...)               NO_OP
+#define VASQ_LOG_FIELDS(...)              NO_OP
+#define vasqThrottleOnce(...)             false
+#define vasqThrottleEveryN(...)           false
+#define vasqThrottleRate(...)             false
+#define vasqLogSuppressed(...)            NO_OP
+#define VASQ_LOG_ONCE(...)                NO_OP
+#define VASQ_LOG_EVERY_N(...)             NO_OP
+#define VASQ_LOG_RATE_LIMITED(...)        NO_OP
+#define VASQ_ALWAYS(...)                  NO_OP
+#define VASQ_CRITICAL(...)                NO_OP
+#define VASQ_ERROR(...)                   NO_OP
+#define VASQ_WARNING(...)                 NO_OP
+#define VASQ_INFO(...)                    NO_OP
+#define VASQ_DEBUG(...)                   NO_OP
+#define VASQ_TRACE(...)                   NO_OP
+#define VASQ_PCRITICAL(...)               NO_OP
+#define VASQ_PERROR(...)                  NO_OP
+#define VASQ_PWARNING(...)                NO_OP
+#define vasqRawLog(...)                   NO_OP
+#define vasqVRawLog(...)                  NO_OP
+#define vasqHexDump(...)                  NO_OP
+#define VASQ_HEXDUMP(...)                 NO_OP
+#define vasqLogBuilderBegin(...)          false
+#define VASQ_LOG_BUILDER_BEGIN(...)       false
+#define vasqLogBuilderAppend(...)         NO_OP
+#define vasqLogBuilderString(...)         NO_OP
+#define vasqLogBuilderInt(...)            NO_OP
+#define vasqLogBuilderUint(...)           NO_OP
+#define vasqLogBuilderHex(...)            NO_OP
+#define vasqLogBuilderCommit(...)         NO_OP
+#define VASQ_ASSERT(...)                  NO_OP
 #endif  // VASQ_NO_LOGGING
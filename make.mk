@@ -32,7 +32,7 @@ endif
 
 $(VASQ_SHARED_LIBRARY): $(VASQ_OBJECT_FILES)
 	@mkdir -p $(@D)
-	$(CC) $(LDFLAGS) -shared -o $@ $^
+	$(CC) $(LDFLAGS) -pthread -shared -o $@ $^
 
 $(VASQ_STATIC_LIBRARY): $(VASQ_OBJECT_FILES)
 	@mkdir -p $(@D)
@@ -0,0 +1,773 @@
+#ifndef VASQ_NO_LOGGING
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+#include "vasq/config.h"
+#include "vasq/safe_snprintf.h"
+
+#define SLOT_SIZE   64
+#define SKIP_RECORD SIZE_MAX /* The length of a record which pads the ring to its end. */
+
+// With VASQ_ASYNC_FLAG_PRIORITY_LANE, the ALWAYS, CRITICAL, and ERROR messages go to the priority lane.
+#define MAX_LANES     2
+#define PRIORITY_LANE 0
+#define NORMAL_LANE   1
+
+#define NANOSECONDS_PER_SECOND      1000000000L
+#define NANOSECONDS_PER_MILLISECOND 1000000L
+#define IDLE_WAIT                   100000000L /* An idle writer rechecks the ring every 100 ms. */
+
+/*
+    A message occupies one or more consecutive slots of a ring.  Its text is stored in the slots' part of
+    data and its header in the first slot's record.  A message never wraps around the end of the ring:  if it
+    would, then the remaining slots are taken by a record which is skipped.
+*/
+typedef struct asyncRecord {
+    vasqLogLevel level;
+    unsigned int num_slots;
+    size_t length;
+} asyncRecord;
+
+/*
+    A ring is a bounded multi-producer queue in the manner of Vyukov's.  sequences[k] is the position for
+    which slot k is free or, if it's position + 1, the position whose message has been committed to it.
+    Producers reserve slots by checking that they're free and then advancing head with a compare-and-swap.
+    Records are claimed by advancing tail with a compare-and-swap and their slots are freed once they've been
+    handled.  Only the writer thread claims records in order to write them but, under VASQ_ASYNC_DROP_OLDEST,
+    producers claim records in order to discard them.  Slots can therefore be freed out of order.  Under that
+    policy, the writer also copies a message into scratch and frees its slots before passing it to the
+    wrapped handler.  Otherwise, the slots of the message being written would block the ring.
+
+    Every message before finished has been written or discarded.
+*/
+typedef struct asyncRing {
+    uint64_t *sequences;
+    asyncRecord *records;
+    char *data;
+    uint64_t mask;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t finished;
+} asyncRing;
+
+/*
+    Each lane is a separate ring.  The writer always empties the lanes in order, so a message in the priority
+    lane never waits behind the ones in the other lane.
+*/
+typedef struct asyncState {
+    vasqHandler handler;
+    asyncRing lanes[MAX_LANES];
+    unsigned int num_lanes;
+    char *scratch;
+    vasqAsyncOptions options;
+    unsigned long written;
+    unsigned long dropped;
+    unsigned long long dropped_bytes;
+    unsigned long dropped_messages_by_level[VASQ_LL_TRACE + 1];
+    unsigned long long dropped_bytes_by_level[VASQ_LL_TRACE + 1];
+    unsigned long reported;            /* The value of dropped when drops were last reported. */
+    unsigned long long reported_bytes; /* The value of dropped_bytes when drops were last reported. */
+    unsigned int fork_generation;
+    unsigned int waiters;
+    bool sleeping;
+    bool stopping;
+    struct timespec deadline;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;     /* Signaled to wake the writer. */
+    pthread_cond_t progress; /* Broadcast to waiters when slots are freed. */
+    pthread_t thread;
+} asyncState;
+
+static void
+asyncWrite(void *user, vasqLogLevel level, const char *text, size_t size);
+
+static bool
+inChild(const asyncState *state)
+{
+    return vasqForkGeneration() != state->fork_generation;
+}
+
+static void
+deadlineAfter(struct timespec *deadline, long nanoseconds)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += nanoseconds / NANOSECONDS_PER_SECOND;
+    deadline->tv_nsec += nanoseconds % NANOSECONDS_PER_SECOND;
+    if (deadline->tv_nsec >= NANOSECONDS_PER_SECOND) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= NANOSECONDS_PER_SECOND;
+    }
+}
+
+static bool
+pastDeadline(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec ||
+           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/*
+    Wakes the writer if it's asleep.  The fence pairs with the one in writerSleep so that either the writer
+    sees the committed message or the producer sees that the writer is sleeping.
+*/
+static void
+wakeWriter(asyncState *state)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&state->sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&state->lock);
+        pthread_cond_signal(&state->wake);
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+/*
+    Wakes the threads waiting for room or for a flush.  The fence pairs with the ones in reserveBlocking and
+    vasqAsyncHandlerFlush.
+*/
+static void
+notifyWaiters(asyncState *state)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&state->waiters, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&state->lock);
+        pthread_cond_broadcast(&state->progress);
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+static void
+countDrop(asyncState *state, vasqLogLevel level, size_t size)
+{
+    if (level == VASQ_LL_NONE) {  // A raw message.
+        level = VASQ_LL_ALWAYS;
+    }
+    __atomic_add_fetch(&state->dropped_messages_by_level[level], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&state->dropped_bytes_by_level[level], size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&state->dropped_bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&state->dropped, 1, __ATOMIC_RELEASE);
+}
+
+/*
+    A message which is too big for the priority lane goes to the normal lane rather than being dropped.  So do
+    raw messages, whose level is VASQ_LL_NONE.
+*/
+static asyncRing *
+laneOf(asyncState *state, vasqLogLevel level, uint64_t num_slots)
+{
+    if (state->num_lanes > 1 && (level == VASQ_LL_NONE || level > VASQ_LL_ERROR ||
+                                 num_slots > state->lanes[PRIORITY_LANE].mask + 1)) {
+        return &state->lanes[NORMAL_LANE];
+    }
+    return &state->lanes[PRIORITY_LANE];
+}
+
+static void
+freeSlots(asyncRing *ring, uint64_t position, unsigned int num_slots)
+{
+    for (unsigned int k = 0; k < num_slots; k++) {
+        __atomic_store_n(&ring->sequences[(position + k) & ring->mask], position + k + ring->mask + 1,
+                         __ATOMIC_RELEASE);
+    }
+}
+
+/*
+    Tries to claim the oldest record.  Returns false if there's nothing to claim.  Otherwise, *claimed is set
+    to whether this thread (rather than another one) claimed it.
+*/
+static bool
+claimOldest(asyncRing *ring, uint64_t *position, asyncRecord *record, bool *claimed)
+{
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE), index = tail & ring->mask;
+
+    *claimed = false;
+    if (__atomic_load_n(&ring->sequences[index], __ATOMIC_ACQUIRE) != tail + 1) {
+        // The ring is empty, the oldest message hasn't been committed yet, or tail has moved on.
+        return tail != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    }
+
+    // The record can't change until it's been claimed, which the compare-and-swap would detect.
+    *record = ring->records[index];
+    if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + record->num_slots, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+        *position = tail;
+        *claimed = true;
+    }
+    return true;
+}
+
+/*
+    Discards the oldest record of a ring to make room.  Returns false if there's nothing which can be
+    discarded.
+*/
+static bool
+discardOldest(asyncState *state, asyncRing *ring)
+{
+    bool claimed;
+    uint64_t position;
+    asyncRecord record;
+
+    if (!claimOldest(ring, &position, &record, &claimed)) {
+        return false;
+    }
+    if (claimed) {
+        if (record.length != SKIP_RECORD) {
+            countDrop(state, record.level, record.length);
+        }
+        freeSlots(ring, position, record.num_slots);
+        notifyWaiters(state);
+    }
+    return true;
+}
+
+static void
+commit(asyncRing *ring, uint64_t position, vasqLogLevel level, unsigned int num_slots, const char *text,
+       size_t length)
+{
+    uint64_t index = position & ring->mask;
+
+    if (length != SKIP_RECORD) {
+        memcpy(ring->data + index * SLOT_SIZE, text, length);
+        ring->data[index * SLOT_SIZE + length] = '\0';
+    }
+    ring->records[index].level = level;
+    ring->records[index].num_slots = num_slots;
+    ring->records[index].length = length;
+    __atomic_store_n(&ring->sequences[index], position + 1, __ATOMIC_RELEASE);
+}
+
+/*
+    Reserves num_slots consecutive slots as well as any padding needed to reach them.  Returns false if the
+    ring is full, in which case *position is set to the position of the message in the way.
+*/
+static bool
+reserve(asyncRing *ring, uint64_t num_slots, uint64_t *position, uint64_t *padding)
+{
+    uint64_t capacity = ring->mask + 1;
+
+    *position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    while (true) {
+        uint64_t offset = *position & ring->mask, last;
+        int64_t diff = 0;
+
+        *padding = (offset + num_slots > capacity) ? capacity - offset : 0;
+        last = *position + *padding + num_slots - 1;
+        // Since slots can be freed out of order, each one has to be checked.
+        for (uint64_t p = *position; p <= last; p++) {
+            diff = __atomic_load_n(&ring->sequences[p & ring->mask], __ATOMIC_ACQUIRE) - p;
+            if (diff != 0) {
+                if (diff < 0) {
+                    *position = p - capacity;
+                }
+                break;
+            }
+        }
+
+        if (diff < 0) {
+            return false;
+        }
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, position, last + 1, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                return true;
+            }
+        }
+        else {
+            *position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+    Like reserve but waits up to block_timeout milliseconds for the writer to free slots.
+*/
+static bool
+reserveBlocking(asyncState *state, asyncRing *ring, uint64_t num_slots, uint64_t *position, uint64_t *padding)
+{
+    bool success;
+    struct timespec deadline;
+
+    deadlineAfter(&deadline, (long)state->options.block_timeout * NANOSECONDS_PER_MILLISECOND);
+
+    pthread_mutex_lock(&state->lock);
+    __atomic_add_fetch(&state->waiters, 1, __ATOMIC_RELAXED);
+    while (true) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        success = reserve(ring, num_slots, position, padding);
+        if (success) {
+            break;
+        }
+        pthread_cond_signal(&state->wake);
+        if (pthread_cond_timedwait(&state->progress, &state->lock, &deadline) == ETIMEDOUT) {
+            success = reserve(ring, num_slots, position, padding);
+            break;
+        }
+    }
+    __atomic_sub_fetch(&state->waiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&state->lock);
+
+    return success;
+}
+
+static void
+asyncWrite(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    bool success;
+    asyncState *state = user;
+    asyncRing *ring;
+    uint64_t num_slots, padding, position;
+
+    if (inChild(state)) {
+        // The writer thread didn't survive the fork.
+        state->handler.func(state->handler.user, level, text, size);
+        return;
+    }
+
+    if ((state->options.flags & VASQ_ASYNC_FLAG_SYNC_CRITICAL) && level != VASQ_LL_NONE &&
+        level <= VASQ_LL_CRITICAL) {
+        state->handler.func(state->handler.user, level, text, size);
+        __atomic_add_fetch(&state->written, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    num_slots = (size + 1 + SLOT_SIZE - 1) / SLOT_SIZE;  // Including the null terminator.
+    ring = laneOf(state, level, num_slots);
+    if (num_slots > ring->mask + 1) {
+        goto drop;
+    }
+
+    success = reserve(ring, num_slots, &position, &padding);
+    if (!success) {
+        switch (state->options.policy) {
+        case VASQ_ASYNC_DROP_OLDEST:
+            // Discarding messages only helps if the one in the way hasn't been claimed yet.
+            while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) <= position && discardOldest(state, ring)) {
+                success = reserve(ring, num_slots, &position, &padding);
+                if (success) {
+                    break;
+                }
+            }
+            break;
+
+        case VASQ_ASYNC_DROP_VERBOSE:
+            if (level > state->options.drop_level) {
+                break;
+            }
+            // fall through
+
+        case VASQ_ASYNC_BLOCK: success = reserveBlocking(state, ring, num_slots, &position, &padding); break;
+
+        default: break;
+        }
+
+        if (!success) {
+            goto drop;
+        }
+    }
+
+    if (padding > 0) {
+        commit(ring, position, level, padding, NULL, SKIP_RECORD);
+        position += padding;
+    }
+    commit(ring, position, level, num_slots, text, size);
+    wakeWriter(state);
+    return;
+
+drop:
+    countDrop(state, level, size);
+}
+
+/*
+    Tells the wrapped handler how many messages have been dropped since the last report.
+*/
+static void
+reportDrops(asyncState *state)
+{
+    unsigned long dropped = __atomic_load_n(&state->dropped, __ATOMIC_ACQUIRE), count;
+    unsigned long long dropped_bytes;
+    ssize_t length;
+    char text[100];
+
+    if (dropped == state->reported) {
+        return;
+    }
+    dropped_bytes = __atomic_load_n(&state->dropped_bytes, __ATOMIC_RELAXED);
+    count = dropped - state->reported;
+
+    length = vasqSafeSnprintf(text, sizeof(text), "%lu message%s (%llu bytes) dropped\n", count,
+                              (count == 1) ? "" : "s", dropped_bytes - state->reported_bytes);
+    state->reported_bytes = dropped_bytes;
+    __atomic_store_n(&state->reported, dropped, __ATOMIC_RELEASE);
+    if (length > 0) {
+        state->handler.func(state->handler.user, VASQ_LL_WARNING, text, length);
+    }
+}
+
+/*
+    Waits for a message to be committed.  Returns false if the writer should exit.
+*/
+static bool
+writerSleep(asyncState *state)
+{
+    bool keep_going = true, empty = true, committed = false;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&state->lock);
+
+    __atomic_store_n(&state->sleeping, true, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (unsigned int k = 0; k < state->num_lanes; k++) {
+        const asyncRing *ring = &state->lanes[k];
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+        if (tail != __atomic_load_n(&ring->head, __ATOMIC_RELAXED)) {
+            empty = false;
+        }
+        if (__atomic_load_n(&ring->sequences[tail & ring->mask], __ATOMIC_RELAXED) == tail + 1) {
+            committed = true;
+        }
+    }
+
+    if (state->stopping && (empty || pastDeadline(&state->deadline))) {
+        keep_going = false;
+    }
+    else if (!committed) {
+        // A message reserved but not yet committed doesn't wake the writer so the wait is bounded.
+        deadlineAfter(&deadline, state->stopping ? IDLE_WAIT / 100 : IDLE_WAIT);
+        pthread_cond_timedwait(&state->wake, &state->lock, &deadline);
+    }
+    __atomic_store_n(&state->sleeping, false, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&state->lock);
+    return keep_going;
+}
+
+/*
+    Claims the oldest record of the first lane which has one.  Returns false if there's nothing to claim.
+*/
+static bool
+claimNext(asyncState *state, asyncRing **ring, uint64_t *position, asyncRecord *record)
+{
+    for (unsigned int k = 0; k < state->num_lanes; k++) {
+        bool claimed;
+
+        while (claimOldest(&state->lanes[k], position, record, &claimed)) {
+            if (claimed) {
+                *ring = &state->lanes[k];
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+    Counts every committed record which hasn't been written as dropped once the drain timeout has passed.
+*/
+static void
+discardRemaining(asyncState *state)
+{
+    uint64_t position;
+    asyncRing *ring;
+    asyncRecord record;
+
+    while (claimNext(state, &ring, &position, &record)) {
+        if (record.length != SKIP_RECORD) {
+            countDrop(state, record.level, record.length);
+        }
+        freeSlots(ring, position, record.num_slots);
+        __atomic_store_n(&ring->finished, position + record.num_slots, __ATOMIC_RELEASE);
+    }
+    reportDrops(state);
+}
+
+static void *
+writerThread(void *arg)
+{
+    asyncState *state = arg;
+
+    while (true) {
+        uint64_t position;
+        asyncRing *ring;
+        asyncRecord record;
+
+        // A slow handler mustn't hold up vasqLoggerFree past the drain timeout.
+        if (__atomic_load_n(&state->stopping, __ATOMIC_ACQUIRE) && pastDeadline(&state->deadline)) {
+            discardRemaining(state);
+            break;
+        }
+
+        if (!claimNext(state, &ring, &position, &record)) {
+            // The writer has caught up.
+            reportDrops(state);
+            for (unsigned int k = 0; k < state->num_lanes; k++) {
+                __atomic_store_n(&state->lanes[k].finished,
+                                 __atomic_load_n(&state->lanes[k].tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+            }
+            notifyWaiters(state);
+            if (!writerSleep(state)) {
+                break;
+            }
+            continue;
+        }
+
+        if (record.length != SKIP_RECORD) {
+            const char *text = ring->data + (position & ring->mask) * SLOT_SIZE;
+
+            if (state->scratch) {
+                memcpy(state->scratch, text, record.length + 1);
+                freeSlots(ring, position, record.num_slots);
+                notifyWaiters(state);
+                text = state->scratch;
+            }
+            state->handler.func(state->handler.user, record.level, text, record.length);
+            __atomic_add_fetch(&state->written, 1, __ATOMIC_RELAXED);
+        }
+        if (!state->scratch || record.length == SKIP_RECORD) {
+            freeSlots(ring, position, record.num_slots);
+        }
+        __atomic_store_n(&ring->finished, position + record.num_slots, __ATOMIC_RELEASE);
+        notifyWaiters(state);
+    }
+
+    return NULL;
+}
+
+static int
+ringInit(asyncRing *ring, size_t size)
+{
+    uint64_t capacity = 2;
+
+    while (capacity * 2 * SLOT_SIZE <= size) {
+        capacity *= 2;
+    }
+
+    ring->sequences = malloc(capacity * sizeof(*ring->sequences));
+    ring->records = malloc(capacity * sizeof(*ring->records));
+    ring->data = malloc(capacity * SLOT_SIZE);
+    if (!ring->sequences || !ring->records || !ring->data) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (uint64_t k = 0; k < capacity; k++) {
+        ring->sequences[k] = k;
+    }
+    ring->mask = capacity - 1;
+    return 0;
+}
+
+static void
+freeState(asyncState *state)
+{
+    for (unsigned int k = 0; k < MAX_LANES; k++) {
+        free(state->lanes[k].sequences);
+        free(state->lanes[k].records);
+        free(state->lanes[k].data);
+    }
+    free(state->scratch);
+    free(state);
+}
+
+static void
+asyncCleanup(void *user)
+{
+    asyncState *state = user;
+
+    if (!inChild(state)) {
+        pthread_mutex_lock(&state->lock);
+        deadlineAfter(&state->deadline, VASQ_ASYNC_DRAIN_TIMEOUT * NANOSECONDS_PER_MILLISECOND);
+        // The writer checks this without the lock so the deadline is published with it.
+        __atomic_store_n(&state->stopping, true, __ATOMIC_RELEASE);
+        pthread_cond_signal(&state->wake);
+        pthread_mutex_unlock(&state->lock);
+        pthread_join(state->thread, NULL);
+
+        pthread_cond_destroy(&state->progress);
+        pthread_cond_destroy(&state->wake);
+        pthread_mutex_destroy(&state->lock);
+    }
+
+    if (state->handler.cleanup) {
+        state->handler.cleanup(state->handler.user);
+    }
+    freeState(state);
+}
+
+static asyncState *
+getState(const vasqHandler *async)
+{
+    if (!async || async->func != asyncWrite) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return async->user;
+}
+
+int
+vasqAsyncHandlerCreate(const vasqHandler *handler, const vasqAsyncOptions *options, vasqHandler *async)
+{
+    int ret;
+    size_t lane_size;
+    asyncState *state;
+    pthread_condattr_t attr;
+    sigset_t blocked, old_signals;
+    vasqAsyncOptions default_options = {0};
+
+    if (!handler || !handler->func || !async) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!options) {
+        options = &default_options;
+    }
+    else if ((unsigned int)options->policy > VASQ_ASYNC_DROP_VERBOSE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    vasqProcessInit();
+
+    state = calloc(1, sizeof(*state));
+    if (!state) {
+        return -1;
+    }
+    state->options = *options;
+    if (state->options.size == 0) {
+        state->options.size = VASQ_ASYNC_SIZE;
+    }
+    if (state->options.block_timeout == 0) {
+        state->options.block_timeout = VASQ_ASYNC_BLOCK_TIMEOUT;
+    }
+
+    lane_size = state->options.size;
+    state->num_lanes = 1;
+    if (state->options.flags & VASQ_ASYNC_FLAG_PRIORITY_LANE) {
+        // The priority lane gets a quarter of the space.
+        if (ringInit(&state->lanes[PRIORITY_LANE], lane_size / 4) != 0) {
+            goto error;
+        }
+        lane_size -= lane_size / 4;
+        state->num_lanes = 2;
+    }
+    if (ringInit(&state->lanes[state->num_lanes - 1], lane_size) != 0) {
+        goto error;
+    }
+
+    if (state->options.policy == VASQ_ASYNC_DROP_OLDEST) {
+        // The last lane is the largest.
+        state->scratch = malloc((state->lanes[state->num_lanes - 1].mask + 1) * SLOT_SIZE);
+        if (!state->scratch) {
+            errno = ENOMEM;
+            goto error;
+        }
+    }
+
+    state->handler = *handler;
+    state->fork_generation = vasqForkGeneration();
+
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&state->wake, &attr);
+    pthread_cond_init(&state->progress, &attr);
+    pthread_condattr_destroy(&attr);
+
+    /*
+        Signals are left to the application's threads except for those raised by the writer's own faults.  A
+        blocked one would kill the process instead of reaching its handler, and the handler for SIGTRAP is
+        what resumes a thread which runs into a call site being patched on x86.
+    */
+    sigfillset(&blocked);
+    sigdelset(&blocked, SIGTRAP);
+    sigdelset(&blocked, SIGSEGV);
+    sigdelset(&blocked, SIGBUS);
+    sigdelset(&blocked, SIGFPE);
+    pthread_sigmask(SIG_SETMASK, &blocked, &old_signals);
+    ret = pthread_create(&state->thread, NULL, writerThread, state);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (ret != 0) {
+        pthread_cond_destroy(&state->progress);
+        pthread_cond_destroy(&state->wake);
+        pthread_mutex_destroy(&state->lock);
+        errno = ret;
+        goto error;
+    }
+
+    async->func = asyncWrite;
+    async->cleanup = asyncCleanup;
+    async->user = state;
+    return 0;
+
+error:
+    freeState(state);
+    return -1;
+}
+
+int
+vasqAsyncHandlerFlush(const vasqHandler *async)
+{
+    uint64_t targets[MAX_LANES];
+    unsigned long target_dropped;
+    asyncState *state = getState(async);
+
+    if (!state) {
+        return -1;
+    }
+    if (inChild(state)) {
+        return 0;  // Messages are written synchronously.
+    }
+
+    for (unsigned int k = 0; k < state->num_lanes; k++) {
+        targets[k] = __atomic_load_n(&state->lanes[k].head, __ATOMIC_RELAXED);
+    }
+    target_dropped = __atomic_load_n(&state->dropped, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&state->lock);
+    __atomic_add_fetch(&state->waiters, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pthread_cond_signal(&state->wake);
+    for (unsigned int k = 0; k < state->num_lanes; k++) {
+        while (__atomic_load_n(&state->lanes[k].finished, __ATOMIC_ACQUIRE) < targets[k]) {
+            pthread_cond_wait(&state->progress, &state->lock);
+        }
+    }
+    while ((long)(__atomic_load_n(&state->reported, __ATOMIC_ACQUIRE) - target_dropped) < 0) {
+        pthread_cond_wait(&state->progress, &state->lock);
+    }
+    __atomic_sub_fetch(&state->waiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&state->lock);
+
+    return 0;
+}
+
+int
+vasqAsyncHandlerStats(const vasqHandler *async, vasqAsyncStats *stats)
+{
+    const asyncState *state = getState(async);
+
+    if (!state) {
+        return -1;
+    }
+
+    stats->written = __atomic_load_n(&state->written, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&state->dropped, __ATOMIC_RELAXED);
+    for (int k = 0; k <= VASQ_LL_TRACE; k++) {
+        stats->dropped_messages[k] = __atomic_load_n(&state->dropped_messages_by_level[k], __ATOMIC_RELAXED);
+        stats->dropped_bytes[k] = __atomic_load_n(&state->dropped_bytes_by_level[k], __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+#endif  // VASQ_NO_LOGGING
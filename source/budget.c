@@ -0,0 +1,98 @@
+#ifndef VASQ_NO_LOGGING
+
+#include <string.h>
+
+#include "internal.h"
+#include "vasq/config.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+#define INTERVAL               (VASQ_BUDGET_INTERVAL * 1000000ULL)
+
+void
+vasqBudgetInit(vasqBudget *budget)
+{
+    memset(budget, 0, sizeof(*budget));
+    pthread_mutex_init(&budget->lock, NULL);
+    budget->level = VASQ_LL_NONE;
+}
+
+uint64_t
+vasqBudgetNow(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
+}
+
+void
+vasqBudgetSetLevel(vasqBudget *budget, vasqLogLevel *level, vasqLogLevel new_level)
+{
+    pthread_mutex_lock(&budget->lock);
+    budget->level = new_level;
+    budget->steps = 0;
+    vasqCallSitesSetLevel(level, new_level);
+    pthread_mutex_unlock(&budget->lock);
+}
+
+void
+vasqBudgetSet(vasqBudget *budget, vasqLogLevel *level, unsigned int percent, vasqLogLevel floor)
+{
+    pthread_mutex_lock(&budget->lock);
+    budget->floor = floor;
+    budget->load = 0;
+    __atomic_store_n(&budget->spent, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&budget->window_start, vasqBudgetNow(), __ATOMIC_RELAXED);
+    __atomic_store_n(&budget->percent, percent, __ATOMIC_RELAXED);
+    if (budget->steps > 0) {
+        budget->steps = 0;
+        vasqCallSitesSetLevel(level, budget->level);
+    }
+    pthread_mutex_unlock(&budget->lock);
+}
+
+/*
+    The load is a moving average which halves the weight of each interval so that a single busy interval
+    doesn't change the level on its own.  The level is lowered one step whenever the load exceeds the budget
+    and raised one step whenever it falls below half of the budget.
+*/
+int
+vasqBudgetCharge(vasqBudget *budget, vasqLogLevel *level, uint64_t start)
+{
+    int transition = 0;
+    uint64_t now = vasqBudgetNow(), elapsed;
+
+    __atomic_add_fetch(&budget->spent, now - start, __ATOMIC_RELAXED);
+    if (now - __atomic_load_n(&budget->window_start, __ATOMIC_RELAXED) < INTERVAL ||
+        pthread_mutex_trylock(&budget->lock) != 0) {
+        return 0;
+    }
+
+    elapsed = now - budget->window_start;
+    if (budget->percent > 0 && elapsed >= INTERVAL) {
+        uint64_t spent = __atomic_exchange_n(&budget->spent, 0, __ATOMIC_RELAXED);
+
+        budget->load = (budget->load + spent * 1000 / elapsed) / 2;
+        __atomic_store_n(&budget->window_start, now, __ATOMIC_RELAXED);
+
+        if (budget->load > budget->percent * 10 && budget->level - (int)budget->steps > budget->floor) {
+            budget->steps++;
+            budget->degradations++;
+            transition = 1;
+        }
+        else if (budget->steps > 0 && budget->load < budget->percent * 5) {
+            budget->steps--;
+            budget->restorations++;
+            transition = -1;
+        }
+
+        if (transition != 0) {
+            vasqCallSitesSetLevel(level, budget->level - (int)budget->steps);
+        }
+    }
+
+    pthread_mutex_unlock(&budget->lock);
+    return transition;
+}
+
+#endif  // VASQ_NO_LOGGING
@@ -0,0 +1,75 @@
+#ifndef VASQ_NO_LOGGING
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "internal.h"
+
+/*
+    Each thread formats its messages in a buffer which is grown as needed and reused.  A message logged
+    while the buffer is in use (e.g., by a handler or data processor) gets its own allocation.
+*/
+static __thread struct {
+    char *data;
+    size_t size;
+    bool in_use;
+} thread_buffer;
+
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+static pthread_key_t buffer_key;
+
+static void
+freeBuffer(void *data)
+{
+    free(data);
+}
+
+static void
+bufferInit(void)
+{
+    pthread_key_create(&buffer_key, freeBuffer);
+}
+
+void
+vasqBufferInit(void)
+{
+    pthread_once(&buffer_once, bufferInit);
+}
+
+char *
+vasqBufferAcquire(size_t size)
+{
+    if (thread_buffer.in_use) {
+        return malloc(size);
+    }
+
+    if (size > thread_buffer.size) {
+        char *data;
+
+        data = realloc(thread_buffer.data, size);
+        if (!data) {
+            return NULL;
+        }
+        thread_buffer.data = data;
+        thread_buffer.size = size;
+
+        // The key's destructor frees the buffer when the thread exits.
+        pthread_setspecific(buffer_key, data);
+    }
+
+    thread_buffer.in_use = true;
+    return thread_buffer.data;
+}
+
+void
+vasqBufferRelease(char *buffer)
+{
+    if (buffer == thread_buffer.data) {
+        thread_buffer.in_use = false;
+    }
+    else {
+        free(buffer);
+    }
+}
+
+#endif  // VASQ_NO_LOGGING
@@ -0,0 +1,502 @@
+#ifndef VASQ_NO_LOGGING
+
+#define _GNU_SOURCE  // For REG_RIP.
+
+#include <fnmatch.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "vasq/config.h"
+
+/*
+    A call site is enabled if its state says so or if at least one logger would emit its level.  level_counts
+    holds the number of root loggers at each level (not counting VASQ_LL_NONE).
+
+    The tables are only appended to and a table's count is incremented after it's filled in so that they can
+    be read without holding the lock.
+*/
+typedef struct siteTable {
+    vasqCallSite *const *start;
+    vasqCallSite *const *stop;
+} siteTable;
+
+typedef struct jumpTable {
+    vasqJumpEntry *start;
+    vasqJumpEntry *stop;
+} jumpTable;
+
+static pthread_mutex_t site_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int level_counts[VASQ_LL_TRACE + 1];
+static vasqLogLevel max_level = VASQ_LL_NONE;
+static siteTable site_tables[VASQ_SITE_TABLES];
+static unsigned int num_site_tables;
+static jumpTable jump_tables[VASQ_SITE_TABLES];
+static unsigned int num_jump_tables;
+
+static bool
+computeEnabled(const vasqCallSite *site)
+{
+    switch (site->state) {
+    case VASQ_SITE_ENABLED: return true;
+    case VASQ_SITE_DISABLED: return false;
+    default: return site->level <= max_level;
+    }
+}
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#define PATCH_BATCH 64 /* The number of jumps rewritten at once. */
+
+/*
+    A jump which is being rewritten.  writable is set once its page has been made writable.
+*/
+typedef struct jumpPatch {
+    vasqJumpEntry *entry;
+    bool enable;
+    bool writable;
+} jumpPatch;
+
+#ifdef __x86_64__
+
+/*
+    Other threads may be executing an instruction while it's rewritten.  Intel and AMD only guarantee that
+    they see either the old or the new instruction if the modification follows the same sequence as the
+    kernel's text_poke_bp:
+
+        1. Replace the first byte with int3.
+        2. Have every core execute a serializing instruction.
+        3. Rewrite the remaining bytes.
+        4. Serialize every core.
+        5. Replace the int3 with the new first byte.
+        6. Serialize every core.
+
+    A thread which reaches an int3 in the meantime gets a SIGTRAP which trapHandler handles by resuming it
+    where the new instruction would have sent it.  Cores are serialized with membarrier.  If that isn't
+    available, then each jump is rewritten with a single 8-byte store instead (a 5-byte instruction which
+    doesn't cross an 8-byte boundary is updated atomically by every x86-64 processor in practice, but that
+    isn't architecturally guaranteed).
+
+    The handler is left installed once the first patch has been made since a thread could have trapped just
+    before the int3 was removed and not yet received the signal.  Signals which aren't due to a patched jump
+    are passed on to the handler which was installed before.
+*/
+
+#include <cpuid.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/syscall.h>
+
+#define INT3 0xcc
+
+// From linux/membarrier.h where they're enumerators rather than macros.
+#define MEMBARRIER_QUERY              0
+#define MEMBARRIER_SYNC_CORE          (1 << 5)
+#define MEMBARRIER_REGISTER_SYNC_CORE (1 << 6)
+
+static pthread_once_t sync_core_once = PTHREAD_ONCE_INIT;
+static bool sync_core_ready;
+static bool trap_handler_installed;
+static struct sigaction previous_trap_action;
+
+static void
+registerSyncCore(void)
+{
+#ifdef __NR_membarrier
+    long commands = syscall(__NR_membarrier, MEMBARRIER_QUERY, 0);
+
+    sync_core_ready = commands > 0 && (commands & MEMBARRIER_SYNC_CORE) &&
+                      syscall(__NR_membarrier, MEMBARRIER_REGISTER_SYNC_CORE, 0) == 0;
+#endif
+}
+
+static void
+syncCores(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+#ifdef __NR_membarrier
+    // The registration isn't inherited by a forked child.
+    if (syscall(__NR_membarrier, MEMBARRIER_SYNC_CORE, 0) != 0 && errno == EPERM &&
+        syscall(__NR_membarrier, MEMBARRIER_REGISTER_SYNC_CORE, 0) == 0) {
+        syscall(__NR_membarrier, MEMBARRIER_SYNC_CORE, 0);
+    }
+#endif
+    __cpuid(0, eax, ebx, ecx, edx);  // The calling thread isn't covered by membarrier.
+    (void)eax;
+    (void)ebx;
+    (void)ecx;
+    (void)edx;
+}
+
+static const vasqJumpEntry *
+findJump(uintptr_t code)
+{
+    unsigned int num_tables = __atomic_load_n(&num_jump_tables, __ATOMIC_ACQUIRE);
+
+    for (unsigned int k = 0; k < num_tables; k++) {
+        for (const vasqJumpEntry *entry = jump_tables[k].start; entry < jump_tables[k].stop; entry++) {
+            if (entry->code == code) {
+                return entry;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void
+trapHandler(int signum, siginfo_t *info, void *context)
+{
+    ucontext_t *ucontext = context;
+    greg_t *pc = &ucontext->uc_mcontext.gregs[REG_RIP];
+    const vasqJumpEntry *entry;
+
+    entry = findJump(*pc - 1);
+    if (entry) {
+        // The entry's enabled field is updated before the int3 is written.
+        *pc = __atomic_load_n(&entry->enabled, __ATOMIC_RELAXED) ? entry->target : entry->code + 5;
+        return;
+    }
+
+    if (previous_trap_action.sa_flags & SA_SIGINFO) {
+        previous_trap_action.sa_sigaction(signum, info, context);
+    }
+    else if (previous_trap_action.sa_handler == SIG_DFL) {
+        signal(SIGTRAP, SIG_DFL);
+        raise(SIGTRAP);
+    }
+    else if (previous_trap_action.sa_handler != SIG_IGN) {
+        previous_trap_action.sa_handler(signum);
+    }
+}
+
+static bool
+installTrapHandler(void)
+{
+    struct sigaction action = {.sa_sigaction = trapHandler, .sa_flags = SA_SIGINFO | SA_RESTART};
+
+    if (!trap_handler_installed) {
+        sigfillset(&action.sa_mask);
+        if (sigaction(SIGTRAP, &action, &previous_trap_action) != 0) {
+            return false;
+        }
+        trap_handler_installed = true;
+    }
+    return true;
+}
+
+static void
+encodeJump(const vasqJumpEntry *entry, bool enable, unsigned char *bytes)
+{
+    if (enable) {
+        int32_t offset = entry->target - (entry->code + 5);
+
+        bytes[0] = 0xe9;
+        memcpy(bytes + 1, &offset, sizeof(offset));
+    }
+    else {
+        memcpy(bytes, "\x0f\x1f\x44\x00\x00", 5);  // nopl 0x0(%rax,%rax,1)
+    }
+}
+
+static void
+rewriteJumps(const jumpPatch *patches, size_t count)
+{
+    unsigned char bytes[8];
+
+    pthread_once(&sync_core_once, registerSyncCore);
+
+    if (!sync_core_ready || !installTrapHandler()) {
+        for (size_t k = 0; k < count; k++) {
+            // The jump is 8-byte aligned so the three bytes following it are also rewritten (as themselves).
+            uint64_t *word = (uint64_t *)patches[k].entry->code;
+
+            if (patches[k].writable) {
+                memcpy(bytes, word, sizeof(bytes));
+                encodeJump(patches[k].entry, patches[k].enable, bytes);
+                __atomic_store_n(word, *(uint64_t *)bytes, __ATOMIC_RELAXED);
+            }
+        }
+        return;
+    }
+
+    for (size_t k = 0; k < count; k++) {
+        if (patches[k].writable) {
+            __atomic_store_n((unsigned char *)patches[k].entry->code, INT3, __ATOMIC_RELAXED);
+        }
+    }
+    syncCores();
+
+    for (size_t k = 0; k < count; k++) {
+        if (patches[k].writable) {
+            encodeJump(patches[k].entry, patches[k].enable, bytes);
+            memcpy((unsigned char *)patches[k].entry->code + 1, bytes + 1, 4);
+        }
+    }
+    syncCores();
+
+    for (size_t k = 0; k < count; k++) {
+        if (patches[k].writable) {
+            encodeJump(patches[k].entry, patches[k].enable, bytes);
+            __atomic_store_n((unsigned char *)patches[k].entry->code, bytes[0], __ATOMIC_RELAXED);
+        }
+    }
+    syncCores();
+}
+
+#else  // __x86_64__
+
+/*
+    B and NOP are among the instructions which the architecture allows to be rewritten while other threads are
+    executing them so a single store followed by cache maintenance is enough.
+*/
+static void
+rewriteJumps(const jumpPatch *patches, size_t count)
+{
+    for (size_t k = 0; k < count; k++) {
+        const vasqJumpEntry *entry = patches[k].entry;
+        uint32_t instruction = 0xd503201f;  // nop
+
+        if (!patches[k].writable) {
+            continue;
+        }
+        if (patches[k].enable) {
+            instruction = 0x14000000 | (((entry->target - entry->code) >> 2) & 0x03ffffff);
+        }
+        __atomic_store_n((uint32_t *)entry->code, instruction, __ATOMIC_RELAXED);
+        __builtin___clear_cache((char *)entry->code, (char *)entry->code + sizeof(instruction));
+    }
+}
+
+#endif  // __x86_64__
+
+static int
+comparePatches(const void *a, const void *b)
+{
+    uintptr_t code_a = ((const jumpPatch *)a)->entry->code, code_b = ((const jumpPatch *)b)->entry->code;
+
+    return (code_a > code_b) - (code_a < code_b);
+}
+
+/*
+    The jumps are sorted so that each page is made writable (and then restored) only once.  A jump is never
+    split across pages.
+*/
+static void
+patchJumps(jumpPatch *patches, size_t count)
+{
+    uintptr_t page_size = sysconf(_SC_PAGESIZE), page = 0;
+    bool writable = false;
+
+    qsort(patches, count, sizeof(*patches), comparePatches);
+
+    for (size_t k = 0; k < count; k++) {
+        uintptr_t entry_page = patches[k].entry->code & ~(page_size - 1);
+
+        if (k == 0 || entry_page != page) {
+            page = entry_page;
+            writable = (mprotect((void *)page, page_size, PROT_READ | PROT_WRITE | PROT_EXEC) == 0);
+        }
+        patches[k].writable = writable;
+        if (writable) {
+            __atomic_store_n(&patches[k].entry->enabled, patches[k].enable, __ATOMIC_RELAXED);
+        }
+    }
+
+    rewriteJumps(patches, count);
+
+    for (size_t k = 0; k < count; k++) {
+        uintptr_t entry_page = patches[k].entry->code & ~(page_size - 1);
+
+        if (patches[k].writable && (k == 0 || entry_page != page)) {
+            mprotect((void *)entry_page, page_size, PROT_READ | PROT_EXEC);
+        }
+        page = entry_page;
+    }
+}
+
+/*
+    A jump which can't be rewritten is left alone.  Leaving a jump enabled is harmless since the site's state
+    and the logger's level are still checked.
+*/
+static void
+updateJumps(const jumpTable *tables, unsigned int num_tables)
+{
+    jumpPatch patches[PATCH_BATCH];
+    size_t count = 0;
+
+    for (unsigned int k = 0; k < num_tables; k++) {
+        for (vasqJumpEntry *entry = tables[k].start; entry < tables[k].stop; entry++) {
+            bool enable = computeEnabled(entry->site);
+
+            if (enable == (bool)entry->enabled) {
+                continue;
+            }
+            patches[count].entry = entry;
+            patches[count].enable = enable;
+            if (++count == PATCH_BATCH) {
+                patchJumps(patches, count);
+                count = 0;
+            }
+        }
+    }
+
+    if (count > 0) {
+        patchJumps(patches, count);
+    }
+}
+
+#else  // Linux on x86-64 or aarch64
+
+static void
+updateJumps(const jumpTable *tables, unsigned int num_tables)
+{
+    (void)tables;
+    (void)num_tables;
+}
+
+#endif  // Linux on x86-64 or aarch64
+
+static void
+updateSites(const siteTable *table)
+{
+    for (vasqCallSite *const *site = table->start; site < table->stop; site++) {
+        __atomic_store_n(&(*site)->enabled, computeEnabled(*site), __ATOMIC_RELAXED);
+    }
+}
+
+static void
+updateAll(void)
+{
+    for (unsigned int k = 0; k < num_site_tables; k++) {
+        updateSites(&site_tables[k]);
+    }
+    updateJumps(jump_tables, num_jump_tables);
+}
+
+void
+vasqRegisterCallSites(vasqCallSite *const *sites, vasqCallSite *const *sites_end, vasqJumpEntry *jumps,
+                      vasqJumpEntry *jumps_end)
+{
+    unsigned int k;
+
+    pthread_mutex_lock(&site_lock);
+
+    // Every translation unit of a shared object registers the same sections.
+    if (sites && sites < sites_end && num_site_tables < VASQ_SITE_TABLES) {
+        for (k = 0; k < num_site_tables && site_tables[k].start != sites; k++) {}
+        if (k == num_site_tables) {
+            site_tables[k].start = sites;
+            site_tables[k].stop = sites_end;
+            updateSites(&site_tables[k]);
+            __atomic_store_n(&num_site_tables, k + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (jumps && jumps < jumps_end && num_jump_tables < VASQ_SITE_TABLES) {
+        for (k = 0; k < num_jump_tables && jump_tables[k].start != jumps; k++) {}
+        if (k == num_jump_tables) {
+            jump_tables[k].start = jumps;
+            jump_tables[k].stop = jumps_end;
+            __atomic_store_n(&num_jump_tables, k + 1, __ATOMIC_RELEASE);  // Before any int3 is written.
+            updateJumps(&jump_tables[k], 1);
+        }
+    }
+
+    pthread_mutex_unlock(&site_lock);
+}
+
+void
+vasqCallSitesSetLevel(vasqLogLevel *level, vasqLogLevel new_level)
+{
+    vasqLogLevel old_level, new_max_level;
+
+    pthread_mutex_lock(&site_lock);
+
+    old_level = __atomic_load_n(level, __ATOMIC_RELAXED);
+    __atomic_store_n(level, new_level, __ATOMIC_RELAXED);
+
+    if (old_level > VASQ_LL_NONE && old_level <= VASQ_LL_TRACE) {
+        level_counts[old_level]--;
+    }
+    if (new_level > VASQ_LL_NONE && new_level <= VASQ_LL_TRACE) {
+        level_counts[new_level]++;
+    }
+
+    for (new_max_level = VASQ_LL_TRACE; new_max_level > VASQ_LL_NONE; new_max_level--) {
+        if (level_counts[new_max_level] > 0) {
+            break;
+        }
+    }
+
+    if (new_max_level != max_level) {
+        max_level = new_max_level;
+        updateAll();
+    }
+
+    pthread_mutex_unlock(&site_lock);
+}
+
+void
+vasqCallSitesForEach(vasqCallSiteFunc *func, void *user)
+{
+    unsigned int num_tables = __atomic_load_n(&num_site_tables, __ATOMIC_ACQUIRE);
+
+    for (unsigned int k = 0; k < num_tables; k++) {
+        for (vasqCallSite *const *site = site_tables[k].start; site < site_tables[k].stop; site++) {
+            if ((*site)->format) {
+                func(user, *site);
+            }
+        }
+    }
+}
+
+static bool
+siteMatches(const vasqCallSite *site, const vasqCallSiteFilter *filter)
+{
+    if (site->line_no < filter->first_line || (filter->last_line > 0 && site->line_no > filter->last_line)) {
+        return false;
+    }
+
+    if (filter->function && strcmp(site->function_name, filter->function) != 0) {
+        return false;
+    }
+
+    if (filter->file && fnmatch(filter->file, site->file_name, 0) != 0) {
+        const char *base_name = strrchr(site->file_name, '/');
+
+        if (!base_name || fnmatch(filter->file, base_name + 1, 0) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+size_t
+vasqCallSitesSetState(const vasqCallSiteFilter *filter, vasqSiteState state)
+{
+    size_t count = 0;
+
+    pthread_mutex_lock(&site_lock);
+
+    for (unsigned int k = 0; k < num_site_tables; k++) {
+        for (vasqCallSite *const *site = site_tables[k].start; site < site_tables[k].stop; site++) {
+            if ((*site)->format && (!filter || siteMatches(*site, filter))) {
+                __atomic_store_n(&(*site)->state, state, __ATOMIC_RELAXED);
+                count++;
+            }
+        }
+    }
+
+    if (count > 0) {
+        updateAll();
+    }
+
+    pthread_mutex_unlock(&site_lock);
+    return count;
+}
+
+#endif  // VASQ_NO_LOGGING
@@ -0,0 +1,440 @@
+#ifndef VASQ_NO_LOGGING
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER
+#elif defined(__aarch64__)
+#define HAVE_CYCLE_COUNTER
+#endif
+
+#include "internal.h"
+#include "vasq/config.h"
+#include "vasq/logger.h"
+#include "vasq/safe_snprintf.h"
+
+#define SECONDS_PER_DAY 86400
+
+static const char day_names[7][4] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char month_names[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+/*
+    The UTC offset of the local time zone over the window [valid_from, valid_until).  The window never
+    extends past the next DST transition.  Readers use the sequence number as a seqlock:  it's odd while an
+    update is being published.
+*/
+static struct {
+    unsigned int sequence;
+    long offset;
+    time_t valid_from;
+    time_t valid_until;
+} zone;
+
+static __thread vasqTimeCache time_cache;
+static __thread vasqTimeCache other_time_cache;
+
+#ifdef HAVE_CYCLE_COUNTER
+
+static pthread_once_t calibration_once = PTHREAD_ONCE_INIT;
+static uint64_t cycles_per_second;
+static uint64_t nanoseconds_per_cycle; /* Fixed point with 32 fractional bits. */
+
+/*
+    Each thread anchors the cycle counter to the real-time clock and re-anchors once a second so that
+    adjustments to the system clock are picked up.
+*/
+static __thread struct {
+    uint64_t cycles;
+    struct timespec time;
+    bool valid;
+} cycle_anchor;
+
+#endif
+
+static long
+zoneOffsetAt(time_t when)
+{
+    struct tm fields;
+
+    if (!localtime_r(&when, &fields)) {
+        return 0;
+    }
+    return fields.tm_gmtoff;
+}
+
+static void
+publishZone(long offset, time_t valid_from, time_t valid_until)
+{
+    unsigned int sequence;
+
+    sequence = __atomic_load_n(&zone.sequence, __ATOMIC_RELAXED);
+    if (sequence & 1 ||
+        !__atomic_compare_exchange_n(&zone.sequence, &sequence, sequence + 1, false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+        return;  // Another thread is already publishing.
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&zone.offset, offset, __ATOMIC_RELAXED);
+    __atomic_store_n(&zone.valid_from, valid_from, __ATOMIC_RELAXED);
+    __atomic_store_n(&zone.valid_until, valid_until, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&zone.sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/*
+    Finds the offset at now and the end of the window, no more than VASQ_TIMEZONE_REFRESH seconds later, over
+    which it's valid.  Along with zoneOffset's fallback, this is the only place where localtime_r (and so the
+    time zone lock) is used.
+*/
+static long
+computeZone(time_t now, time_t *valid_until)
+{
+    long offset;
+    time_t until;
+
+    offset = zoneOffsetAt(now);
+    until = now + VASQ_TIMEZONE_REFRESH;
+
+    if (zoneOffsetAt(until) != offset) {
+        time_t low = now;
+
+        // There's a transition in the window so find the first second of the new offset.
+        while (until - low > 1) {
+            time_t middle = low + (until - low) / 2;
+
+            if (zoneOffsetAt(middle) == offset) {
+                low = middle;
+            }
+            else {
+                until = middle;
+            }
+        }
+    }
+
+    *valid_until = until;
+    return offset;
+}
+
+static void
+refreshZone(time_t now)
+{
+    long offset;
+    time_t until;
+
+    offset = computeZone(now, &until);
+    publishZone(offset, now, until);
+}
+
+static bool
+readZone(time_t now, long *offset, unsigned int *sequence)
+{
+    unsigned int before;
+    long value;
+    time_t valid_from, valid_until;
+
+    before = __atomic_load_n(&zone.sequence, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+        return false;
+    }
+
+    value = __atomic_load_n(&zone.offset, __ATOMIC_RELAXED);
+    valid_from = __atomic_load_n(&zone.valid_from, __ATOMIC_RELAXED);
+    valid_until = __atomic_load_n(&zone.valid_until, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&zone.sequence, __ATOMIC_RELAXED) != before || now < valid_from ||
+        now >= valid_until) {
+        return false;
+    }
+
+    *offset = value;
+    *sequence = before;
+    return true;
+}
+
+static void
+zoneOffset(time_t now, long *offset, unsigned int *sequence)
+{
+    if (readZone(now, offset, sequence)) {
+        return;
+    }
+
+    refreshZone(now);
+    if (readZone(now, offset, sequence)) {
+        return;
+    }
+
+    // Another thread is in the middle of publishing.  Rather than wait for it, use what this thread saw last.
+    if (time_cache.valid) {
+        *offset = time_cache.offset;
+    }
+    else {
+        *offset = zoneOffsetAt(now);
+    }
+    *sequence = 0;
+}
+
+void
+vasqCivilFromEpoch(time_t local, vasqCivilTime *civil)
+{
+    long long days, era;
+    unsigned int seconds, day_of_era, year_of_era, day_of_year, shifted_month;
+
+    days = local / SECONDS_PER_DAY;
+    if (local % SECONDS_PER_DAY < 0) {
+        days--;
+    }
+    seconds = local - days * SECONDS_PER_DAY;
+
+    civil->hour = seconds / 3600;
+    civil->minute = (seconds / 60) % 60;
+    civil->second = seconds % 60;
+    civil->weekday = (days + 4) % 7;  // January 1, 1970 was a Thursday.
+    if (civil->weekday < 0) {
+        civil->weekday += 7;
+    }
+
+    // See http://howardhinnant.github.io/date_algorithms.html#civil_from_days.
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    day_of_era = days - era * 146097;
+    year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    shifted_month = (5 * day_of_year + 2) / 153;
+
+    civil->day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+    civil->month = (shifted_month < 10) ? shifted_month + 3 : shifted_month - 9;
+    civil->year = year_of_era + era * 400 + (civil->month <= 2);
+}
+
+static void
+twoDigits(char *dst, int value)
+{
+    dst[0] = '0' + value / 10;
+    dst[1] = '0' + value % 10;
+}
+
+static void
+renderSecond(vasqTimeCache *cache, time_t second, long offset, unsigned int sequence)
+{
+    ssize_t written;
+    vasqCivilTime civil;
+
+    vasqCivilFromEpoch(second + offset, &civil);
+
+    written = vasqSafeSnprintf(cache->pretty, sizeof(cache->pretty), "%s %s %2i %02i:%02i:%02i %lli",
+                               day_names[civil.weekday], month_names[civil.month - 1], civil.day, civil.hour,
+                               civil.minute, civil.second, civil.year);
+    cache->pretty_length = (written > 0) ? written : 0;
+
+    written = vasqSafeSnprintf(cache->iso, sizeof(cache->iso), "%04lli-%02i-%02iT%02i:%02i:%02i", civil.year,
+                               civil.month, civil.day, civil.hour, civil.minute, civil.second);
+    cache->iso_length = (written > 0) ? written : 0;
+
+    cache->offset_string[0] = (offset < 0) ? '-' : '+';
+    twoDigits(cache->offset_string + 1, labs(offset) / 3600);
+    cache->offset_string[3] = ':';
+    twoDigits(cache->offset_string + 4, (labs(offset) / 60) % 60);
+
+    twoDigits(cache->hour, civil.hour);
+    twoDigits(cache->minute, civil.minute);
+    twoDigits(cache->sec, civil.second);
+
+    written = vasqSafeSnprintf(cache->epoch, sizeof(cache->epoch), "%lli", (long long)second);
+    cache->epoch_length = (written > 0) ? written : 0;
+
+    cache->second = second;
+    cache->offset = offset;
+    cache->zone_sequence = sequence;
+    cache->valid = true;
+}
+
+static bool
+isSystemClock(vasqClockFunc *clock)
+{
+    return clock == vasqClockRealtime || clock == vasqClockRealtimeCoarse || clock == vasqClockCycles;
+}
+
+/*
+    Other clocks (e.g., a fake one in a test) might be nowhere near the real time and so they use a window of
+    their own.  It's invalidated along with the shared one by vasqRefreshTimeZone.
+*/
+static const vasqTimeCache *
+otherTimeCacheGet(vasqClockFunc *clock, void *clock_user, time_t now)
+{
+    vasqTimeCache *cache = &other_time_cache;
+    unsigned int sequence = __atomic_load_n(&zone.sequence, __ATOMIC_RELAXED) & ~1u;
+
+    if (cache->valid && cache->clock == clock && cache->clock_user == clock_user &&
+        cache->zone_sequence == sequence) {
+        if (now == cache->second) {
+            return cache;
+        }
+        if (now >= cache->zone_from && now < cache->zone_until) {
+            renderSecond(cache, now, cache->offset, sequence);
+            return cache;
+        }
+    }
+
+    cache->clock = clock;
+    cache->clock_user = clock_user;
+    cache->zone_from = now;
+    renderSecond(cache, now, computeZone(now, &cache->zone_until), sequence);
+    return cache;
+}
+
+const vasqTimeCache *
+vasqTimeCacheGet(vasqClockFunc *clock, void *clock_user, const struct timespec *now)
+{
+    long offset;
+    unsigned int sequence;
+
+    if (!isSystemClock(clock)) {
+        return otherTimeCacheGet(clock, clock_user, now->tv_sec);
+    }
+
+    if (time_cache.valid && now->tv_sec == time_cache.second &&
+        __atomic_load_n(&zone.sequence, __ATOMIC_RELAXED) == time_cache.zone_sequence) {
+        return &time_cache;
+    }
+
+    zoneOffset(now->tv_sec, &offset, &sequence);
+    renderSecond(&time_cache, now->tv_sec, offset, sequence);
+
+    return &time_cache;
+}
+
+void
+vasqRenderFraction(char *dst, long nanoseconds)
+{
+    for (int k = 8; k >= 0; k--) {
+        dst[k] = '0' + nanoseconds % 10;
+        nanoseconds /= 10;
+    }
+}
+
+void
+vasqClockRealtime(void *user, struct timespec *now)
+{
+    (void)user;
+
+    clock_gettime(CLOCK_REALTIME, now);
+}
+
+void
+vasqClockRealtimeCoarse(void *user, struct timespec *now)
+{
+    (void)user;
+
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, now);
+#else
+    clock_gettime(CLOCK_REALTIME, now);
+#endif
+}
+
+#ifdef HAVE_CYCLE_COUNTER
+
+static uint64_t
+readCycles(void)
+{
+#ifdef __aarch64__
+    uint64_t value;
+
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return __rdtsc();
+#endif
+}
+
+static void
+calibrate(void)
+{
+#ifdef __aarch64__
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(cycles_per_second));
+#else
+    uint64_t start_cycles, end_cycles;
+    long long elapsed;
+    struct timespec start, end, pause = {.tv_nsec = 10000000};
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    start_cycles = readCycles();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end_cycles = readCycles();
+
+    elapsed = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    if (elapsed > 0 && end_cycles > start_cycles) {
+        cycles_per_second = (end_cycles - start_cycles) * 1000000000ULL / elapsed;
+    }
+#endif
+
+    if (cycles_per_second > 0) {
+        nanoseconds_per_cycle = (1000000000ULL << 32) / cycles_per_second;
+    }
+}
+
+#endif  // HAVE_CYCLE_COUNTER
+
+void
+vasqClockCycles(void *user, struct timespec *now)
+{
+#ifdef HAVE_CYCLE_COUNTER
+    uint64_t elapsed;
+
+    (void)user;
+
+    pthread_once(&calibration_once, calibrate);
+    if (nanoseconds_per_cycle == 0) {
+        goto fallback;
+    }
+
+    elapsed = readCycles() - cycle_anchor.cycles;
+    if (!cycle_anchor.valid || elapsed >= cycles_per_second) {
+        clock_gettime(CLOCK_REALTIME, &cycle_anchor.time);
+        cycle_anchor.cycles = readCycles();
+        cycle_anchor.valid = true;
+        *now = cycle_anchor.time;
+        return;
+    }
+
+    *now = cycle_anchor.time;
+    now->tv_nsec += (elapsed * nanoseconds_per_cycle) >> 32;
+    if (now->tv_nsec >= 1000000000L) {
+        now->tv_sec++;
+        now->tv_nsec -= 1000000000L;
+    }
+    return;
+
+fallback:
+#endif
+    vasqClockRealtime(user, now);
+}
+
+void
+vasqClockPrepare(vasqClockFunc *clock)
+{
+#ifdef HAVE_CYCLE_COUNTER
+    if (clock == vasqClockCycles) {
+        pthread_once(&calibration_once, calibrate);
+    }
+#else
+    (void)clock;
+#endif
+}
+
+void
+vasqRefreshTimeZone(void)
+{
+    tzset();
+    refreshZone(time(NULL));
+}
+
+#endif  // VASQ_NO_LOGGING
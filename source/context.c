@@ -0,0 +1,155 @@
+#ifndef VASQ_NO_LOGGING
+
+#include <errno.h>
+#include <string.h>
+
+#include "internal.h"
+#include "vasq/config.h"
+#include "vasq/logger.h"
+#include "vasq/safe_snprintf.h"
+
+/*
+    The fields pushed by a thread.  They're rendered as they're pushed so that %C only has to copy the text.
+    marks[k] holds the lengths of the buffers before the (k+1)th field was pushed.
+*/
+static __thread struct {
+    vasqFieldBuffer buffer;
+    unsigned int depth;
+    struct {
+        size_t text_length;
+        size_t json_length;
+    } marks[VASQ_CONTEXT_DEPTH];
+    char text[VASQ_CONTEXT_SIZE];
+    char json[VASQ_CONTEXT_SIZE];
+} context;
+
+bool
+vasqRenderField(vasqFieldBuffer *buffer, const char *key, const char *format, va_list args)
+{
+    char value[VASQ_CONTEXT_SIZE];
+    char *dst;
+    ssize_t written;
+    size_t key_length, value_length, json_field_length, remaining;
+
+    written = vasqSafeVsnprintf(value, sizeof(value), format, args);
+    if (written < 0) {  // The format has an unsupported token.
+        errno = EINVAL;
+        return false;
+    }
+    value_length = written;
+    if (value_length + 1 >= sizeof(value)) {  // The value may have been truncated.
+        errno = ENOSPC;
+        return false;
+    }
+
+    key_length = strlen(key);
+
+    // A comma (if needed), the quotes, and the colon.
+    json_field_length = (buffer->json_length > 0) + 5 + vasqJsonEscapedLength(key, key_length) +
+                        vasqJsonEscapedLength(value, value_length);
+    if (json_field_length >= buffer->size - buffer->json_length) {
+        errno = ENOSPC;
+        return false;
+    }
+
+    dst = buffer->text + buffer->text_length;
+    remaining = buffer->size - buffer->text_length;
+    if (buffer->text_length > 0) {
+        vasqIncSnprintf(&dst, &remaining, " ");
+    }
+    vasqIncSnprintf(&dst, &remaining, "%s=%s", key, value);
+    if (remaining <= 1) {  // The field may have been truncated.
+        goto overflow;
+    }
+    buffer->text_length = dst - buffer->text;
+
+    dst = buffer->json + buffer->json_length;
+    remaining = buffer->size - buffer->json_length;
+    if (buffer->json_length > 0) {
+        vasqIncSnprintf(&dst, &remaining, ",");
+    }
+    vasqIncSnprintf(&dst, &remaining, "\"");
+    vasqJsonAppendString(&dst, &remaining, key, key_length);
+    vasqIncSnprintf(&dst, &remaining, "\":\"");
+    vasqJsonAppendString(&dst, &remaining, value, value_length);
+    vasqIncSnprintf(&dst, &remaining, "\"");
+    buffer->json_length = dst - buffer->json;
+
+    return true;
+
+overflow:
+    buffer->text[buffer->text_length] = '\0';
+    errno = ENOSPC;
+    return false;
+}
+
+static void
+contextInit(void)
+{
+    if (!context.buffer.text) {
+        context.buffer.text = context.text;
+        context.buffer.json = context.json;
+        context.buffer.size = VASQ_CONTEXT_SIZE;
+    }
+}
+
+const vasqFieldBuffer *
+vasqContextGet(void)
+{
+    contextInit();
+    return &context.buffer;
+}
+
+int
+vasqContextPush(const char *key, const char *format, ...)
+{
+    bool success;
+    va_list args;
+
+    if (!key || !format) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (context.depth == VASQ_CONTEXT_DEPTH) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    contextInit();
+    context.marks[context.depth].text_length = context.buffer.text_length;
+    context.marks[context.depth].json_length = context.buffer.json_length;
+    va_start(args, format);
+    success = vasqRenderField(&context.buffer, key, format, args);
+    va_end(args);
+    if (!success) {
+        return -1;
+    }
+
+    context.depth++;
+    return 0;
+}
+
+void
+vasqContextPop(void)
+{
+    if (context.depth > 0) {
+        context.depth--;
+        context.buffer.text_length = context.marks[context.depth].text_length;
+        context.buffer.json_length = context.marks[context.depth].json_length;
+        context.text[context.buffer.text_length] = '\0';
+        context.json[context.buffer.json_length] = '\0';
+    }
+}
+
+void
+vasqContextClear(void)
+{
+    context.depth = 0;
+    context.buffer.text_length = 0;
+    context.buffer.json_length = 0;
+    context.text[0] = '\0';
+    context.json[0] = '\0';
+}
+
+#endif  // VASQ_NO_LOGGING
@@ -0,0 +1,261 @@
+#ifndef VASQ_NO_LOGGING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "vasq/control.h"
+
+/*
+    registered[k] is the logger whose name is in page->loggers[k].  Everything other than page,
+    _vasq_control_generation, and _vasq_control_seen is protected by control_lock.
+
+    _vasq_control_generation points at the open page's generation or, if none is open, at no_generation.  The
+    logging macros compare it with _vasq_control_seen, the last generation applied, without taking the lock.
+    Since a thread may still be reading a page after it's closed, pages are never unmapped.
+*/
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+static vasqControlPage *page;
+static const vasqLogger *registered[VASQ_CONTROL_LOGGERS];
+static uint32_t applied_sequence;
+static const uint32_t no_generation;
+const uint32_t *_vasq_control_generation = &no_generation;
+uint32_t _vasq_control_seen;
+
+int
+vasqControlOpen(const char *path)
+{
+    int fd, ret = -1;
+    void *map;
+
+    pthread_mutex_lock(&control_lock);
+
+    if (page) {
+        errno = EBUSY;
+        goto done;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        goto done;
+    }
+
+    if (ftruncate(fd, sizeof(*page)) != 0) {
+        int local_errno = errno;
+
+        close(fd);
+        errno = local_errno;
+        goto done;
+    }
+
+    map = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        goto done;
+    }
+
+    memset(registered, 0, sizeof(registered));
+    __atomic_store_n(&_vasq_control_seen, 0, __ATOMIC_RELAXED);
+    applied_sequence = 0;
+
+    // The file was just truncated so everything else is already zero.
+    page = map;
+    page->version = VASQ_CONTROL_VERSION;
+    page->pid = getpid();
+    page->next_sequence = 1;
+    __atomic_store_n(&page->magic, VASQ_CONTROL_MAGIC, __ATOMIC_RELEASE);
+    __atomic_store_n(&_vasq_control_generation, &page->generation, __ATOMIC_RELEASE);
+    ret = 0;
+
+done:
+    pthread_mutex_unlock(&control_lock);
+    return ret;
+}
+
+void
+vasqControlClose(void)
+{
+    pthread_mutex_lock(&control_lock);
+    if (page) {
+        // The page stays mapped (see above) but vasqctl no longer accepts it.
+        __atomic_store_n(&page->magic, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&_vasq_control_generation, &no_generation, __ATOMIC_RELEASE);
+        __atomic_store_n(&_vasq_control_seen, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&page, NULL, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&control_lock);
+}
+
+static vasqControlLogger *
+findSlot(const vasqLogger *logger)
+{
+    for (unsigned int k = 0; k < VASQ_CONTROL_LOGGERS; k++) {
+        if (registered[k] == logger) {
+            return &page->loggers[k];
+        }
+    }
+    return NULL;
+}
+
+int
+vasqControlRegister(vasqLogger *logger)
+{
+    const char *name = vasqLoggerName(logger);
+    int ret = -1;
+
+    if (!name || ((vasqLoggerHead *)logger)->root != logger) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&control_lock);
+
+    if (!page) {
+        errno = EBADF;
+        goto done;
+    }
+
+    if (findSlot(logger)) {
+        ret = 0;
+        goto done;
+    }
+
+    for (unsigned int k = 0; k < VASQ_CONTROL_LOGGERS; k++) {
+        if (!registered[k]) {
+            vasqControlLogger *slot = &page->loggers[k];
+
+            registered[k] = logger;
+            slot->level = vasqLoggerLevel(logger);
+            slot->pending = 0;
+            strncpy(slot->name, name, sizeof(slot->name) - 1);
+            slot->name[sizeof(slot->name) - 1] = '\0';
+            ret = 0;
+            goto done;
+        }
+    }
+    errno = ENOSPC;
+
+done:
+    pthread_mutex_unlock(&control_lock);
+    return ret;
+}
+
+void
+vasqControlLevelChanged(const vasqLogger *logger, vasqLogLevel level)
+{
+    vasqControlLogger *slot;
+
+    if (!__atomic_load_n(&page, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pthread_mutex_lock(&control_lock);
+    if (page && (slot = findSlot(logger))) {
+        __atomic_store_n(&slot->level, level, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&control_lock);
+}
+
+void
+vasqControlUnregister(const vasqLogger *logger)
+{
+    vasqControlLogger *slot;
+
+    if (!__atomic_load_n(&page, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    pthread_mutex_lock(&control_lock);
+    if (page && (slot = findSlot(logger))) {
+        registered[slot - page->loggers] = NULL;
+        memset(slot, 0, sizeof(*slot));
+    }
+    pthread_mutex_unlock(&control_lock);
+}
+
+static void
+applyRule(const vasqControlRule *rule)
+{
+    char file[VASQ_CONTROL_PATTERN_SIZE], function[VASQ_CONTROL_PATTERN_SIZE];
+    vasqCallSiteFilter filter = {.first_line = rule->first_line, .last_line = rule->last_line};
+
+    if (rule->state < VASQ_SITE_DEFAULT || rule->state > VASQ_SITE_DISABLED) {
+        return;
+    }
+
+    // The strings are copied since vasqctl could be overwriting them.
+    memcpy(file, rule->file, sizeof(file));
+    file[sizeof(file) - 1] = '\0';
+    memcpy(function, rule->function, sizeof(function));
+    function[sizeof(function) - 1] = '\0';
+    if (*file) {
+        filter.file = file;
+    }
+    if (*function) {
+        filter.function = function;
+    }
+
+    vasqCallSitesSetState(&filter, rule->state);
+}
+
+static void
+applyChanges(void)
+{
+    uint32_t generation, next_sequence;
+
+    if (!page || (generation = __atomic_load_n(&page->generation, __ATOMIC_ACQUIRE)) == _vasq_control_seen) {
+        return;  // Another thread got here first.
+    }
+    __atomic_store_n(&_vasq_control_seen, generation, __ATOMIC_RELAXED);
+
+    for (unsigned int k = 0; k < VASQ_CONTROL_LOGGERS; k++) {
+        vasqControlLogger *slot = &page->loggers[k];
+
+        if (registered[k] && __atomic_exchange_n(&slot->pending, 0, __ATOMIC_ACQUIRE)) {
+            vasqLogLevel level = __atomic_load_n(&slot->level, __ATOMIC_RELAXED);
+
+            if (level >= VASQ_LL_NONE && level <= VASQ_LL_TRACE) {
+                vasqLoggerApplyLevel((vasqLogger *)registered[k], level);
+            }
+        }
+    }
+
+    // Rules which have already been overwritten are skipped.
+    next_sequence = __atomic_load_n(&page->next_sequence, __ATOMIC_ACQUIRE);
+    for (uint32_t sequence = applied_sequence + 1; sequence < next_sequence; sequence++) {
+        const vasqControlRule *rule = &page->rules[sequence % VASQ_CONTROL_RULES];
+
+        if (__atomic_load_n(&rule->sequence, __ATOMIC_ACQUIRE) == sequence) {
+            applyRule(rule);
+        }
+    }
+    if (next_sequence > 0) {
+        applied_sequence = next_sequence - 1;
+    }
+}
+
+void
+vasqControlPoll(void)
+{
+    const uint32_t *generation = __atomic_load_n(&_vasq_control_generation, __ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(generation, __ATOMIC_RELAXED) ==
+        __atomic_load_n(&_vasq_control_seen, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    // A thread which finds the lock taken leaves the changes to the thread holding it.
+    if (pthread_mutex_trylock(&control_lock) == 0) {
+        int local_errno = errno;
+
+        applyChanges();
+        pthread_mutex_unlock(&control_lock);
+        errno = local_errno;
+    }
+}
+
+#endif  // VASQ_NO_LOGGING
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "vasq/logger.h"
+
+#ifdef __GNUC__
+#define VASQ_HIDDEN __attribute__((visibility("hidden")))
+#else
+#define VASQ_HIDDEN
+#endif
+
+/*
+    A process or thread ID rendered as decimal digits.
+*/
+typedef struct vasqIdString {
+    unsigned char length;
+    char digits[24];
+} vasqIdString;
+
+/*
+    The rendered forms of the current second.  Each thread keeps one copy for the system clocks and one for
+    other clocks (keyed on the clock) which are only re-rendered when the second rolls over.  The latter keeps
+    its own time zone window, [zone_from, zone_until), so that a clock far from the real time doesn't disturb
+    the shared one.
+*/
+typedef struct vasqTimeCache {
+    vasqClockFunc *clock;
+    void *clock_user;
+    time_t second;
+    time_t zone_from;
+    time_t zone_until;
+    long offset;
+    unsigned int zone_sequence;
+    bool valid;
+    unsigned char pretty_length;
+    unsigned char epoch_length;
+    unsigned char iso_length;
+    char pretty[32];       /* E.g., Sun Feb 14 14:27:19 2021 */
+    char iso[32];          /* E.g., 2021-02-14T14:27:19 */
+    char offset_string[6]; /* E.g., -05:00 */
+    char hour[2];
+    char minute[2];
+    char sec[2];
+    char epoch[24];
+} vasqTimeCache;
+
+/*
+    Broken-down time as computed by vasqCivilFromEpoch.
+*/
+typedef struct vasqCivilTime {
+    long long year;
+    int month; /* 1-12 */
+    int day;   /* 1-31 */
+    int hour;
+    int minute;
+    int second;
+    int weekday; /* 0-6 with 0 being Sunday */
+} vasqCivilTime;
+
+const vasqTimeCache *
+vasqTimeCacheGet(vasqClockFunc *clock, void *clock_user, const struct timespec *now) VASQ_HIDDEN;
+
+/*
+    Does any expensive setup of a clock (i.e., calibrating vasqClockCycles) so that it isn't done by the first
+    message.
+*/
+void
+vasqClockPrepare(vasqClockFunc *clock) VASQ_HIDDEN;
+
+/*
+    Writes exactly 9 digits.
+*/
+void
+vasqRenderFraction(char *dst, long nanoseconds) VASQ_HIDDEN;
+
+void
+vasqCivilFromEpoch(time_t local, vasqCivilTime *civil) VASQ_HIDDEN;
+
+void
+vasqProcessInit(void) VASQ_HIDDEN;
+
+const vasqIdString *
+vasqProcessId(void) VASQ_HIDDEN;
+
+/*
+    Returns the number of times that the process has been forked from its parent (i.e., 0 in the original
+    process).
+*/
+unsigned int
+vasqForkGeneration(void) VASQ_HIDDEN;
+
+#ifdef __linux__
+const vasqIdString *
+vasqThreadId(void) VASQ_HIDDEN;
+#endif
+
+/*
+    A buffer of rendered fields.  Fields are rendered both as text (key=value separated by spaces) and as JSON
+    ("key":"value" separated by commas) so that neither has to be done when a message is logged.
+*/
+typedef struct vasqFieldBuffer {
+    char *text;
+    char *json;
+    size_t size; /* The size of each of text and json. */
+    size_t text_length;
+    size_t json_length;
+} vasqFieldBuffer;
+
+/*
+    Appends a field to a buffer.  If the value can't be rendered (EINVAL) or the field doesn't fit (ENOSPC),
+    then the buffer is left as it was, errno is set, and false is returned.
+*/
+bool
+vasqRenderField(vasqFieldBuffer *buffer, const char *key, const char *format, va_list args) VASQ_HIDDEN;
+
+/*
+    Returns the calling thread's context fields.  The buffer must not be modified.
+*/
+const vasqFieldBuffer *
+vasqContextGet(void) VASQ_HIDDEN;
+
+/*
+    Continues a 64-bit FNV-1a hash over size bytes.  Pass VASQ_FNV_OFFSET_BASIS to start a new hash.
+*/
+#define VASQ_FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+uint64_t
+vasqFnvHash(uint64_t hash, const void *data, size_t size) VASQ_HIDDEN;
+
+void
+vasqBufferInit(void) VASQ_HIDDEN;
+
+/*
+    Returns a buffer of at least size bytes which must be returned by vasqBufferRelease.  The calling thread's
+    reusable buffer is returned unless it's already in use.
+*/
+char *
+vasqBufferAcquire(size_t size) VASQ_HIDDEN;
+
+void
+vasqBufferRelease(char *buffer) VASQ_HIDDEN;
+
+/*
+    Stores the level of a root logger and updates the registered call sites.  A logger is counted from the
+    first call (as a change from VASQ_LL_NONE) until its level is set to VASQ_LL_NONE.
+*/
+void
+vasqCallSitesSetLevel(vasqLogLevel *level, vasqLogLevel new_level) VASQ_HIDDEN;
+
+/*
+    The CPU budget of a logger (see vasqSetLoggerBudget).  The effective level is level lowered by steps but
+    never below floor.  load is in tenths of a percent.
+*/
+typedef struct vasqBudget {
+    pthread_mutex_t lock;
+    unsigned int percent; /* 0 if the logger has no budget. */
+    vasqLogLevel floor;
+    vasqLogLevel level; /* The level set by vasqSetLoggerLevel. */
+    unsigned int steps;
+    unsigned int load;
+    uint64_t window_start;
+    uint64_t spent; /* Nanoseconds spent logging since window_start. */
+    unsigned long degradations;
+    unsigned long restorations;
+} vasqBudget;
+
+void
+vasqBudgetInit(vasqBudget *budget) VASQ_HIDDEN;
+
+/*
+    Returns CLOCK_MONOTONIC in nanoseconds.
+*/
+uint64_t
+vasqBudgetNow(void) VASQ_HIDDEN;
+
+/*
+    Stores a new level as set by the user and cancels any degradation.  level points to the root logger's
+    level.
+*/
+void
+vasqBudgetSetLevel(vasqBudget *budget, vasqLogLevel *level, vasqLogLevel new_level) VASQ_HIDDEN;
+
+/*
+    Sets the budget.  A percent of 0 removes it and restores the user's level.
+*/
+void
+vasqBudgetSet(vasqBudget *budget, vasqLogLevel *level, unsigned int percent, vasqLogLevel floor) VASQ_HIDDEN;
+
+/*
+    Charges the time since start (as returned by vasqBudgetNow) to the budget.  If a measurement interval has
+    ended, then the effective level may be changed.  Returns 1 if it was lowered, -1 if it was raised, and 0
+    otherwise.
+*/
+int
+vasqBudgetCharge(vasqBudget *budget, vasqLogLevel *level, uint64_t start) VASQ_HIDDEN;
+
+/*
+    Sets a root logger's level without notifying the control file.
+*/
+void
+vasqLoggerApplyLevel(vasqLogger *logger, vasqLogLevel level) VASQ_HIDDEN;
+
+/*
+    Records a logger's new level in the control file.
+*/
+void
+vasqControlLevelChanged(const vasqLogger *logger, vasqLogLevel level) VASQ_HIDDEN;
+
+/*
+    Removes a logger from the control file.
+*/
+void
+vasqControlUnregister(const vasqLogger *logger) VASQ_HIDDEN;
+
+/*
+    Returns true if the calling thread is holding back messages.
+*/
+bool
+vasqTailActive(void) VASQ_HIDDEN;
+
+/*
+    Adds a formatted message to the calling thread's held back messages, discarding the oldest ones if
+    necessary.
+*/
+void
+vasqTailAppend(const vasqHandler *handler, vasqLogLevel level, const char *text, size_t length) VASQ_HIDDEN;
+
+/*
+    Returns the length of the longest prefix of text which doesn't need to be escaped in a JSON string.
+*/
+size_t
+vasqJsonSafeLength(const char *text, size_t length) VASQ_HIDDEN;
+
+/*
+    Returns the length of text once it's been escaped for a JSON string.
+*/
+size_t
+vasqJsonEscapedLength(const char *text, size_t length) VASQ_HIDDEN;
+
+/*
+    Appends text to a buffer in the manner of vasqIncSnprintf, escaping it for a JSON string.
+*/
+void
+vasqJsonAppendString(char **dst, size_t *remaining, const char *text, size_t length) VASQ_HIDDEN;
+
+/*
+    Escapes the first length characters of text for a JSON string without exceeding capacity bytes (including
+    the null terminator).  Characters which don't fit are dropped.  Returns the new length.
+*/
+size_t
+vasqJsonEscapeInPlace(char *text, size_t length, size_t capacity) VASQ_HIDDEN;
@@ -0,0 +1,223 @@
+#ifndef VASQ_NO_LOGGING
+
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "internal.h"
+
+/*
+    Characters which must be escaped in a JSON string are the control characters, '"', and '\'.  Everything
+    else, including the bytes of UTF-8 sequences, is copied as is.
+*/
+static bool
+needsEscape(unsigned char c)
+{
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+size_t
+vasqJsonSafeLength(const char *text, size_t length)
+{
+    size_t k = 0;
+
+#if defined(__AVX2__)
+    const __m256i quote32 = _mm256_set1_epi8('"'), backslash32 = _mm256_set1_epi8('\\'),
+                  control32 = _mm256_set1_epi8(0x1f);
+
+    for (; k + 32 <= length; k += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(text + k));
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote32), _mm256_cmpeq_epi8(chunk, backslash32)),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, control32), chunk));
+        unsigned int mask = _mm256_movemask_epi8(hits);
+
+        if (mask) {
+            return k + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'), control = _mm_set1_epi8(0x1f);
+
+    for (; k + 16 <= length; k += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(text + k));
+        __m128i hits =
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                         _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+        unsigned int mask = _mm_movemask_epi8(hits);
+
+        if (mask) {
+            return k + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"'), backslash = vdupq_n_u8('\\'), control = vdupq_n_u8(0x20);
+
+    for (; k + 16 <= length; k += 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *)(text + k));
+        uint8x16_t hits =
+            vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)), vcltq_u8(chunk, control));
+
+        if (vmaxvq_u8(hits)) {
+            break;  // The scalar loop below locates the character.
+        }
+    }
+#endif
+
+    for (; k < length; k++) {
+        if (needsEscape(text[k])) {
+            break;
+        }
+    }
+
+    return k;
+}
+
+/*
+    Returns the escape sequence for a character which needs one and sets *length to its length.
+*/
+static const char *
+escapeSequence(unsigned char c, char *scratch, unsigned int *length)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+
+    *length = 2;
+    switch (c) {
+    case '"': return "\\\"";
+    case '\\': return "\\\\";
+    case '\n': return "\\n";
+    case '\r': return "\\r";
+    case '\t': return "\\t";
+    case '\b': return "\\b";
+    case '\f': return "\\f";
+    default:
+        memcpy(scratch, "\\u00", 4);
+        scratch[4] = hex_digits[c >> 4];
+        scratch[5] = hex_digits[c & 0x0f];
+        *length = 6;
+        return scratch;
+    }
+}
+
+size_t
+vasqJsonEscapedLength(const char *text, size_t length)
+{
+    size_t escaped_length = 0;
+
+    while (length > 0) {
+        size_t safe;
+        unsigned int escape_length;
+        char scratch[6];
+
+        safe = vasqJsonSafeLength(text, length);
+        escaped_length += safe;
+        text += safe;
+        length -= safe;
+        if (length == 0) {
+            break;
+        }
+
+        escapeSequence(*text, scratch, &escape_length);
+        escaped_length += escape_length;
+        text++;
+        length--;
+    }
+
+    return escaped_length;
+}
+
+void
+vasqJsonAppendString(char **dst, size_t *remaining, const char *text, size_t length)
+{
+    while (length > 0) {
+        size_t safe;
+        unsigned int escape_length;
+        const char *escape;
+        char scratch[6];
+
+        safe = vasqJsonSafeLength(text, length);
+        if (safe >= *remaining) {
+            safe = *remaining ? *remaining - 1 : 0;
+            length = safe;  // Ends the loop after this run.
+        }
+        memcpy(*dst, text, safe);
+        *dst += safe;
+        *remaining -= safe;
+        text += safe;
+        length -= safe;
+        if (length == 0) {
+            break;
+        }
+
+        escape = escapeSequence(*text, scratch, &escape_length);
+        if (escape_length >= *remaining) {
+            break;  // Don't emit part of an escape sequence.
+        }
+        memcpy(*dst, escape, escape_length);
+        *dst += escape_length;
+        *remaining -= escape_length;
+        text++;
+        length--;
+    }
+
+    if (*remaining > 0) {
+        **dst = '\0';
+    }
+}
+
+size_t
+vasqJsonEscapeInPlace(char *text, size_t length, size_t capacity)
+{
+    size_t safe, escaped_length, cutoff;
+    char *src, *dst;
+
+    safe = vasqJsonSafeLength(text, length);
+    if (safe == length) {
+        return length;  // The common case.
+    }
+
+    // Find out how much of the text can be escaped within the capacity (leaving room for a null terminator).
+    escaped_length = safe;
+    for (cutoff = safe; cutoff < length; cutoff++) {
+        unsigned int char_length = 1;
+        char scratch[6];
+
+        if (needsEscape(text[cutoff])) {
+            escapeSequence(text[cutoff], scratch, &char_length);
+        }
+        if (escaped_length + char_length >= capacity) {
+            break;
+        }
+        escaped_length += char_length;
+    }
+
+    // Expand from the back so that nothing is overwritten before it's read.
+    src = text + cutoff;
+    dst = text + escaped_length;
+    *dst = '\0';
+    while (src > text + safe) {
+        unsigned int escape_length;
+        const char *escape;
+        char scratch[6];
+
+        src--;
+        if (!needsEscape(*src)) {
+            *(--dst) = *src;
+            continue;
+        }
+
+        escape = escapeSequence(*src, scratch, &escape_length);
+        dst -= escape_length;
+        memcpy(dst, escape, escape_length);
+    }
+
+    return escaped_length;
+}
+
+#endif  // VASQ_NO_LOGGING
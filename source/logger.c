@@ -2,12 +2,12 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/syscall.h>
-#include <time.h>
 #include <unistd.h>
 
+#include "internal.h"
 #include "vasq/config.h"
 #include "vasq/logger.h"
 #include "vasq/safe_snprintf.h"
@@ -16,14 +16,188 @@
 #error "VASQ_HEXDUMP_SIZE must be a multiple of VASQ_HEXDUMP_WIDTH."
 #endif
 
+#define JSON_RESERVE  3  /* The closing quote of a string, the closing brace, and the newline. */
+#define JSON_MIN_SIZE 64 /* The smallest output buffer allowed for VASQ_LOGGER_FLAG_JSON. */
+
+#define LEVEL_OFF (VASQ_LL_TRACE + 1) /* A sample_level or tail_level which no message reaches. */
+
+#define LOG_NEEDS_TIME 0x01
+#define LOG_NEEDS_PID  0x02
+#define LOG_NEEDS_TID  0x04
+
+/*
+    The expansion of a format token.
+*/
+typedef void
+tokenRenderer(vasqFormatContext *ctx);
+
+/*
+    A logger format is compiled into an array of these.  A token of '\0' denotes a run of literal characters
+    which is copied from the logger's literal pool.  Otherwise, token is the character following the % in the
+    format string and render is its expansion.
+*/
+typedef struct logOp {
+    char token;
+    unsigned int length;   /* The length of a literal run. */
+    size_t offset;         /* The offset of a literal run in the pool. */
+    tokenRenderer *render; /* The expansion of a token. */
+} logOp;
+
+/*
+    Which part of a format to render.  A log builder renders the part before %M when it begins and the part
+    after %M when it commits.
+*/
+enum formatPart {
+    FORMAT_WHOLE = 0,
+    FORMAT_PREFIX,
+    FORMAT_SUFFIX,
+};
+
+/*
+    The state of a message being formatted.  The PID, TID, and time are looked up the first time a token
+    needs them so that a message only pays for what its format uses.
+
+    While skipping is set, *remaining is held at 0 so that nothing is written.  The real value is kept in
+    saved_remaining.
+
+    In the JSON output mode, JSON_RESERVE bytes are held back from *remaining for the closing characters so
+    that a truncated message is still a valid object.  json_reserve is what's left of them.
+*/
+struct vasqFormatContext {
+    vasqLogger *logger;
+    const vasqLoggerHead *head;
+    const vasqCallSite *site;
+    const vasqField *fields;
+    size_t num_fields;
+    char **dst;
+    size_t *remaining;
+    char *message_start;
+    unsigned int json_fields;
+    size_t json_reserve;
+    bool json;
+    bool context_done;
+    const vasqIdString *pid;
+    const vasqIdString *tid;
+    const vasqTimeCache *now;
+    size_t data_index;
+    size_t saved_remaining;
+    enum formatPart part;
+    bool skipping;
+    bool message_done;
+    uint64_t message_hash;
+    char fraction[9];
+    va_list args;
+};
+
+/*
+    A rendered %x value.
+*/
+typedef struct dataValue {
+    unsigned int length;
+    char text[VASQ_DATA_CACHE_SIZE];
+} dataValue;
+
+enum dataSlotState {
+    DATA_SLOT_EMPTY = 0,
+    DATA_SLOT_RENDERING,
+    DATA_SLOT_READY,
+};
+
+/*
+    A logger's value for one %x in VASQ_DATA_STATIC mode.  The first thread to claim an empty slot renders it
+    while any others call the processor directly until the slot is ready.
+*/
+typedef struct dataSlot {
+    int state;
+    dataValue value;
+} dataSlot;
+
+/*
+    A child logger's head points to the logger at the root of its family.  A root logger's head points to
+    itself.
+*/
 struct vasqLogger {
-    const char *format;
-    char *name;
+    vasqLoggerHead head;
+    logOp *ops;
+    char *literals;
+    unsigned int needs; /* Which of the time, PID, and TID the compiled format uses. */
     vasqHandler handler;
     vasqLoggerOptions options;
-    vasqLogLevel level;
+    size_t num_ops;
+    unsigned long serial;
+    unsigned long data_generation;
+    dataSlot *static_data;
+    size_t max_message_size;
+    vasqLogLevel tail_level;
+    vasqLogLevel tail_flush_level;
+    pthread_mutex_t dedup_lock;
+    vasqCallSite dedup_site; /* The origin of the last message. */
+    uint64_t dedup_key;      /* The hash of the last message and its origin. */
+    unsigned long repeats;   /* The number of times the last message has been suppressed. */
+    time_t dedup_start;      /* When the current run of the last message started. */
+    vasqBudget budget;
 };
 
+/*
+    The per-thread cache for VASQ_DATA_PER_THREAD and VASQ_DATA_VERSIONED.  Entries are keyed by the logger's
+    serial number rather than its address so that a logger allocated where a freed one used to be doesn't
+    see stale values.
+*/
+#define THREAD_DATA_ENTRIES 16
+
+typedef struct threadDataEntry {
+    unsigned long serial; /* 0 means unused. */
+    unsigned long generation;
+    size_t index;
+    dataValue value;
+} threadDataEntry;
+
+static unsigned long next_serial;
+static __thread threadDataEntry thread_data[THREAD_DATA_ENTRIES];
+
+static vasqLogger *
+rootLogger(vasqLogger *logger)
+{
+    return logger ? ((vasqLoggerHead *)logger)->root : NULL;
+}
+
+/*
+    The level can be changed while other threads are logging.
+*/
+static vasqLogLevel
+loggerLevel(const vasqLogger *logger)
+{
+    return __atomic_load_n(&logger->head.level, __ATOMIC_RELAXED);
+}
+
+/*
+    A thread with no sampling key has a hash of 0 and so is always kept.
+*/
+static bool
+sampled(const vasqLogger *logger, vasqLogLevel level)
+{
+    return level < __atomic_load_n(&logger->head.sample_level, __ATOMIC_RELAXED) ||
+           _vasq_sample_hash <= __atomic_load_n(&logger->head.sample_threshold, __ATOMIC_RELAXED);
+}
+
+static bool
+levelEnabled(const vasqLogger *logger, vasqLogLevel level)
+{
+    vasqLogLevel max_level = loggerLevel(logger);
+
+    return level <= max_level && max_level != VASQ_LL_NONE && sampled(logger, level);
+}
+
+static bool
+siteEnabled(const vasqLogger *logger, const vasqCallSite *site)
+{
+    switch (__atomic_load_n(&site->state, __ATOMIC_RELAXED)) {
+    case VASQ_SITE_ENABLED: return loggerLevel(logger) != VASQ_LL_NONE;
+    case VASQ_SITE_DISABLED: return false;
+    default: return levelEnabled(logger, site->level);
+    }
+}
+
 static bool
 validLogFormat(const char *format)
 {
@@ -53,10 +227,15 @@ validLogFormat(const char *format)
             case 'h':
             case 'm':
             case 's':
+            case '3':
+            case '6':
+            case '9':
+            case 'I':
             case 'F':
             case 'f':
             case 'l':
             case 'x':
+            case 'C':
             case '%': break;
 
             default: return false;
@@ -83,6 +262,7 @@ logLevelName(vasqLogLevel level)
     case VASQ_LL_WARNING: return "WARNING";
     case VASQ_LL_INFO: return "INFO";
     case VASQ_LL_DEBUG: return "DEBUG";
+    case VASQ_LL_TRACE: return "TRACE";
     default: return "INVALID";  // This should never happen.
     }
 }
@@ -97,128 +277,879 @@ logLevelNamePadding(vasqLogLevel level)
     case VASQ_LL_WARNING: return 1;
     case VASQ_LL_INFO: return 4;
     case VASQ_LL_DEBUG: return 3;
+    case VASQ_LL_TRACE: return 3;
     default: return 0;  // This should never happen.
 #define LOG_LEVEL_NAME_MAX_PADDING 4
     }
 }
 
+static const vasqTimeCache *
+resolveTime(vasqFormatContext *ctx)
+{
+    struct timespec now;
+
+    ctx->logger->options.clock(ctx->logger->options.clock_user, &now);
+    ctx->now = vasqTimeCacheGet(ctx->logger->options.clock, ctx->logger->options.clock_user, &now);
+    vasqRenderFraction(ctx->fraction, now.tv_nsec);
+    return ctx->now;
+}
+
+static void
+renderData(vasqLogger *logger, size_t idx, vasqLogLevel level, dataValue *value)
+{
+    char *dst = value->text;
+    size_t remaining = sizeof(value->text);
+
+    value->text[0] = '\0';
+    logger->options.processor(logger->options.user, idx, level, &dst, &remaining);
+    value->length = dst - value->text;
+}
+
+static const dataValue *
+staticData(vasqLogger *logger, size_t idx, vasqLogLevel level)
+{
+    dataSlot *slot = &logger->static_data[idx];
+    int state;
+
+    state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (state == DATA_SLOT_READY) {
+        return &slot->value;
+    }
+
+    if (state == DATA_SLOT_EMPTY &&
+        __atomic_compare_exchange_n(&slot->state, &state, DATA_SLOT_RENDERING, false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+        renderData(logger, idx, level, &slot->value);
+        __atomic_store_n(&slot->state, DATA_SLOT_READY, __ATOMIC_RELEASE);
+        return &slot->value;
+    }
+
+    return NULL;
+}
+
+static const dataValue *
+threadData(vasqLogger *logger, size_t idx, vasqLogLevel level)
+{
+    unsigned long generation = 0;
+    threadDataEntry *entry;
+
+    if (logger->options.data_mode == VASQ_DATA_VERSIONED) {
+        generation = __atomic_load_n(&logger->data_generation, __ATOMIC_ACQUIRE);
+    }
+
+    entry = &thread_data[(logger->serial * VASQ_DATA_CACHE_SLOTS + idx) % THREAD_DATA_ENTRIES];
+    if (entry->serial != logger->serial || entry->index != idx || entry->generation != generation) {
+        entry->serial = logger->serial;
+        entry->index = idx;
+        entry->generation = generation;
+        renderData(logger, idx, level, &entry->value);
+    }
+
+    return &entry->value;
+}
+
 static void
-vlogToBuffer(vasqLogger *logger, vasqLogLevel level, const char *file_name, const char *function_name,
-             unsigned int line_no, char **dst, size_t *remaining, const char *format, va_list args)
+formatData(vasqFormatContext *ctx)
 {
-    size_t position = 0;
-    time_t now;
-    struct tm now_fields;
+    vasqLogger *logger = ctx->logger;
+    size_t idx = ctx->data_index;
+    const dataValue *value = NULL;
+
+    if (!logger->options.processor) {
+        return;
+    }
+
+    if (idx < VASQ_DATA_CACHE_SLOTS) {
+        switch (logger->options.data_mode) {
+        case VASQ_DATA_STATIC: value = staticData(logger, idx, ctx->site->level); break;
+
+        case VASQ_DATA_PER_THREAD:
+        case VASQ_DATA_VERSIONED: value = threadData(logger, idx, ctx->site->level); break;
+
+        default: break;
+        }
+    }
+
+    if (value) {
+        vasqFormatLiteral(ctx->dst, ctx->remaining, value->text, value->length);
+    }
+    else {
+        logger->options.processor(logger->options.user, idx, ctx->site->level, ctx->dst, ctx->remaining);
+    }
+}
+
+static void
+formatFields(vasqFormatContext *ctx)
+{
+    char **dst = ctx->dst;
+    size_t *remaining = ctx->remaining;
+    const vasqFieldBuffer *context = vasqContextGet();
+    bool first = true;
+
+    if (ctx->head->fields_length > 0) {
+        vasqFormatLiteral(dst, remaining, ctx->head->fields, ctx->head->fields_length);
+        first = false;
+    }
+
+    if (context->text_length > 0) {
+        if (!first) {
+            vasqFormatLiteral(dst, remaining, " ", 1);
+        }
+        vasqFormatLiteral(dst, remaining, context->text, context->text_length);
+        first = false;
+    }
+
+    for (size_t k = 0; k < ctx->num_fields; k++) {
+        const vasqField *field = &ctx->fields[k];
+
+        vasqIncSnprintf(dst, remaining, first ? "%s=" : " %s=", field->key);
+        switch (field->type) {
+        case VASQ_FT_STRING: vasqIncSnprintf(dst, remaining, "%s", field->value.string); break;
+        case VASQ_FT_INT: vasqIncSnprintf(dst, remaining, "%lli", field->value.integer); break;
+        case VASQ_FT_UINT: vasqIncSnprintf(dst, remaining, "%llu", field->value.uinteger); break;
+        case VASQ_FT_BOOL:
+            vasqIncSnprintf(dst, remaining, "%s", field->value.boolean ? "true" : "false");
+            break;
+        default: break;
+        }
+        first = false;
+    }
+}
+
+/*
+    The expansion of each format token.  The compiled format of a logger points each token op at one of these
+    and the VASQ_FMT_* macros call them through their public wrappers.
+*/
 
-    now = time(NULL);
-    localtime_r(&now, &now_fields);
+#define NOW() (ctx->now ? ctx->now : resolveTime(ctx))
 
-    for (size_t k = 0; logger->format[k]; k++) {
-        char c = logger->format[k];
+static void
+tokenMessage(vasqFormatContext *ctx)
+{
+    char **dst = ctx->dst;
+    size_t *remaining = ctx->remaining;
 
-        if (c == '%') {
-            switch (logger->format[++k]) {
-                unsigned int padding_length, len;
-                size_t idx;
-                char time_string[30], padding[LOG_LEVEL_NAME_MAX_PADDING + 1];
-                struct timespec epoch;
+    if (ctx->part == FORMAT_PREFIX) {
+        ctx->saved_remaining = *remaining;
+        *remaining = 0;
+        ctx->skipping = true;
+    }
+    else if (!ctx->message_done) {
+        char *start = *dst;
 
-            case 'M': vasqIncVsnprintf(dst, remaining, format, args); break;
+        vasqIncVsnprintf(dst, remaining, ctx->site->format, ctx->args);
+        ctx->message_done = true;
+        if (ctx->logger->options.flags & VASQ_LOGGER_FLAG_DEDUP) {
+            ctx->message_hash = vasqFnvHash(VASQ_FNV_OFFSET_BASIS, start, *dst - start);
+        }
+    }
+}
 
-            case 'p': vasqIncSnprintf(dst, remaining, "%li", (long)getpid()); break;
+static void
+tokenPid(vasqFormatContext *ctx)
+{
+    if (!ctx->pid) {
+        ctx->pid = vasqProcessId();
+    }
+    vasqFormatLiteral(ctx->dst, ctx->remaining, ctx->pid->digits, ctx->pid->length);
+}
 
+static void
+tokenTid(vasqFormatContext *ctx)
+{
 #ifdef __linux__
-            case 'T': vasqIncSnprintf(dst, remaining, "%li", (long)syscall(SYS_gettid)); break;
+    if (!ctx->tid) {
+        ctx->tid = vasqThreadId();
+    }
+    vasqFormatLiteral(ctx->dst, ctx->remaining, ctx->tid->digits, ctx->tid->length);
+#else
+    (void)ctx;
 #endif
+}
 
-            case 'L': vasqIncSnprintf(dst, remaining, "%s", logLevelName(level)); break;
+static void
+tokenLevel(vasqFormatContext *ctx)
+{
+    const char *name = logLevelName(ctx->site->level);
 
-            case '_':
-                padding_length = logLevelNamePadding(level);
-                memset(padding, ' ', padding_length);
-                padding[padding_length] = '\0';
-                vasqIncSnprintf(dst, remaining, "%s", padding);
-                break;
+    vasqFormatLiteral(ctx->dst, ctx->remaining, name, strlen(name));
+}
 
-            case 'N':
-                if (logger->options.name) {
-                    vasqIncSnprintf(dst, remaining, "%s", logger->options.name);
-                }
-                break;
+static void
+tokenPadding(vasqFormatContext *ctx)
+{
+    unsigned int len = logLevelNamePadding(ctx->site->level);
+    char padding[LOG_LEVEL_NAME_MAX_PADDING];
 
-            case 'u':
-                clock_gettime(CLOCK_REALTIME, &epoch);
-                vasqIncSnprintf(dst, remaining, "%lli", (long long)epoch.tv_sec);
-                break;
+    memset(padding, ' ', len);
+    vasqFormatLiteral(ctx->dst, ctx->remaining, padding, len);
+}
 
-            case 't':
-                ctime_r(&now, time_string);
-                len = strnlen(time_string, sizeof(time_string));
-                vasqIncSnprintf(dst, remaining, "%.*s", len - 1,
-                                time_string);  // Don't include the newline character.
-                break;
+static void
+tokenName(vasqFormatContext *ctx)
+{
+    const char *name = ctx->logger->options.name;
 
-            case 'h': vasqIncSnprintf(dst, remaining, "%02i", now_fields.tm_hour); break;
+    if (name) {
+        vasqFormatLiteral(ctx->dst, ctx->remaining, name, strlen(name));
+    }
+}
 
-            case 'm': vasqIncSnprintf(dst, remaining, "%02i", now_fields.tm_min); break;
+static void
+tokenEpoch(vasqFormatContext *ctx)
+{
+    const vasqTimeCache *now = NOW();
 
-            case 's': vasqIncSnprintf(dst, remaining, "%02i", now_fields.tm_sec); break;
+    vasqFormatLiteral(ctx->dst, ctx->remaining, now->epoch, now->epoch_length);
+}
 
-            case 'F':
-                for (idx = strlen(file_name); idx > 0; idx--) {
-                    if (file_name[idx] == '/') {
-                        idx++;
-                        goto print_file_name;
-                    }
-                }
-                if (file_name[0] == '/') {  // idx equals 0 here.
-                    idx = 1;
-                }
+static void
+tokenTimestamp(vasqFormatContext *ctx)
+{
+    const vasqTimeCache *now = NOW();
+
+    vasqFormatLiteral(ctx->dst, ctx->remaining, now->pretty, now->pretty_length);
+}
+
+static void
+tokenHour(vasqFormatContext *ctx)
+{
+    vasqFormatLiteral(ctx->dst, ctx->remaining, NOW()->hour, 2);
+}
+
+static void
+tokenMinute(vasqFormatContext *ctx)
+{
+    vasqFormatLiteral(ctx->dst, ctx->remaining, NOW()->minute, 2);
+}
+
+static void
+tokenSecond(vasqFormatContext *ctx)
+{
+    vasqFormatLiteral(ctx->dst, ctx->remaining, NOW()->sec, 2);
+}
+
+static void
+tokenMilliseconds(vasqFormatContext *ctx)
+{
+    NOW();
+    vasqFormatLiteral(ctx->dst, ctx->remaining, ctx->fraction, 3);
+}
+
+static void
+tokenMicroseconds(vasqFormatContext *ctx)
+{
+    NOW();
+    vasqFormatLiteral(ctx->dst, ctx->remaining, ctx->fraction, 6);
+}
+
+static void
+tokenNanoseconds(vasqFormatContext *ctx)
+{
+    NOW();
+    vasqFormatLiteral(ctx->dst, ctx->remaining, ctx->fraction, 9);
+}
+
+static void
+tokenIsoTime(vasqFormatContext *ctx)
+{
+    char **dst = ctx->dst;
+    size_t *remaining = ctx->remaining;
+    const vasqTimeCache *now = NOW();
+
+    vasqFormatLiteral(dst, remaining, now->iso, now->iso_length);
+    vasqFormatLiteral(dst, remaining, ".", 1);
+    vasqFormatLiteral(dst, remaining, ctx->fraction, 3);
+    vasqFormatLiteral(dst, remaining, now->offset_string, sizeof(now->offset_string));
+}
+
+#undef NOW
+
+static void
+tokenFile(vasqFormatContext *ctx)
+{
+    const vasqCallSite *site = ctx->site;
+    size_t idx;
+
+    idx = site->base_offset;
+    if (idx != VASQ_BASE_OFFSET_UNKNOWN) {
+        goto print_file_name;
+    }
+    for (idx = strlen(site->file_name); idx > 0; idx--) {
+        if (site->file_name[idx] == '/') {
+            idx++;
+            goto print_file_name;
+        }
+    }
+    if (site->file_name[0] == '/') {  // idx equals 0 here.
+        idx = 1;
+    }
 print_file_name:
-                vasqIncSnprintf(dst, remaining, "%s", file_name + idx);
-                break;
+    vasqFormatLiteral(ctx->dst, ctx->remaining, site->file_name + idx, strlen(site->file_name + idx));
+}
 
-            case 'f': vasqIncSnprintf(dst, remaining, "%s", function_name); break;
+static void
+tokenFunction(vasqFormatContext *ctx)
+{
+    vasqFormatLiteral(ctx->dst, ctx->remaining, ctx->site->function_name, strlen(ctx->site->function_name));
+}
 
-            case 'l': vasqIncSnprintf(dst, remaining, "%u", line_no); break;
+static void
+tokenLine(vasqFormatContext *ctx)
+{
+    vasqIncSnprintf(ctx->dst, ctx->remaining, "%u", ctx->site->line_no);
+}
 
-            case 'x':
-                if (logger->options.processor) {
-                    logger->options.processor(logger->options.user, position, level, dst, remaining);
+static void
+tokenData(vasqFormatContext *ctx)
+{
+    formatData(ctx);
+    ctx->data_index++;
+}
+
+static void
+tokenPercent(vasqFormatContext *ctx)
+{
+    vasqFormatLiteral(ctx->dst, ctx->remaining, "%", 1);
+}
+
+static tokenRenderer *const token_renderers[128] = {
+    ['M'] = tokenMessage,      ['p'] = tokenPid,          ['T'] = tokenTid,
+    ['L'] = tokenLevel,        ['_'] = tokenPadding,      ['N'] = tokenName,
+    ['u'] = tokenEpoch,        ['t'] = tokenTimestamp,    ['h'] = tokenHour,
+    ['m'] = tokenMinute,       ['s'] = tokenSecond,       ['3'] = tokenMilliseconds,
+    ['6'] = tokenMicroseconds, ['9'] = tokenNanoseconds,  ['I'] = tokenIsoTime,
+    ['F'] = tokenFile,         ['f'] = tokenFunction,     ['l'] = tokenLine,
+    ['x'] = tokenData,         ['C'] = formatFields,      ['%'] = tokenPercent,
+};
+
+/*
+    Returns NULL for an unknown token.
+*/
+static tokenRenderer *
+tokenRendererOf(char token)
+{
+    unsigned char c = token;
+
+    return (c < sizeof(token_renderers) / sizeof(token_renderers[0])) ? token_renderers[c] : NULL;
+}
+
+static void
+renderToken(vasqFormatContext *ctx, char token)
+{
+    tokenRenderer *renderer = tokenRendererOf(token);
+
+    if (renderer) {
+        renderer(ctx);
+    }
+}
+
+static bool
+compileLogFormat(vasqLogger *logger, const char *format)
+{
+    size_t num_ops = 0, pool_size = 0;
+    bool in_literal = false;
+    logOp *op;
+    char *pool;
+
+    for (size_t k = 0; format[k]; k++) {
+        if (format[k] != '%' || format[k + 1] == '%') {
+            if (format[k] == '%') {
+                k++;
+            }
+            if (!in_literal) {
+                num_ops++;
+                in_literal = true;
+            }
+            pool_size++;
+        }
+        else {
+            k++;
+            num_ops++;
+            in_literal = false;
+        }
+    }
+
+    logger->ops = malloc(num_ops * sizeof(*logger->ops) + pool_size + 1);
+    if (!logger->ops) {
+        return false;
+    }
+    logger->literals = (char *)(logger->ops + num_ops);
+    logger->num_ops = num_ops;
+    logger->needs = 0;
+
+    op = logger->ops - 1;
+    pool = logger->literals;
+    in_literal = false;
+    for (size_t k = 0; format[k]; k++) {
+        char c = format[k];
+
+        if (c != '%' || format[k + 1] == '%') {
+            if (c == '%') {
+                k++;
+            }
+            if (!in_literal) {
+                op++;
+                op->token = '\0';
+                op->length = 0;
+                op->offset = pool - logger->literals;
+                in_literal = true;
+            }
+            *(pool++) = c;
+            op->length++;
+            continue;
+        }
+
+        op++;
+        op->token = format[++k];
+        op->length = 0;
+        op->offset = 0;
+        op->render = tokenRendererOf(op->token);
+        in_literal = false;
+
+        switch (op->token) {
+        case 'p': logger->needs |= LOG_NEEDS_PID; break;
+        case 'T': logger->needs |= LOG_NEEDS_TID; break;
+        case 'u':
+        case 't':
+        case 'h':
+        case 'm':
+        case 's':
+        case '3':
+        case '6':
+        case '9':
+        case 'I': logger->needs |= LOG_NEEDS_TIME; break;
+        default: break;
+        }
+    }
+    *pool = '\0';
+
+    return true;
+}
+
+/*
+    Starts a JSON field.  Returns false (and writes nothing) if there isn't enough room for the key.
+*/
+static bool
+jsonKey(vasqFormatContext *ctx, const char *key, bool string)
+{
+    char **dst = ctx->dst;
+    size_t *remaining = ctx->remaining;
+    size_t key_length = strlen(key);
+
+    if (vasqJsonEscapedLength(key, key_length) + 6 >= *remaining) {
+        return false;
+    }
+
+    if (ctx->json_fields++ > 0) {
+        vasqFormatLiteral(dst, remaining, ",", 1);
+    }
+    vasqFormatLiteral(dst, remaining, "\"", 1);
+    vasqJsonAppendString(dst, remaining, key, key_length);
+    vasqFormatLiteral(dst, remaining, string ? "\":\"" : "\":", string ? 3 : 2);
+    return true;
+}
+
+/*
+    Escapes the text written since start and closes the string.
+*/
+static void
+jsonEndString(vasqFormatContext *ctx, char *start)
+{
+    char **dst = ctx->dst;
+    size_t *remaining = ctx->remaining;
+    size_t length, capacity = (*dst - start) + *remaining;
+
+    length = vasqJsonEscapeInPlace(start, *dst - start, capacity);
+    *dst = start + length;
+    *remaining = capacity - length;
+
+    // If the string filled the buffer, then the closing quote comes out of the reserve.
+    if (*remaining <= 1) {
+        ctx->json_reserve--;
+        (*remaining)++;
+    }
+    vasqFormatLiteral(dst, remaining, "\"", 1);
+}
+
+/*
+    Appends pre-rendered JSON fields but only if they fit in their entirety.
+*/
+static void
+jsonAppendRendered(vasqFormatContext *ctx, const char *json, size_t length)
+{
+    if (length == 0 || length + 1 >= *ctx->remaining) {
+        return;
+    }
+
+    if (ctx->json_fields++ > 0) {
+        vasqFormatLiteral(ctx->dst, ctx->remaining, ",", 1);
+    }
+    vasqFormatLiteral(ctx->dst, ctx->remaining, json, length);
+}
+
+static void
+jsonFields(vasqFormatContext *ctx)
+{
+    char **dst = ctx->dst;
+    size_t *remaining = ctx->remaining;
+    const vasqFieldBuffer *context = vasqContextGet();
+
+    ctx->context_done = true;
+
+    jsonAppendRendered(ctx, ctx->head->json_fields, ctx->head->json_fields_length);
+    jsonAppendRendered(ctx, context->json, context->json_length);
+
+    for (size_t k = 0; k < ctx->num_fields; k++) {
+        const vasqField *field = &ctx->fields[k];
+        bool string = (field->type == VASQ_FT_STRING);
+        char *start;
+
+        if (!jsonKey(ctx, field->key, string)) {
+            break;
+        }
+
+        start = *dst;
+        switch (field->type) {
+        case VASQ_FT_STRING:
+            vasqFormatLiteral(dst, remaining, field->value.string, strlen(field->value.string));
+            break;
+        case VASQ_FT_INT: vasqIncSnprintf(dst, remaining, "%lli", field->value.integer); break;
+        case VASQ_FT_UINT: vasqIncSnprintf(dst, remaining, "%llu", field->value.uinteger); break;
+        case VASQ_FT_BOOL:
+            vasqFormatLiteral(dst, remaining, field->value.boolean ? "true" : "false",
+                              field->value.boolean ? 4 : 5);
+            break;
+        default: break;
+        }
+        if (string) {
+            jsonEndString(ctx, start);
+        }
+    }
+}
+
+/*
+    Renders a token as a JSON field.  The header tokens become fields with fixed keys while %_ and %% are
+    dropped.
+*/
+static void
+jsonToken(vasqFormatContext *ctx, char token)
+{
+    const char *key;
+    bool string = true;
+    char *start;
+    char data_key[32];
+
+    switch (token) {
+    case 'M':
+        if (ctx->message_done && ctx->part != FORMAT_PREFIX) {
+            return;
+        }
+        key = "message";
+        break;
+
+    case 'p':
+#ifdef __linux__
+    case 'T':
+#endif
+        key = (token == 'p') ? "pid" : "tid";
+        string = false;
+        break;
+
+    case 'L': key = "level"; break;
+
+    case 'N':
+        if (!ctx->logger->options.name) {
+            return;
+        }
+        key = "logger";
+        break;
+
+    case 'u':
+        key = "epoch";
+        string = false;
+        break;
+
+    case 't': key = "timestamp"; break;
+    case 'h': key = "hour"; break;
+    case 'm': key = "minute"; break;
+    case 's': key = "second"; break;
+    case '3': key = "msec"; break;
+    case '6': key = "usec"; break;
+    case '9': key = "nsec"; break;
+    case 'I': key = "time"; break;
+    case 'F': key = "file"; break;
+    case 'f': key = "function"; break;
+
+    case 'l':
+        key = "line";
+        string = false;
+        break;
+
+    case 'x':
+        vasqSafeSnprintf(data_key, sizeof(data_key), "data%zu", ctx->data_index);
+        key = data_key;
+        break;
+
+    case 'C': jsonFields(ctx); return;
+
+    default: return;
+    }
+
+    if (!jsonKey(ctx, key, string)) {
+        if (token == 'x') {
+            ctx->data_index++;
+        }
+        else if (token == 'M' && ctx->part == FORMAT_PREFIX) {
+            // There's no room for the message so anything the builder appends is dropped.
+            renderToken(ctx, token);
+            ctx->saved_remaining = 0;
+            ctx->message_start = NULL;
+        }
+        return;
+    }
+
+    start = *ctx->dst;
+    renderToken(ctx, token);
+    if (token == 'M' && ctx->part == FORMAT_PREFIX) {
+        ctx->message_start = start;  // The string is closed when the builder commits.
+    }
+    else if (string) {
+        jsonEndString(ctx, start);
+    }
+}
+
+/*
+    Accounts for a token while the part of the format being rendered is skipped.
+*/
+static void
+skipToken(vasqFormatContext *ctx, char token)
+{
+    switch (token) {
+    case 'M':
+        if (ctx->part == FORMAT_SUFFIX) {
+            *ctx->remaining = ctx->saved_remaining;
+            ctx->skipping = false;
+            if (ctx->json) {
+                ctx->json_fields = 1;
+                if (ctx->message_start) {
+                    jsonEndString(ctx, ctx->message_start);
                 }
-                position++;
-                break;
-
-            case '%':
-                if (*remaining > 1) {
-                    *((*dst)++) = '%';
-                    **dst = '\0';
-                    (*remaining)--;
+            }
+        }
+        break;
+
+    case 'x': ctx->data_index++; break;
+
+    case 'C': ctx->context_done = true; break;
+
+    default: break;
+    }
+}
+
+void
+vasqFormatToken(vasqFormatContext *ctx, char token)
+{
+    if (ctx->skipping) {
+        skipToken(ctx, token);
+    }
+    else if (ctx->json) {
+        jsonToken(ctx, token);
+    }
+    else {
+        renderToken(ctx, token);
+    }
+}
+
+/*
+    vasqFormatToken specialized to each token for the VASQ_FMT_* macros.  A formatter is never used in the
+    JSON output mode so only skipping has to be checked.
+*/
+#define DEFINE_TOKEN_FUNCTION(name, token, renderer) \
+    void name(vasqFormatContext *ctx)                \
+    {                                                \
+        if (ctx->skipping) {                         \
+            skipToken(ctx, token);                   \
+        }                                            \
+        else {                                       \
+            renderer(ctx);                           \
+        }                                            \
+    }
+
+DEFINE_TOKEN_FUNCTION(vasqFormatMessage, 'M', tokenMessage)
+DEFINE_TOKEN_FUNCTION(vasqFormatPid, 'p', tokenPid)
+DEFINE_TOKEN_FUNCTION(vasqFormatTid, 'T', tokenTid)
+DEFINE_TOKEN_FUNCTION(vasqFormatLevel, 'L', tokenLevel)
+DEFINE_TOKEN_FUNCTION(vasqFormatPadding, '_', tokenPadding)
+DEFINE_TOKEN_FUNCTION(vasqFormatName, 'N', tokenName)
+DEFINE_TOKEN_FUNCTION(vasqFormatEpoch, 'u', tokenEpoch)
+DEFINE_TOKEN_FUNCTION(vasqFormatTimestamp, 't', tokenTimestamp)
+DEFINE_TOKEN_FUNCTION(vasqFormatHour, 'h', tokenHour)
+DEFINE_TOKEN_FUNCTION(vasqFormatMinute, 'm', tokenMinute)
+DEFINE_TOKEN_FUNCTION(vasqFormatSecond, 's', tokenSecond)
+DEFINE_TOKEN_FUNCTION(vasqFormatMilliseconds, '3', tokenMilliseconds)
+DEFINE_TOKEN_FUNCTION(vasqFormatMicroseconds, '6', tokenMicroseconds)
+DEFINE_TOKEN_FUNCTION(vasqFormatNanoseconds, '9', tokenNanoseconds)
+DEFINE_TOKEN_FUNCTION(vasqFormatIsoTime, 'I', tokenIsoTime)
+DEFINE_TOKEN_FUNCTION(vasqFormatFile, 'F', tokenFile)
+DEFINE_TOKEN_FUNCTION(vasqFormatFunction, 'f', tokenFunction)
+DEFINE_TOKEN_FUNCTION(vasqFormatLine, 'l', tokenLine)
+DEFINE_TOKEN_FUNCTION(vasqFormatData, 'x', tokenData)
+DEFINE_TOKEN_FUNCTION(vasqFormatContextFields, 'C', formatFields)
+
+static void
+runFormat(vasqFormatContext *ctx)
+{
+    vasqLogger *logger = ctx->logger;
+    char **dst = ctx->dst;
+    size_t *remaining = ctx->remaining;
+
+    ctx->json = (logger->options.flags & VASQ_LOGGER_FLAG_JSON);
+    ctx->json_reserve = JSON_RESERVE;
+    if (ctx->json && ctx->part != FORMAT_SUFFIX) {
+        vasqFormatLiteral(dst, remaining, "{", 1);
+        *remaining -= JSON_RESERVE;
+    }
+
+    if (logger->needs & LOG_NEEDS_TIME) {
+        resolveTime(ctx);
+    }
+    if (logger->needs & LOG_NEEDS_PID) {
+        ctx->pid = vasqProcessId();
+    }
+#ifdef __linux__
+    if (logger->needs & LOG_NEEDS_TID) {
+        ctx->tid = vasqThreadId();
+    }
+#endif
+
+    if (logger->options.formatter) {
+        logger->options.formatter(ctx, dst, remaining);
+    }
+    else {
+        for (const logOp *op = logger->ops; op < logger->ops + logger->num_ops; op++) {
+            if (op->token == '\0') {
+                if (!ctx->json) {
+                    vasqFormatLiteral(dst, remaining, logger->literals + op->offset, op->length);
                 }
-                break;
+            }
+            else if (!ctx->skipping && !ctx->json) {
+                op->render(ctx);
+            }
+            else {
+                vasqFormatToken(ctx, op->token);
+            }
+        }
+    }
+
+    if (ctx->skipping) {
+        *remaining = ctx->saved_remaining;
+    }
+
+    if (ctx->json && ctx->part != FORMAT_PREFIX) {
+        if (!ctx->context_done) {
+            jsonFields(ctx);
+        }
+        *remaining += ctx->json_reserve;
+        vasqFormatLiteral(dst, remaining, "}\n", 2);
+    }
+}
+
+/*
+    Hashes a message which the logger's format doesn't render.
+*/
+static uint64_t
+hashMessage(const vasqLogger *logger, const vasqCallSite *site, va_list args)
+{
+    char *text;
+    ssize_t length;
+    uint64_t hash = VASQ_FNV_OFFSET_BASIS;
+    va_list args_copy;
+
+    text = vasqBufferAcquire(logger->max_message_size);
+    if (!text) {
+        return hash;
+    }
 
-            default: __builtin_unreachable();
-            }
-        }
-        else if (*remaining > 1) {
-            *((*dst)++) = c;
-            **dst = '\0';
-            (*remaining)--;
-        }
+    va_copy(args_copy, args);
+    length = vasqSafeVsnprintf(text, logger->max_message_size, site->format, args_copy);
+    va_end(args_copy);
+    if (length > 0) {
+        hash = vasqFnvHash(hash, text, length);
+    }
+    vasqBufferRelease(text);
+    return hash;
+}
+
+/*
+    Returns the hash of the message (whether or not the format renders it) if the logger has
+    VASQ_LOGGER_FLAG_DEDUP set and 0 otherwise.
+*/
+static uint64_t
+vlogToBuffer(const vasqLoggerHead *head, const vasqCallSite *site, const vasqField *fields, size_t num_fields,
+             char **dst, size_t *remaining, va_list args)
+{
+    vasqLogger *logger = head->root;
+    vasqFormatContext ctx = {
+        .logger = logger,
+        .head = head,
+        .site = site,
+        .fields = fields,
+        .num_fields = num_fields,
+        .dst = dst,
+        .remaining = remaining,
+    };
+
+    va_copy(ctx.args, args);
+    runFormat(&ctx);
+    va_end(ctx.args);
+    if ((logger->options.flags & VASQ_LOGGER_FLAG_DEDUP) && !ctx.message_done) {
+        ctx.message_hash = hashMessage(logger, site, args);
     }
+    return ctx.message_hash;
 }
 
 static void
-logToBuffer(vasqLogger *logger, vasqLogLevel level, const char *file_name, const char *function_name,
-            unsigned int line_no, char **dst, size_t *remaining, const char *format, ...)
+logToBuffer(const vasqLoggerHead *head, const vasqCallSite *site, char **dst, size_t *remaining, ...)
 {
     va_list args;
 
-    va_start(args, format);
-    vlogToBuffer(logger, level, file_name, function_name, line_no, dst, remaining, format, args);
+    va_start(args, remaining);
+    vlogToBuffer(head, site, NULL, 0, dst, remaining, args);
     va_end(args);
 }
 
+/*
+    Renders the part of a format before or after %M.  For the suffix, message_start is the value returned when
+    the prefix was rendered.  For the prefix, the return value is where the message starts or NULL if there
+    was no room for it.
+*/
+static char *
+renderPart(const vasqLoggerHead *head, const vasqCallSite *site, char **dst, size_t *remaining,
+           enum formatPart part, char *message_start)
+{
+    vasqFormatContext ctx = {
+        .logger = head->root,
+        .head = head,
+        .site = site,
+        .dst = dst,
+        .remaining = remaining,
+        .message_start = *dst,
+        .part = part,
+        .message_done = true,
+    };
+
+    if (part == FORMAT_SUFFIX) {
+        ctx.message_start = message_start;
+        ctx.saved_remaining = *remaining;
+        *remaining = 0;
+        ctx.skipping = true;
+    }
+
+    runFormat(&ctx);
+    return ctx.message_start;
+}
+
 static void
 writeToFd(void *user, vasqLogLevel level, const char *text, size_t size)
 {
@@ -274,6 +1205,88 @@ vasqFdHandlerCreate(int fd, unsigned int flags, vasqHandler *handler)
     return 0;
 }
 
+static void
+emitRepeats(vasqLogger *logger, const vasqCallSite *site, unsigned long repeats)
+{
+    char *output, *dst;
+    size_t remaining;
+    vasqCallSite summary = *site;
+
+    output = vasqBufferAcquire(logger->max_message_size);
+    if (!output) {
+        return;
+    }
+
+    summary.format = "Last message repeated %lu time%s";
+    dst = output;
+    remaining = logger->max_message_size;
+    logToBuffer(&logger->head, &summary, &dst, &remaining, repeats, (repeats == 1) ? "" : "s");
+    logger->handler.func(logger->handler.user, summary.level, output, dst - output);
+    vasqBufferRelease(output);
+}
+
+/*
+    Returns true if a message repeats the logger's last message within the dedup window and so should be
+    suppressed.  Otherwise, the message becomes the last one and the previous run, if any, is reported.  A
+    message is identified by its text, its file name, line number, and level, the fields of the child logger
+    (if any), the message's own fields, and the calling thread's context fields.
+*/
+static bool
+dedupMessage(vasqLogger *logger, const vasqLoggerHead *head, const vasqCallSite *site,
+             const vasqField *fields, size_t num_fields, uint64_t message_hash)
+{
+    uint64_t key;
+    unsigned long repeats;
+    vasqCallSite last_site;
+    struct timespec now;
+    const vasqFieldBuffer *context = vasqContextGet();
+
+    key = vasqFnvHash(message_hash, &site->file_name, sizeof(site->file_name));
+    key = vasqFnvHash(key, &site->line_no, sizeof(site->line_no));
+    key = vasqFnvHash(key, &site->level, sizeof(site->level));
+    key = vasqFnvHash(key, head->fields, head->fields_length);
+    key = vasqFnvHash(key, context->text, context->text_length);
+    for (size_t k = 0; k < num_fields; k++) {
+        const vasqField *field = &fields[k];
+
+        // The terminators keep the boundaries between keys and values.
+        key = vasqFnvHash(key, field->key, strlen(field->key) + 1);
+        key = vasqFnvHash(key, &field->type, sizeof(field->type));
+        switch (field->type) {
+        case VASQ_FT_STRING:
+            key = vasqFnvHash(key, field->value.string, strlen(field->value.string) + 1);
+            break;
+        case VASQ_FT_INT: key = vasqFnvHash(key, &field->value.integer, sizeof(field->value.integer)); break;
+        case VASQ_FT_UINT:
+            key = vasqFnvHash(key, &field->value.uinteger, sizeof(field->value.uinteger));
+            break;
+        case VASQ_FT_BOOL: key = vasqFnvHash(key, &field->value.boolean, sizeof(field->value.boolean)); break;
+        default: break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    pthread_mutex_lock(&logger->dedup_lock);
+    if (key == logger->dedup_key && now.tv_sec - logger->dedup_start < (time_t)logger->options.dedup_window) {
+        logger->repeats++;
+        pthread_mutex_unlock(&logger->dedup_lock);
+        return true;
+    }
+    repeats = logger->repeats;
+    last_site = logger->dedup_site;
+    logger->dedup_site = *site;
+    logger->dedup_key = key;
+    logger->dedup_start = now.tv_sec;
+    logger->repeats = 0;
+    pthread_mutex_unlock(&logger->dedup_lock);
+
+    // The handler isn't called with the lock held in case it logs.
+    if (repeats > 0) {
+        emitRepeats(logger, &last_site, repeats);
+    }
+    return false;
+}
+
 vasqLogger *
 vasqLoggerCreate(vasqLogLevel level, const char *format, const vasqHandler *handler,
                  const vasqLoggerOptions *options)
@@ -291,31 +1304,99 @@ vasqLoggerCreate(vasqLogLevel level, const char *format, const vasqHandler *hand
         return NULL;
     }
 
-    if (!validLogFormat(format)) {
+    if (options->flags & VASQ_LOGGER_FLAG_JSON) {
+        // A formatter's literals can't be suppressed.
+        if (options->formatter || (options->max_message_size && options->max_message_size < JSON_MIN_SIZE)) {
+            errno_value = EINVAL;
+            goto error;
+        }
+    }
+
+    // Each chunk of a spilled message has to hold at least one character.
+    if (options->flags & VASQ_LOGGER_FLAG_SPILL && options->max_message_size == 1) {
+        errno_value = EINVAL;
+        goto error;
+    }
+
+    if (options->formatter) {
+        format = "";  // The formatter takes the place of the format string.
+    }
+    else if (!validLogFormat(format)) {
         errno_value = EINVAL;
         goto error;
     }
 
+    vasqProcessInit();
+    vasqBufferInit();
+
     logger = malloc(sizeof(*logger));
     if (!logger) {
         errno_value = ENOMEM;
         goto error;
     }
 
-    logger->format = format;
+    if (!compileLogFormat(logger, format)) {
+        free(logger);
+        errno_value = ENOMEM;
+        goto error;
+    }
+
     memcpy(&logger->handler, handler, sizeof(*handler));
     memcpy(&logger->options, options, sizeof(*options));
-    logger->level = level;
+    logger->head.root = logger;
+    logger->head.fields = "";
+    logger->head.json_fields = "";
+    logger->head.fields_length = 0;
+    logger->head.json_fields_length = 0;
+    logger->head.level = VASQ_LL_NONE;  // Set once the logger is complete.
+    logger->head.sample_level = LEVEL_OFF;
+    logger->tail_level = LEVEL_OFF;
+    logger->tail_flush_level = VASQ_LL_NONE;
+    pthread_mutex_init(&logger->dedup_lock, NULL);
+    vasqBudgetInit(&logger->budget);
+    logger->dedup_key = 0;
+    logger->repeats = 0;
+    if (!logger->options.dedup_window) {
+        logger->options.dedup_window = VASQ_DEDUP_WINDOW;
+    }
+    logger->serial = __atomic_add_fetch(&next_serial, 1, __ATOMIC_RELAXED);
+    logger->data_generation = 0;
+    logger->static_data = NULL;
+    logger->max_message_size = options->max_message_size ? options->max_message_size : VASQ_LOGGING_LENGTH;
+    if (!logger->options.clock) {
+        logger->options.clock = vasqClockRealtime;
+    }
+    vasqClockPrepare(logger->options.clock);
 
     if (options->name) {
         logger->options.name = strdup(options->name);
         if (!logger->options.name) {
+            free(logger->ops);
+            free(logger);
+            errno_value = ENOMEM;
+            goto error;
+        }
+    }
+
+    if (options->processor && options->data_mode == VASQ_DATA_STATIC) {
+        logger->static_data = calloc(VASQ_DATA_CACHE_SLOTS, sizeof(*logger->static_data));
+        if (!logger->static_data) {
+            free(logger->options.name);
+            free(logger->ops);
             free(logger);
             errno_value = ENOMEM;
             goto error;
         }
+
+        // Render the values now for a format string.  A formatter's are rendered when first used.
+        for (size_t k = 0, idx = 0; k < logger->num_ops && idx < VASQ_DATA_CACHE_SLOTS; k++) {
+            if (logger->ops[k].token == 'x') {
+                staticData(logger, idx++, VASQ_LL_NONE);
+            }
+        }
     }
 
+    vasqBudgetSetLevel(&logger->budget, &logger->head.level, level);
     return logger;
 
 error:
@@ -329,15 +1410,26 @@ error:
 void
 vasqLoggerFree(vasqLogger *logger)
 {
-    if (!logger) {
+    if (!logger || logger->head.root != logger) {  // Child loggers aren't freed.
         return;
     }
 
+    // The logger is unregistered first so that vasqctl can't re-enable it.
+    vasqControlUnregister(logger);
+    vasqCallSitesSetLevel(&logger->head.level, VASQ_LL_NONE);
+    if (logger->repeats > 0) {
+        emitRepeats(logger, &logger->dedup_site, logger->repeats);
+    }
+    pthread_mutex_destroy(&logger->dedup_lock);
+    pthread_mutex_destroy(&logger->budget.lock);
+
     if (logger->handler.cleanup) {
         logger->handler.cleanup(logger->handler.user);
     }
 
     free(logger->options.name);
+    free(logger->ops);
+    free(logger->static_data);
 
     free(logger);
 }
@@ -345,23 +1437,184 @@ vasqLoggerFree(vasqLogger *logger)
 vasqLogLevel
 vasqLoggerLevel(vasqLogger *logger)
 {
-    return logger ? logger->level : VASQ_LL_NONE;
+    logger = rootLogger(logger);
+    return logger ? loggerLevel(logger) : VASQ_LL_NONE;
+}
+
+void
+vasqLoggerBumpDataGeneration(vasqLogger *logger)
+{
+    logger = rootLogger(logger);
+    if (logger) {
+        __atomic_add_fetch(&logger->data_generation, 1, __ATOMIC_RELEASE);
+    }
 }
 
 void
 vasqSetLoggerLevel(vasqLogger *logger, vasqLogLevel level)
 {
+    logger = rootLogger(logger);
     if (logger) {
-        logger->level = level;
+        vasqLoggerApplyLevel(logger, level);
+        vasqControlLevelChanged(logger, level);
     }
 }
 
+void
+vasqLoggerApplyLevel(vasqLogger *logger, vasqLogLevel level)
+{
+    vasqBudgetSetLevel(&logger->budget, &logger->head.level, level);
+}
+
+int
+vasqSetLoggerBudget(vasqLogger *logger, unsigned int percent, vasqLogLevel floor)
+{
+    logger = rootLogger(logger);
+    if (!logger || floor < VASQ_LL_ALWAYS || floor > VASQ_LL_TRACE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    vasqBudgetSet(&logger->budget, &logger->head.level, percent, floor);
+    return 0;
+}
+
+int
+vasqLoggerBudgetStats(vasqLogger *logger, vasqBudgetStats *stats)
+{
+    logger = rootLogger(logger);
+    if (!logger) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&logger->budget.lock);
+    stats->level = loggerLevel(logger);
+    stats->steps = logger->budget.steps;
+    stats->load = logger->budget.load;
+    stats->degradations = logger->budget.degradations;
+    stats->restorations = logger->budget.restorations;
+    pthread_mutex_unlock(&logger->budget.lock);
+    return 0;
+}
+
+/*
+    Returns the time at which logging a message started if the logger has a CPU budget and 0 otherwise.
+*/
+static uint64_t
+budgetStart(const vasqLogger *logger)
+{
+    return (__atomic_load_n(&logger->budget.percent, __ATOMIC_RELAXED) > 0) ? vasqBudgetNow() : 0;
+}
+
+/*
+    Called after a message has been logged by a logger with a CPU budget.
+*/
+static void
+chargeBudget(vasqLogger *logger, uint64_t start)
+{
+    unsigned int load;
+    vasqLogLevel level;
+
+    switch (vasqBudgetCharge(&logger->budget, &logger->head.level, start)) {
+    case 1:
+        load = __atomic_load_n(&logger->budget.load, __ATOMIC_RELAXED);
+        level = loggerLevel(logger);
+        vasqLogStatement(logger, VASQ_LL_ALWAYS, VASQ_CONTEXT_PARAMS,
+                         "Logging used %u.%u%% of wall time; lowered the level to %s", load / 10, load % 10,
+                         logLevelName(level));
+        break;
+
+    case -1:
+        level = loggerLevel(logger);
+        vasqLogStatement(logger, VASQ_LL_ALWAYS, VASQ_CONTEXT_PARAMS, "Raised the level to %s",
+                         logLevelName(level));
+        break;
+
+    default: break;
+    }
+}
+
+int
+vasqSetLoggerSampling(vasqLogger *logger, vasqLogLevel level, double ratio)
+{
+    logger = rootLogger(logger);
+    if (!logger || level < VASQ_LL_NONE || level > VASQ_LL_TRACE || !(ratio >= 0 && ratio <= 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Sampling hashes are never 0 so a threshold of 0 keeps nothing.
+    __atomic_store_n(&logger->head.sample_threshold, (uint32_t)(ratio * UINT32_MAX), __ATOMIC_RELAXED);
+    __atomic_store_n(&logger->head.sample_level, (level == VASQ_LL_NONE) ? LEVEL_OFF : level,
+                     __ATOMIC_RELAXED);
+    return 0;
+}
+
+int
+vasqSetLoggerTail(vasqLogger *logger, vasqLogLevel level, vasqLogLevel flush_level)
+{
+    logger = rootLogger(logger);
+    if (!logger || level < VASQ_LL_NONE || level > VASQ_LL_TRACE || flush_level < VASQ_LL_NONE ||
+        (level != VASQ_LL_NONE && flush_level >= level)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    __atomic_store_n(&logger->tail_flush_level, flush_level, __ATOMIC_RELAXED);
+    __atomic_store_n(&logger->tail_level, (level == VASQ_LL_NONE) ? LEVEL_OFF : level, __ATOMIC_RELAXED);
+    return 0;
+}
+
 const char *
 vasqLoggerName(vasqLogger *logger)
 {
+    logger = rootLogger(logger);
     return logger ? logger->options.name : NULL;
 }
 
+vasqLogger *
+vasqChildLoggerInit(vasqChildLogger *child, vasqLogger *parent, const char *key, const char *format, ...)
+{
+    const vasqLoggerHead *parent_head = (const vasqLoggerHead *)parent;
+    vasqFieldBuffer buffer;
+    bool success;
+    va_list args;
+
+    if (!child || !parent || !key || !format) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    buffer.text = child->fields;
+    buffer.json = child->json_fields;
+    buffer.size = sizeof(child->fields);
+
+    // The parent's fields always fit since it's either a root logger or a child logger itself.
+    memcpy(child->fields, parent_head->fields, parent_head->fields_length);
+    memcpy(child->json_fields, parent_head->json_fields, parent_head->json_fields_length);
+    buffer.text_length = parent_head->fields_length;
+    buffer.json_length = parent_head->json_fields_length;
+    child->fields[buffer.text_length] = '\0';
+    child->json_fields[buffer.json_length] = '\0';
+
+    va_start(args, format);
+    success = vasqRenderField(&buffer, key, format, args);
+    va_end(args);
+    if (!success) {
+        return NULL;
+    }
+
+    child->head.root = parent_head->root;
+    child->head.fields = child->fields;
+    child->head.json_fields = child->json_fields;
+    child->head.fields_length = buffer.text_length;
+    child->head.json_fields_length = buffer.json_length;
+    child->head.level = VASQ_LL_NONE;  // Only the root's level is used.
+
+    return (vasqLogger *)child;
+}
+
 void
 vasqLogStatement(vasqLogger *logger, vasqLogLevel level, const char *file_name, const char *function_name,
                  unsigned int line_no, const char *format, ...)
@@ -377,18 +1630,168 @@ void
 vasqVLogStatement(vasqLogger *logger, vasqLogLevel level, const char *file_name, const char *function_name,
                   unsigned int line_no, const char *format, va_list args)
 {
-    char output[VASQ_LOGGING_LENGTH];
-    char *dst = output;
-    size_t remaining = sizeof(output);
+    const vasqCallSite site = {
+        .file_name = file_name,
+        .function_name = function_name,
+        .format = format,
+        .line_no = line_no,
+        .base_offset = VASQ_BASE_OFFSET_UNKNOWN,
+        .level = level,
+    };
+
+    vasqVLogSite(logger, &site, args);
+}
+
+void
+vasqLogSite(vasqLogger *logger, const vasqCallSite *site, ...)
+{
+    va_list args;
+
+    va_start(args, site);
+    vasqVLogSite(logger, site, args);
+    va_end(args);
+}
+
+/*
+    Called when a message filled the output buffer and the logger has VASQ_LOGGER_FLAG_SPILL set.  The message
+    is rendered again into successively larger buffers until it fits and is then passed to the handler in
+    chunks no larger than the logger's output buffer.  Returns false if no larger buffer could be allocated.
+*/
+static bool
+spillMessage(const vasqLoggerHead *head, const vasqCallSite *site, const vasqField *fields, size_t num_fields,
+             va_list args)
+{
+    vasqLogger *logger = head->root;
+    size_t chunk_size = logger->max_message_size - 1;
+    char *output = NULL;
+    char *dst;
+    size_t remaining;
+
+    for (size_t size = logger->max_message_size * 2; size <= VASQ_SPILL_LIMIT; size *= 2) {
+        free(output);
+        output = malloc(size);
+        if (!output) {
+            return false;
+        }
+
+        dst = output;
+        remaining = size;
+        vlogToBuffer(head, site, fields, num_fields, &dst, &remaining, args);
+        if (remaining > 1) {
+            break;
+        }
+    }
+
+    if (!output) {
+        return false;
+    }
+
+    for (const char *chunk = output; chunk < dst; chunk += chunk_size) {
+        char saved;
+        size_t length = MIN(chunk_size, (size_t)(dst - chunk));
+
+        // Handlers expect null-terminated text.
+        saved = chunk[length];
+        ((char *)chunk)[length] = '\0';
+        logger->handler.func(logger->handler.user, site->level, chunk, length);
+        ((char *)chunk)[length] = saved;
+    }
+
+    free(output);
+    return true;
+}
+
+/*
+    The last step of logging a rendered message, whether it came from vasqVLogFields, vasqHexDump, or a log
+    builder.  The message is held back by the thread's tail buffer, suppressed as a repeat of the last one, or
+    passed to the handler.  message_hash is 0 if the message isn't to be deduplicated.  spill_args holds the
+    message's arguments if it filled the output buffer and is to be spilled and is NULL otherwise.  start is
+    the value of budgetStart when the caller began working on the message.
+*/
+static void
+emitMessage(const vasqLoggerHead *head, const vasqCallSite *site, const vasqField *fields, size_t num_fields,
+            uint64_t message_hash, const char *text, size_t length, va_list *spill_args, uint64_t start)
+{
+    vasqLogger *logger = head->root;
+    bool held = false;
+
+    if (vasqTailActive()) {
+        held = site->level >= __atomic_load_n(&logger->tail_level, __ATOMIC_RELAXED);
+        if (site->level <= __atomic_load_n(&logger->tail_flush_level, __ATOMIC_RELAXED)) {
+            vasqTailFlush();
+        }
+    }
+
+    if (held) {
+        vasqTailAppend(&logger->handler, site->level, text, length);
+    }
+    else if (message_hash == 0 || !dedupMessage(logger, head, site, fields, num_fields, message_hash)) {
+        if (!spill_args || !spillMessage(head, site, fields, num_fields, *spill_args)) {
+            logger->handler.func(logger->handler.user, site->level, text, length);
+        }
+    }
+
+    if (start) {
+        chargeBudget(logger, start);
+    }
+}
+
+void
+vasqVLogSite(vasqLogger *logger, const vasqCallSite *site, va_list args)
+{
+    vasqVLogFields(logger, site, NULL, 0, args);
+}
+
+void
+vasqLogFields(vasqLogger *logger, const vasqCallSite *site, const vasqField *fields, size_t num_fields, ...)
+{
+    va_list args;
+
+    va_start(args, num_fields);
+    vasqVLogFields(logger, site, fields, num_fields, args);
+    va_end(args);
+}
+
+void
+vasqVLogFields(vasqLogger *logger, const vasqCallSite *site, const vasqField *fields, size_t num_fields,
+               va_list args)
+{
+    char *output, *dst;
+    size_t remaining;
     int remote_errno;
+    uint64_t message_hash, start;
+    const vasqLoggerHead *head = (const vasqLoggerHead *)logger;
 
-    if (!logger || level > logger->level || logger->level == VASQ_LL_NONE) {
+    vasqControlPoll();
+    logger = rootLogger(logger);
+    if (!logger || !siteEnabled(logger, site)) {
         return;
     }
 
     remote_errno = errno;
-    vlogToBuffer(logger, level, file_name, function_name, line_no, &dst, &remaining, format, args);
-    logger->handler.func(logger->handler.user, level, output, dst - output);
+    start = budgetStart(logger);
+
+    output = vasqBufferAcquire(logger->max_message_size);
+    if (!output) {
+        goto done;
+    }
+
+    dst = output;
+    remaining = logger->max_message_size;
+    message_hash = vlogToBuffer(head, site, fields, num_fields, &dst, &remaining, args);
+    if (remaining > 1 || !(logger->options.flags & VASQ_LOGGER_FLAG_SPILL)) {
+        emitMessage(head, site, fields, num_fields, message_hash, output, dst - output, NULL, start);
+    }
+    else {
+        va_list spill_args;
+
+        va_copy(spill_args, args);
+        emitMessage(head, site, fields, num_fields, message_hash, output, dst - output, &spill_args, start);
+        va_end(spill_args);
+    }
+    vasqBufferRelease(output);
+
+done:
     errno = remote_errno;
 }
 
@@ -407,15 +1810,21 @@ vasqVRawLog(vasqLogger *logger, const char *format, va_list args)
 {
     int remote_errno;
     ssize_t written;
-    char output[VASQ_LOGGING_LENGTH];
+    char *output;
 
-    if (!logger || logger->level == VASQ_LL_NONE) {
+    vasqControlPoll();
+    logger = rootLogger(logger);
+    if (!logger || loggerLevel(logger) == VASQ_LL_NONE) {
         return;
     }
 
     remote_errno = errno;
-    written = vasqSafeVsnprintf(output, sizeof(output), format, args);
-    logger->handler.func(logger->handler.user, VASQ_LL_NONE, output, written);
+    output = vasqBufferAcquire(logger->max_message_size);
+    if (output) {
+        written = vasqSafeVsnprintf(output, logger->max_message_size, format, args);
+        logger->handler.func(logger->handler.user, VASQ_LL_NONE, output, written);
+        vasqBufferRelease(output);
+    }
     errno = remote_errno;
 }
 
@@ -428,25 +1837,50 @@ vasqHexDump(vasqLogger *logger, const char *file_name, const char *function_name
 #define HEXDUMP_BUFFER_SIZE (NUM_HEXDUMP_LINES * HEXDUMP_LINE_LENGTH + 250)
 
     const unsigned char *bytes = data;
-    char output[VASQ_LOGGING_LENGTH + HEXDUMP_BUFFER_SIZE];
-    char *dst = output;
+    char *output, *dst, *message = NULL;
+    bool json;
     int remote_errno;
     unsigned int actual_dump_size;
-    size_t remaining = sizeof(output);
-    vasqLogLevel dump_level;
-
+    size_t remaining;
+    uint64_t message_hash = 0, start;
+    vasqCallSite site = {
+        .file_name = file_name,
+        .function_name = function_name,
+        .format = "%s (%zu byte%s):",
+        .line_no = line_no,
+        .base_offset = VASQ_BASE_OFFSET_UNKNOWN,
+    };
+    const vasqLoggerHead *head = (const vasqLoggerHead *)logger;
+
+    vasqControlPoll();
+    logger = rootLogger(logger);
     if (!logger) {
         return;
     }
-    dump_level = (logger->options.flags & VASQ_LOGGER_FLAG_HEX_DUMP_INFO) ? VASQ_LL_INFO : VASQ_LL_DEBUG;
-    if (logger->level < dump_level) {
+    site.level = (logger->options.flags & VASQ_LOGGER_FLAG_HEX_DUMP_INFO) ? VASQ_LL_INFO : VASQ_LL_DEBUG;
+    if (!levelEnabled(logger, site.level)) {
         return;
     }
 
     remote_errno = errno;
+    start = budgetStart(logger);
+
+    // In the JSON output mode, the dump is part of the message so it needs room to be escaped.
+    json = (logger->options.flags & VASQ_LOGGER_FLAG_JSON);
+    remaining = logger->max_message_size + (json ? 2 : 1) * HEXDUMP_BUFFER_SIZE;
+    output = vasqBufferAcquire(remaining);
+    if (!output) {
+        goto done;
+    }
+    dst = output;
 
-    logToBuffer(logger, dump_level, file_name, function_name, line_no, &dst, &remaining,
-                "%s (%zu byte%s):", name, size, (size == 1) ? "" : "s");
+    if (json) {
+        message = renderPart(head, &site, &dst, &remaining, FORMAT_PREFIX, NULL);
+        vasqIncSnprintf(&dst, &remaining, "%s (%zu byte%s):\n", name, size, (size == 1) ? "" : "s");
+    }
+    else {
+        logToBuffer(head, &site, &dst, &remaining, name, size, (size == 1) ? "" : "s");
+    }
 
     actual_dump_size = MIN(size, VASQ_HEXDUMP_SIZE);
     for (unsigned int k = 0; k < actual_dump_size; k += VASQ_HEXDUMP_WIDTH) {
@@ -477,7 +1911,19 @@ vasqHexDump(vasqLogger *logger, const char *file_name, const char *function_name
                         (size - actual_dump_size == 1) ? "" : "s");
     }
 
-    logger->handler.func(logger->handler.user, dump_level, output, dst - output);
+    if (json) {
+        renderPart(head, &site, &dst, &remaining, FORMAT_SUFFIX, message);
+    }
+
+    if (logger->options.flags & VASQ_LOGGER_FLAG_DEDUP) {
+        message_hash = vasqFnvHash(VASQ_FNV_OFFSET_BASIS, name, strlen(name) + 1);
+        message_hash = vasqFnvHash(message_hash, &size, sizeof(size));
+        message_hash = vasqFnvHash(message_hash, bytes, actual_dump_size);
+    }
+    emitMessage(head, &site, NULL, 0, message_hash, output, dst - output, NULL, start);
+    vasqBufferRelease(output);
+
+done:
     errno = remote_errno;
 
 #undef NUM_HEXDUMP_LINES
@@ -485,4 +1931,128 @@ vasqHexDump(vasqLogger *logger, const char *file_name, const char *function_name
 #undef HEXDUMP_BUFFER_SIZE
 }
 
+bool
+vasqLogBuilderBegin(vasqLogBuilder *builder, vasqLogger *logger, vasqLogLevel level, const char *file_name,
+                    const char *function_name, unsigned int line_no)
+{
+    vasqLogger *root = rootLogger(logger);
+    int remote_errno;
+    uint64_t start;
+
+    builder->site.file_name = file_name;
+    builder->site.function_name = function_name;
+    builder->site.format = "";
+    builder->site.line_no = line_no;
+    builder->site.base_offset = VASQ_BASE_OFFSET_UNKNOWN;
+    builder->site.level = level;
+    builder->logger = NULL;
+    builder->buffer = NULL;
+    builder->dst = NULL;
+    builder->remaining = 0;  // Makes the appending functions no-ops.
+
+    vasqControlPoll();
+    if (!root || !levelEnabled(root, level)) {
+        return false;
+    }
+
+    remote_errno = errno;
+    start = budgetStart(root);
+
+    builder->buffer = vasqBufferAcquire(root->max_message_size);
+    if (!builder->buffer) {
+        errno = remote_errno;
+        return false;
+    }
+    builder->logger = logger;
+    builder->dst = builder->buffer;
+    builder->remaining = root->max_message_size;
+    builder->buffer[0] = '\0';
+
+    builder->message =
+        renderPart(&logger->head, &builder->site, &builder->dst, &builder->remaining, FORMAT_PREFIX, NULL);
+    if (start) {
+        chargeBudget(root, start);
+    }
+    errno = remote_errno;
+
+    return true;
+}
+
+void
+vasqLogBuilderAppend(vasqLogBuilder *builder, const char *text, size_t length)
+{
+    vasqFormatLiteral(&builder->dst, &builder->remaining, text, length);
+}
+
+void
+vasqLogBuilderString(vasqLogBuilder *builder, const char *string)
+{
+    vasqFormatLiteral(&builder->dst, &builder->remaining, string, strlen(string));
+}
+
+void
+vasqLogBuilderInt(vasqLogBuilder *builder, long long value)
+{
+    if (value < 0) {
+        vasqFormatLiteral(&builder->dst, &builder->remaining, "-", 1);
+        vasqLogBuilderUint(builder, -(unsigned long long)value);
+    }
+    else {
+        vasqLogBuilderUint(builder, value);
+    }
+}
+
+void
+vasqLogBuilderUint(vasqLogBuilder *builder, unsigned long long value)
+{
+    char digits[20];
+    unsigned int idx = sizeof(digits);
+
+    do {
+        digits[--idx] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    vasqFormatLiteral(&builder->dst, &builder->remaining, digits + idx, sizeof(digits) - idx);
+}
+
+void
+vasqLogBuilderHex(vasqLogBuilder *builder, const void *data, size_t size)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    const unsigned char *bytes = data;
+
+    for (size_t k = 0; k < size && builder->remaining > 2; k++) {
+        char pair[2] = {hex_digits[bytes[k] >> 4], hex_digits[bytes[k] & 0x0f]};
+
+        vasqFormatLiteral(&builder->dst, &builder->remaining, pair, sizeof(pair));
+    }
+}
+
+void
+vasqLogBuilderCommit(vasqLogBuilder *builder)
+{
+    int remote_errno;
+    uint64_t message_hash = 0, start;
+
+    if (!builder->logger) {
+        return;
+    }
+
+    remote_errno = errno;
+    start = budgetStart(builder->logger->head.root);
+    if ((builder->logger->head.root->options.flags & VASQ_LOGGER_FLAG_DEDUP) && builder->message) {
+        message_hash = vasqFnvHash(VASQ_FNV_OFFSET_BASIS, builder->message, builder->dst - builder->message);
+    }
+    renderPart(&builder->logger->head, &builder->site, &builder->dst, &builder->remaining, FORMAT_SUFFIX,
+               builder->message);
+    emitMessage(&builder->logger->head, &builder->site, NULL, 0, message_hash, builder->buffer,
+                builder->dst - builder->buffer, NULL, start);
+    vasqBufferRelease(builder->buffer);
+    errno = remote_errno;
+
+    builder->logger = NULL;  // Guards against committing twice.
+    builder->buffer = NULL;
+}
+
 #endif  // VASQ_NO_LOGGING
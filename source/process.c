@@ -0,0 +1,76 @@
+#ifndef VASQ_NO_LOGGING
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "vasq/safe_snprintf.h"
+
+static pthread_once_t process_once = PTHREAD_ONCE_INIT;
+static vasqIdString pid_cache;
+static unsigned int fork_generation;
+#ifdef __linux__
+static __thread vasqIdString tid_cache;
+#endif
+
+static void
+renderId(vasqIdString *id, long value)
+{
+    ssize_t written;
+
+    written = vasqSafeSnprintf(id->digits, sizeof(id->digits), "%li", value);
+    id->length = (written > 0) ? written : 0;
+}
+
+static void
+afterFork(void)
+{
+    // The child has a new PID and its only thread has a new TID.  The child is single-threaded at this point
+    // so there's no need for synchronization.
+    renderId(&pid_cache, getpid());
+#ifdef __linux__
+    tid_cache.length = 0;
+#endif
+    fork_generation++;
+}
+
+static void
+processInit(void)
+{
+    renderId(&pid_cache, getpid());
+    pthread_atfork(NULL, NULL, afterFork);
+}
+
+void
+vasqProcessInit(void)
+{
+    pthread_once(&process_once, processInit);
+}
+
+const vasqIdString *
+vasqProcessId(void)
+{
+    return &pid_cache;
+}
+
+unsigned int
+vasqForkGeneration(void)
+{
+    return fork_generation;
+}
+
+#ifdef __linux__
+
+const vasqIdString *
+vasqThreadId(void)
+{
+    if (tid_cache.length == 0) {
+        renderId(&tid_cache, syscall(SYS_gettid));
+    }
+    return &tid_cache;
+}
+
+#endif
+
+#endif  // VASQ_NO_LOGGING
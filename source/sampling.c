@@ -0,0 +1,50 @@
+#ifndef VASQ_NO_LOGGING
+
+#include <stdint.h>
+
+#include "internal.h"
+
+#define FNV_PRIME 0x100000001b3ULL
+
+__thread uint32_t _vasq_sample_hash;
+
+uint64_t
+vasqFnvHash(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t k = 0; k < size; k++) {
+        hash ^= bytes[k];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/*
+    FNV-1a followed by MurmurHash3's finalizer so that keys differing only in their last bytes (e.g.,
+    sequential request IDs) are spread over the whole range.  The hash must never change since processes
+    running different versions of the library should make the same decision for a given key.
+*/
+static uint32_t
+hashKey(const void *key, size_t size)
+{
+    uint64_t hash = vasqFnvHash(VASQ_FNV_OFFSET_BASIS, key, size);
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    hash >>= 32;
+    return hash ? hash : 1;  // 0 is reserved for threads with no key.
+}
+
+void
+vasqSetSamplingKey(const void *key, size_t size)
+{
+    _vasq_sample_hash = key ? hashKey(key, size) : 0;
+}
+
+#endif  // VASQ_NO_LOGGING
@@ -0,0 +1,150 @@
+#ifndef VASQ_NO_LOGGING
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "vasq/config.h"
+
+typedef struct tailRecord {
+    vasqHandlerFunc *func;
+    void *user;
+    vasqLogLevel level;
+    size_t length;
+} tailRecord;
+
+/*
+    The texts of a thread's held back messages are stored back to back so that consecutive messages for the
+    same handler can be passed in one call.  records[k] describes the kth oldest message.
+*/
+static __thread struct {
+    char *text;
+    tailRecord *records;
+    size_t text_length;
+    unsigned int count;
+    bool active;
+} tail;
+
+static pthread_once_t tail_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tail_key;
+
+static void
+freeTail(void *data)
+{
+    free(data);
+}
+
+static void
+tailInit(void)
+{
+    pthread_key_create(&tail_key, freeTail);
+}
+
+bool
+vasqTailActive(void)
+{
+    return tail.active;
+}
+
+void
+vasqTailStart(void)
+{
+    if (!tail.text) {
+        char *data;
+
+        pthread_once(&tail_once, tailInit);
+        data = malloc(VASQ_TAIL_MESSAGES * sizeof(*tail.records) + VASQ_TAIL_SIZE + 1);
+        if (!data) {
+            return;  // Messages are emitted as usual.
+        }
+        // The key's destructor frees the buffer when the thread exits.
+        pthread_setspecific(tail_key, data);
+        tail.records = (tailRecord *)data;
+        tail.text = data + VASQ_TAIL_MESSAGES * sizeof(*tail.records);
+    }
+
+    tail.text_length = 0;
+    tail.count = 0;
+    tail.active = true;
+}
+
+void
+vasqTailStop(void)
+{
+    tail.active = false;
+}
+
+void
+vasqTailFlush(void)
+{
+    size_t offset = 0;
+    unsigned int count = tail.count;
+
+    if (!tail.active) {
+        return;
+    }
+
+    // Anything logged by the handlers is emitted directly.
+    tail.active = false;
+
+    for (unsigned int k = 0; k < count;) {
+        const tailRecord *first = &tail.records[k];
+        vasqLogLevel level = first->level;
+        size_t length = 0;
+        char saved;
+
+        for (; k < count && tail.records[k].func == first->func && tail.records[k].user == first->user; k++) {
+            length += tail.records[k].length;
+            if (tail.records[k].level < level) {
+                level = tail.records[k].level;
+            }
+        }
+
+        // Null-terminate the batch for the handler.
+        saved = tail.text[offset + length];
+        tail.text[offset + length] = '\0';
+        first->func(first->user, level, tail.text + offset, length);
+        tail.text[offset + length] = saved;
+        offset += length;
+    }
+}
+
+void
+vasqTailAppend(const vasqHandler *handler, vasqLogLevel level, const char *text, size_t length)
+{
+    tailRecord *record;
+
+    if (length > VASQ_TAIL_SIZE) {
+        return;
+    }
+
+    /*
+        Make room by discarding the oldest messages.  At least half of them are discarded at once so that the
+        cost of moving the rest is spread over the messages which fill the space.
+    */
+    if (tail.count == VASQ_TAIL_MESSAGES || tail.text_length + length > VASQ_TAIL_SIZE) {
+        unsigned int drop = 0;
+        size_t drop_length = 0;
+
+        while (drop < tail.count / 2 || tail.count - drop >= VASQ_TAIL_MESSAGES ||
+               tail.text_length - drop_length + length > VASQ_TAIL_SIZE) {
+            drop_length += tail.records[drop++].length;
+        }
+
+        tail.count -= drop;
+        tail.text_length -= drop_length;
+        memmove(tail.records, tail.records + drop, tail.count * sizeof(*tail.records));
+        memmove(tail.text, tail.text + drop_length, tail.text_length);
+    }
+
+    record = &tail.records[tail.count++];
+    record->func = handler->func;
+    record->user = handler->user;
+    record->level = level;
+    record->length = length;
+    memcpy(tail.text + tail.text_length, text, length);
+    tail.text_length += length;
+}
+
+#endif  // VASQ_NO_LOGGING
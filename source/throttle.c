@@ -0,0 +1,60 @@
+#ifndef VASQ_NO_LOGGING
+
+#include <stdint.h>
+#include <time.h>
+
+#include "internal.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+
+/*
+    The token bucket is implemented as the generic cell rate algorithm so that its entire state fits in one
+    word.  throttle->state holds the theoretical arrival time (TAT) of the next message:  the time at which
+    the bucket would be full again.  A message is admitted if it arrives no more than burst - 1 intervals
+    before the TAT, in which case the TAT is advanced by one interval.
+*/
+bool
+vasqThrottleRate(vasqThrottle *throttle, unsigned int rate, unsigned int burst)
+{
+    uint64_t now, interval, tolerance, arrival, next_arrival;
+    struct timespec spec;
+
+    if (rate == 0) {
+        return true;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    now = spec.tv_sec * NANOSECONDS_PER_SECOND + spec.tv_nsec;
+    interval = NANOSECONDS_PER_SECOND / rate;
+    tolerance = interval * ((burst > 0) ? burst - 1 : 0);
+
+    arrival = __atomic_load_n(&throttle->state, __ATOMIC_RELAXED);
+    do {
+        if (now + tolerance < arrival) {
+            __atomic_add_fetch(&throttle->suppressed, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        next_arrival = ((arrival > now) ? arrival : now) + interval;
+    } while (!__atomic_compare_exchange_n(&throttle->state, &arrival, next_arrival, true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    return true;
+}
+
+void
+vasqLogSuppressed(vasqLogger *logger, const vasqCallSite *site, vasqThrottle *throttle)
+{
+    unsigned long suppressed;
+    vasqCallSite summary;
+
+    suppressed = __atomic_exchange_n(&throttle->suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed == 0) {
+        return;  // Another thread reported them.
+    }
+
+    summary = *site;
+    summary.format = "Suppressed %lu message%s";
+    vasqLogSite(logger, &summary, suppressed, (suppressed == 1) ? "" : "s");
+}
+
+#endif  // VASQ_NO_LOGGING
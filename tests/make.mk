@@ -21,7 +21,7 @@ endif
 
 
 $(TEST_BINARY): $(TEST_OBJECT_FILES) $(VASQ_SHARED_LIBRARY)
-	$(CC) $(CFLAGS) $(VASQ_INCLUDE_FLAGS) $(filter %.o,$^) -Wl,-rpath $(realpath $(VASQ_LIB_DIR)) -L$(VASQ_LIB_DIR) -lvanillasquad -lscrutiny -o $@
+	$(CC) $(CFLAGS) $(VASQ_INCLUDE_FLAGS) $(filter %.o,$^) -Wl,-rpath $(realpath $(VASQ_LIB_DIR)) -L$(VASQ_LIB_DIR) -lvanillasquad -lscrutiny -pthread -o $@
 
 tests: $(TEST_BINARY)
 	@$<
@@ -1,11 +1,15 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -16,6 +20,7 @@
 #define VASQ_TEST_ASSERT
 
 #include <scrutiny/scrutiny.h>
+#include <vasq/control.h>
 #include <vasq/logger.h>
 #include <vasq/safe_snprintf.h>
 
@@ -23,6 +28,8 @@ struct test_ctx {
     char buffer[100];
 };
 
+#define JSON_TEST_SIZE 80
+
 bool _vasq_abort_caught;
 
 void
@@ -183,6 +190,38 @@ test_logger_level_too_high(void)
     vasqLoggerFree(logger);
 }
 
+static void
+check_in_child(vasqLogger *logger, struct test_ctx *ctx, long (*get_id)(void))
+{
+    pid_t child;
+    int status;
+
+    child = fork();
+    if (child < 0) {
+        SCR_FAIL("fork: %s", strerror(errno));
+    }
+
+    if (child == 0) {
+        char answer[20];
+
+        snprintf(answer, sizeof(answer), "%li", get_id());
+        VASQ_INFO(logger, "Check");
+        _exit(strcmp(ctx->buffer, answer) == 0 ? 0 : 1);
+    }
+
+    if (waitpid(child, &status, 0) != child) {
+        SCR_FAIL("waitpid: %s", strerror(errno));
+    }
+    SCR_ASSERT(WIFEXITED(status));
+    SCR_ASSERT_EQ(WEXITSTATUS(status), 0);
+}
+
+static long
+get_pid(void)
+{
+    return getpid();
+}
+
 void
 test_logger_pid(void)
 {
@@ -190,15 +229,25 @@ test_logger_pid(void)
     struct test_ctx ctx;
     vasqLogger *logger;
 
-    snprintf(answer, sizeof(answer), "%li", (long)getpid());
+    snprintf(answer, sizeof(answer), "%li", get_pid());
 
     SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%p", NULL), NULL);
     VASQ_INFO(logger, "Check");
     SCR_ASSERT_STR_EQ(ctx.buffer, answer);
 
+    check_in_child(logger, &ctx, get_pid);
+
     vasqLoggerFree(logger);
 }
 
+#ifdef __linux__
+static long
+get_tid(void)
+{
+    return syscall(SYS_gettid);
+}
+#endif
+
 void
 test_logger_tid(void)
 {
@@ -207,12 +256,14 @@ test_logger_tid(void)
     struct test_ctx ctx;
     vasqLogger *logger;
 
-    snprintf(answer, sizeof(answer), "%li", (long)syscall(SYS_gettid));
+    snprintf(answer, sizeof(answer), "%li", get_tid());
 
     SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%T", NULL), NULL);
     VASQ_INFO(logger, "Check");
     SCR_ASSERT_STR_EQ(ctx.buffer, answer);
 
+    check_in_child(logger, &ctx, get_tid);
+
     vasqLoggerFree(logger);
 #else
     SCR_TEST_SKIP();
@@ -361,6 +412,194 @@ test_logger_pretty_timestamp(void)
     vasqLoggerFree(logger);
 }
 
+void
+test_logger_time_consistent(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger;
+    char *separator;
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_DEBUG, "%t|%h:%m:%s", NULL), NULL);
+    VASQ_INFO(logger, "Check");
+
+    // The pretty timestamp and the individual fields should come from the same second.
+    separator = strchr(ctx.buffer, '|');
+    SCR_ASSERT_PTR_NEQ(separator, NULL);
+    *separator = '\0';
+    SCR_ASSERT_EQ(strlen(ctx.buffer), 24);
+    ctx.buffer[19] = '\0';
+    SCR_ASSERT_STR_EQ(ctx.buffer + 11, separator + 1);
+
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_time_zone(void)
+{
+    time_t now;
+    struct test_ctx ctx;
+    vasqLogger *logger;
+    char answer[30];
+
+    // No DST in effect and a non-zero offset.
+    setenv("TZ", "XYZ-5:30", 1);
+    tzset();
+    vasqRefreshTimeZone();
+
+    now = time(NULL);
+    ctime_r(&now, answer);
+    answer[strlen(answer) - 1] = '\0';
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_DEBUG, "%t", NULL), NULL);
+    VASQ_INFO(logger, "Check");
+
+    SCR_LOG("Logged time: %s", ctx.buffer);
+    SCR_LOG("Actual time: %s", answer);
+
+    ctx.buffer[17] = '\0';
+    answer[17] = '\0';
+    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
+
+    vasqLoggerFree(logger);
+    unsetenv("TZ");
+    tzset();
+    vasqRefreshTimeZone();
+}
+
+static void
+fake_clock(void *user, struct timespec *now)
+{
+    *now = *(const struct timespec *)user;
+}
+
+static void
+set_time_zone(const char *zone)
+{
+    if (zone) {
+        setenv("TZ", zone, 1);
+    }
+    else {
+        unsetenv("TZ");
+    }
+    tzset();
+    vasqRefreshTimeZone();
+}
+
+void
+test_logger_fake_clock(void)
+{
+    struct timespec now = {.tv_sec = 1613312839, .tv_nsec = 123456789};
+    struct test_ctx ctx;
+    vasqLoggerOptions options = {.clock = fake_clock, .clock_user = &now};
+    vasqLogger *logger;
+
+    set_time_zone("UTC0");
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%u %t %I %3 %6 %9", &options), NULL);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "1613312839 Sun Feb 14 14:27:19 2021 "
+                                  "2021-02-14T14:27:19.123+00:00 123 123456 123456789");
+
+    vasqLoggerFree(logger);
+    set_time_zone(NULL);
+}
+
+void
+test_logger_dst_transition(void)
+{
+    struct timespec now = {.tv_sec = 1615705199};  // One second before DST begins in New York in 2021.
+    struct test_ctx ctx;
+    vasqLoggerOptions options = {.clock = fake_clock, .clock_user = &now};
+    vasqLogger *logger;
+
+    set_time_zone("EST5EDT,M3.2.0,M11.1.0");
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%h:%m:%s %I", &options), NULL);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "01:59:59 2021-03-14T01:59:59.000-05:00");
+
+    now.tv_sec++;
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "03:00:00 2021-03-14T03:00:00.000-04:00");
+
+    vasqLoggerFree(logger);
+    set_time_zone(NULL);
+}
+
+void
+test_logger_mixed_clocks(void)
+{
+    struct timespec now = {.tv_sec = 1613312839}, later = {.tv_sec = 1636257600};
+    struct test_ctx fake_ctx, later_ctx, real_ctx;
+    vasqLoggerOptions options = {.clock = fake_clock, .clock_user = &now};
+    vasqLoggerOptions later_options = {.clock = fake_clock, .clock_user = &later};
+    vasqLogger *fake_logger, *later_logger, *real_logger;
+    char *endptr;
+    long long epoch;
+    time_t before;
+
+    set_time_zone("EST5EDT,M3.2.0,M11.1.0");
+
+    SCR_ASSERT_PTR_NEQ(fake_logger = create_logger(&fake_ctx, VASQ_LL_INFO, "%I", &options), NULL);
+    SCR_ASSERT_PTR_NEQ(later_logger = create_logger(&later_ctx, VASQ_LL_INFO, "%I", &later_options), NULL);
+    SCR_ASSERT_PTR_NEQ(real_logger = create_logger(&real_ctx, VASQ_LL_INFO, "%u", NULL), NULL);
+
+    // Each clock keeps its own rendered time (and time zone window) even when their loggers are interleaved.
+    for (int k = 0; k < 3; k++) {
+        before = time(NULL);
+        VASQ_INFO(real_logger, "Check");
+        epoch = strtoll(real_ctx.buffer, &endptr, 10);
+        SCR_ASSERT_EQ(*endptr, '\0');
+        SCR_ASSERT_LE((long long)before, epoch);
+        SCR_ASSERT_LE(epoch - (long long)before, 1);
+
+        VASQ_INFO(fake_logger, "Check");
+        SCR_ASSERT_STR_EQ(fake_ctx.buffer, "2021-02-14T09:27:19.000-05:00");
+
+        VASQ_INFO(later_logger, "Check");
+        SCR_ASSERT_STR_EQ(later_ctx.buffer, "2021-11-07T00:00:00.000-04:00");
+    }
+
+    vasqLoggerFree(fake_logger);
+    vasqLoggerFree(later_logger);
+    vasqLoggerFree(real_logger);
+    set_time_zone(NULL);
+}
+
+static void
+check_clock(vasqClockFunc *clock)
+{
+    long long epoch;
+    char *endptr;
+    time_t before;
+    struct test_ctx ctx;
+    vasqLoggerOptions options = {.clock = clock};
+    vasqLogger *logger;
+
+    before = time(NULL);
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%u", &options), NULL);
+    VASQ_INFO(logger, "Check");
+    epoch = strtoll(ctx.buffer, &endptr, 10);
+    if (ctx.buffer[0] == '\0' || *endptr != '\0') {
+        SCR_FAIL("Invalid logged time: %s", ctx.buffer);
+    }
+
+    // The coarse clock can lag behind time() by a tick.
+    SCR_ASSERT_LE((long long)before - 1, epoch);
+    SCR_ASSERT_LE(epoch - (long long)before, 1);
+
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_clock_sources(void)
+{
+    check_clock(vasqClockRealtime);
+    check_clock(vasqClockRealtimeCoarse);
+    check_clock(vasqClockCycles);
+}
+
 static void
 get_date_fields(struct tm *fields)
 {
@@ -466,187 +705,1288 @@ test_logger_file(void)
 }
 
 void
-test_logger_func(void)
+test_logger_statement(void)
 {
     struct test_ctx ctx;
     vasqLogger *logger;
+    char answer[100];
 
-    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%f", NULL), NULL);
-    VASQ_INFO(logger, "Check");
-    SCR_ASSERT_STR_EQ(ctx.buffer, __func__);
+    snprintf(answer, sizeof(answer), "%s:%s: Check 5", get_file_name(), __func__);
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%F:%f: %M", NULL), NULL);
+    vasqLogStatement(logger, VASQ_LL_INFO, VASQ_CONTEXT_PARAMS, "Check %i", 5);
+    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
 
     vasqLoggerFree(logger);
 }
 
 void
-test_logger_line(void)
+test_logger_call_site(void)
 {
     struct test_ctx ctx;
     vasqLogger *logger;
-    char answer[10];
+    char answer[100];
+    VASQ_CALL_SITE(site, VASQ_LL_INFO, "Check %i");
 
-    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%l", NULL), NULL);
-    snprintf(answer, sizeof(answer), "%u", __LINE__ + 1);
-    VASQ_INFO(logger, "Check");
+    snprintf(answer, sizeof(answer), "INFO %s:%u: Check 5", get_file_name(), site.line_no);
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%L %F:%l: %M", NULL), NULL);
+    vasqLogSite(logger, &site, 5);
     SCR_ASSERT_STR_EQ(ctx.buffer, answer);
 
     vasqLoggerFree(logger);
 }
 
 static void
-processor(void *user, size_t pos, vasqLogLevel level, char **buffer, size_t *remaining)
+log_dynamic(vasqLogger *logger, vasqLogLevel level, const char *format)
 {
-    int num = (intptr_t)user;
+    VASQ_LOG(logger, level, format, 5);
+}
 
-    SCR_ASSERT_EQ(level, VASQ_LL_INFO);
+static void
+check_not_dynamic(void *user, const vasqCallSite *site)
+{
+    (void)user;
 
-    vasqIncSnprintf(buffer, remaining, "%zu-%i", pos, num);
+    SCR_ASSERT_STR_NEQ(site->function_name, "log_dynamic");
 }
 
 void
-test_logger_user_data(void)
+test_logger_dynamic_statement(void)
 {
+    int count = 0;
     struct test_ctx ctx;
-    vasqLoggerOptions options = {.processor = processor, .user = (void *)(intptr_t)1};
     vasqLogger *logger;
+    char answer[100];
+    const char *format = "Check %i";
 
-    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%x%M%x", &options), NULL);
-    VASQ_INFO(logger, "Check");
-    SCR_ASSERT_STR_EQ(ctx.buffer, "0-1Check1-1");
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%L %f: %M", NULL), NULL);
+
+    log_dynamic(logger, VASQ_LL_INFO, "Check %i");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "INFO log_dynamic: Check 5");
+
+    *ctx.buffer = '\0';
+    log_dynamic(logger, VASQ_LL_DEBUG, "Check %i");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "");
+
+    snprintf(answer, sizeof(answer), "WARNING %s: Check 5", __func__);
+    VASQ_WARNING(logger, format, 5);
+    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
+
+    // The macros are expressions.
+    count ? VASQ_INFO(logger, "Never") : VASQ_INFO(logger, "Count %i", count);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "INFO test_logger_dynamic_statement: Count 0");
+
+    vasqCallSitesForEach(check_not_dynamic, NULL);
 
     vasqLoggerFree(logger);
 }
 
 void
-test_logger_no_format(void)
+test_logger_func(void)
 {
     struct test_ctx ctx;
     vasqLogger *logger;
 
-    SCR_ASSERT_PTR_EQ(logger = create_logger(&ctx, VASQ_LL_INFO, NULL, NULL), NULL);
-    SCR_ASSERT_EQ(errno, EINVAL);
-}
-
-void
-test_logger_invalid_format(void)
-{
-    struct test_ctx ctx;
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%f", NULL), NULL);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, __func__);
 
-    SCR_ASSERT_PTR_EQ(create_logger(&ctx, VASQ_LL_INFO, "%k", NULL), NULL);
-    SCR_ASSERT_EQ(errno, EINVAL);
+    vasqLoggerFree(logger);
 }
 
 void
-test_logger_percent(void)
+test_logger_line(void)
 {
     struct test_ctx ctx;
     vasqLogger *logger;
+    char answer[10];
 
-    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%%", NULL), NULL);
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%l", NULL), NULL);
+    snprintf(answer, sizeof(answer), "%u", __LINE__ + 1);
     VASQ_INFO(logger, "Check");
-    SCR_ASSERT_STR_EQ(ctx.buffer, "%");
+    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
 
     vasqLoggerFree(logger);
 }
 
 static void
-raw_handler(void *user, vasqLogLevel level, const char *text, size_t size)
+processor(void *user, size_t pos, vasqLogLevel level, char **buffer, size_t *remaining)
 {
-    SCR_ASSERT_EQ(level, VASQ_LL_NONE);
-
-    write_to_ctx(user, level, text, size);
-}
+    int num = (intptr_t)user;
 
-static vasqLogger *
-create_raw_logger(struct test_ctx *ctx)
-{
-    vasqHandler handler = {.func = raw_handler, .user = ctx};
+    SCR_ASSERT_EQ(level, VASQ_LL_INFO);
 
-    return vasqLoggerCreate(VASQ_LL_INFO, "%L: %M", &handler, NULL);
+    vasqIncSnprintf(buffer, remaining, "%zu-%i", pos, num);
 }
 
 void
-test_logger_raw(void)
+test_logger_user_data(void)
 {
     struct test_ctx ctx;
+    vasqLoggerOptions options = {.processor = processor, .user = (void *)(intptr_t)1};
     vasqLogger *logger;
 
-    SCR_ASSERT_PTR_NEQ(logger = create_raw_logger(&ctx), NULL);
-    vasqRawLog(logger, "Check: %i", 5);
-    SCR_ASSERT_STR_EQ(ctx.buffer, "Check: 5");
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%x%M%x", &options), NULL);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0-1Check1-1");
 
     vasqLoggerFree(logger);
 }
 
 static void
-do_vraw(vasqLogger *logger, const char *format, ...)
+counting_processor(void *user, size_t pos, vasqLogLevel level, char **buffer, size_t *remaining)
 {
-    va_list args;
+    unsigned int *calls = user;
 
-    va_start(args, format);
-    vasqVRawLog(logger, format, args);
-    va_end(args);
+    (void)level;
+
+    vasqIncSnprintf(buffer, remaining, "%zu:%u", pos, ++*calls);
 }
 
 void
-test_logger_vraw(void)
+test_logger_data_static(void)
 {
     struct test_ctx ctx;
+    unsigned int calls = 0;
+    vasqLoggerOptions options = {
+        .processor = counting_processor,
+        .user = &calls,
+        .data_mode = VASQ_DATA_STATIC,
+    };
     vasqLogger *logger;
 
-    SCR_ASSERT_PTR_NEQ(logger = create_raw_logger(&ctx), NULL);
-    do_vraw(logger, "Check: %i", 5);
-    SCR_ASSERT_STR_EQ(ctx.buffer, "Check: 5");
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%x %x %M", &options), NULL);
+    SCR_ASSERT_EQ(calls, 2);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0:1 1:2 Check");
+    vasqLoggerBumpDataGeneration(logger);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0:1 1:2 Check");
+    SCR_ASSERT_EQ(calls, 2);
 
     vasqLoggerFree(logger);
 }
 
+static void *
+log_in_thread(void *arg)
+{
+    VASQ_INFO(arg, "Check");
+    return NULL;
+}
+
 void
-test_logger_perror(void)
+test_logger_data_per_thread(void)
 {
     struct test_ctx ctx;
+    unsigned int calls = 0;
+    vasqLoggerOptions options = {
+        .processor = counting_processor,
+        .user = &calls,
+        .data_mode = VASQ_DATA_PER_THREAD,
+    };
     vasqLogger *logger;
-    char answer[50];
+    pthread_t thread;
 
-    snprintf(answer, sizeof(answer), "ERROR: Check: %s", strerror(EINVAL));
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%x %M", &options), NULL);
+    SCR_ASSERT_EQ(calls, 0);
+    VASQ_INFO(logger, "Check");
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0:1 Check");
 
-    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%L: %M", NULL), NULL);
-    VASQ_PERROR(logger, "Check", EINVAL);
-    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
+    SCR_ASSERT_EQ(pthread_create(&thread, NULL, log_in_thread, logger), 0);
+    pthread_join(thread, NULL);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0:2 Check");
+
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0:1 Check");
+    SCR_ASSERT_EQ(calls, 2);
 
     vasqLoggerFree(logger);
 }
 
 void
-test_logger_pwarning(void)
+test_logger_data_versioned(void)
 {
     struct test_ctx ctx;
+    unsigned int calls = 0;
+    vasqLoggerOptions options = {
+        .processor = counting_processor,
+        .user = &calls,
+        .data_mode = VASQ_DATA_VERSIONED,
+    };
     vasqLogger *logger;
-    char answer[50];
 
-    snprintf(answer, sizeof(answer), "WARNING: Check: %s", strerror(EINVAL));
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%x %M", &options), NULL);
+    VASQ_INFO(logger, "Check");
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0:1 Check");
 
-    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%L: %M", NULL), NULL);
-    VASQ_PWARNING(logger, "Check", EINVAL);
-    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
+    vasqLoggerBumpDataGeneration(logger);
+    VASQ_INFO(logger, "Check");
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0:2 Check");
+    SCR_ASSERT_EQ(calls, 2);
+
+    vasqLoggerFree(logger);
+
+    // A new logger must not see the old one's values even if it reuses its memory.
+    calls = 10;
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%x %M", &options), NULL);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0:11 Check");
 
     vasqLoggerFree(logger);
 }
 
 void
-test_logger_pcritical(void)
+test_logger_context(void)
 {
     struct test_ctx ctx;
     vasqLogger *logger;
-    char answer[50];
 
-    snprintf(answer, sizeof(answer), "CRITICAL: Check: %s", strerror(EINVAL));
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "[%C] %M", NULL), NULL);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "[] Check");
 
-    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%L: %M", NULL), NULL);
-    VASQ_PCRITICAL(logger, "Check", EINVAL);
-    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
+    SCR_ASSERT_EQ(vasqContextPush("request", "%i", 42), 0);
+    SCR_ASSERT_EQ(vasqContextPush("tenant", "%s", "acme"), 0);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "[request=42 tenant=acme] Check");
 
-    vasqLoggerFree(logger);
+    vasqContextPop();
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "[request=42] Check");
+
+    vasqContextClear();
+    vasqContextPop();
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "[] Check");
+
+    for (int k = 0; k < VASQ_CONTEXT_DEPTH; k++) {
+        SCR_ASSERT_EQ(vasqContextPush("k", "%i", k), 0);
+    }
+    SCR_ASSERT_EQ(vasqContextPush("k", "overflow"), -1);
+    SCR_ASSERT_EQ(errno, ENOSPC);
+    vasqContextClear();
+
+    // vasqSafeSnprintf doesn't support %f.
+    SCR_ASSERT_EQ(vasqContextPush("ratio", "%f", 0.5), -1);
+    SCR_ASSERT_EQ(errno, EINVAL);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "[] Check");
+
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_child(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger, *child, *grandchild;
+    vasqChildLogger child_storage, grandchild_storage;
+    char long_value[VASQ_CHILD_FIELDS_SIZE];
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "[%C] %M", NULL), NULL);
+    SCR_ASSERT_PTR_NEQ(child = vasqChildLoggerInit(&child_storage, logger, "shard", "%i", 3), NULL);
+    SCR_ASSERT_PTR_NEQ(grandchild = vasqChildLoggerInit(&grandchild_storage, child, "table", "users"), NULL);
+
+    VASQ_INFO(child, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "[shard=3] Check");
+    VASQ_INFO(grandchild, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "[shard=3 table=users] Check");
+
+    SCR_ASSERT_EQ(vasqContextPush("request", "7"), 0);
+    VASQ_INFO(grandchild, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "[shard=3 table=users request=7] Check");
+    vasqContextPop();
+
+    // Children share their root's level.
+    vasqSetLoggerLevel(logger, VASQ_LL_ERROR);
+    SCR_ASSERT_EQ(vasqLoggerLevel(grandchild), VASQ_LL_ERROR);
+    ctx.buffer[0] = '\0';
+    VASQ_INFO(grandchild, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "");
+
+    memset(long_value, 'a', sizeof(long_value) - 1);
+    long_value[sizeof(long_value) - 1] = '\0';
+    SCR_ASSERT_PTR_EQ(vasqChildLoggerInit(&grandchild_storage, child, "long", "%s", long_value), NULL);
+    SCR_ASSERT_EQ(errno, ENOSPC);
+
+    vasqLoggerFree(child);  // Does nothing.
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_max_message_size(void)
+{
+    struct test_ctx ctx;
+    vasqLoggerOptions options = {.max_message_size = 6};
+    vasqLogger *logger;
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%M", &options), NULL);
+    VASQ_INFO(logger, "Check check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Check");
+    vasqRawLog(logger, "Raw text");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Raw t");
+
+    vasqLoggerFree(logger);
+}
+
+struct spill_ctx {
+    unsigned int calls;
+    size_t length;
+    char text[3000];
+};
+
+static void
+collect_chunks(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    struct spill_ctx *ctx = user;
+
+    SCR_ASSERT_EQ(level, VASQ_LL_INFO);
+    SCR_ASSERT_LE(size, 99);
+    SCR_ASSERT_EQ(text[size], '\0');
+
+    memcpy(ctx->text + ctx->length, text, size);
+    ctx->length += size;
+    ctx->text[ctx->length] = '\0';
+    ctx->calls++;
+}
+
+void
+test_logger_spill(void)
+{
+    struct spill_ctx ctx = {0};
+    vasqHandler handler = {.func = collect_chunks, .user = &ctx};
+    vasqLoggerOptions options = {.max_message_size = 100, .flags = VASQ_LOGGER_FLAG_SPILL};
+    vasqLogger *logger;
+    char message[2000];
+
+    memset(message, 'a', sizeof(message) - 1);
+    message[sizeof(message) - 1] = '\0';
+    message[1000] = 'b';
+
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_INFO, "<%M>", &handler, &options), NULL);
+    VASQ_INFO(logger, "%s", message);
+    SCR_ASSERT_EQ(ctx.calls, 21);
+    SCR_ASSERT_EQ(ctx.length, sizeof(message) + 1);
+    SCR_ASSERT_EQ(ctx.text[0], '<');
+    SCR_ASSERT_EQ(ctx.text[1001], 'b');
+    SCR_ASSERT_STR_EQ(ctx.text + sizeof(message) - 1, "a>");
+
+    ctx.calls = ctx.length = 0;
+    VASQ_INFO(logger, "Short");
+    SCR_ASSERT_EQ(ctx.calls, 1);
+    SCR_ASSERT_STR_EQ(ctx.text, "<Short>");
+
+    vasqLoggerFree(logger);
+
+    // Chunks would be empty.
+    options.max_message_size = 1;
+    SCR_ASSERT_PTR_EQ(vasqLoggerCreate(VASQ_LL_INFO, "<%M>", &handler, &options), NULL);
+    SCR_ASSERT_EQ(errno, EINVAL);
+
+    options.max_message_size = 2;
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_INFO, "<%M>", &handler, &options), NULL);
+    ctx.calls = ctx.length = 0;
+    VASQ_INFO(logger, "Short");
+    SCR_ASSERT_EQ(ctx.calls, 7);
+    SCR_ASSERT_STR_EQ(ctx.text, "<Short>");
+    vasqLoggerFree(logger);
+}
+
+static void
+nested_handler(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    vasqLogger **inner = user;
+
+    (void)level;
+    (void)size;
+
+    // The outer message is still in the thread's buffer while the inner one is formatted.
+    VASQ_INFO(*inner, "Inner");
+    SCR_ASSERT_STR_EQ(text, "Outer");
+}
+
+void
+test_logger_nested(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *inner, *outer;
+    vasqHandler handler = {.func = nested_handler, .user = &inner};
+
+    SCR_ASSERT_PTR_NEQ(inner = create_logger(&ctx, VASQ_LL_INFO, "%M", NULL), NULL);
+    SCR_ASSERT_PTR_NEQ(outer = vasqLoggerCreate(VASQ_LL_INFO, "%M", &handler, NULL), NULL);
+    VASQ_INFO(outer, "Outer");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Inner");
+
+    vasqLoggerFree(outer);
+    vasqLoggerFree(inner);
+}
+
+static void
+build_message(vasqLogger *logger)
+{
+    vasqLogBuilder builder;
+    const unsigned char bytes[] = {0xde, 0xad, 0x01};
+
+    if (!VASQ_LOG_BUILDER_BEGIN(&builder, logger, VASQ_LL_INFO)) {
+        vasqLogBuilderString(&builder, "Discarded");
+        vasqLogBuilderCommit(&builder);
+        return;
+    }
+
+    vasqLogBuilderString(&builder, "Check ");
+    vasqLogBuilderInt(&builder, -12);
+    vasqLogBuilderAppend(&builder, " and more", 4);
+    vasqLogBuilderUint(&builder, 0);
+    vasqLogBuilderAppend(&builder, " ", 1);
+    vasqLogBuilderHex(&builder, bytes, sizeof(bytes));
+    vasqLogBuilderCommit(&builder);
+}
+
+void
+test_logger_builder(void)
+{
+    struct test_ctx ctx;
+    vasqLoggerOptions options = {.processor = processor, .user = (void *)(intptr_t)1};
+    vasqLogger *logger;
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%x [%L] %M! %x%%", &options), NULL);
+    build_message(logger);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0-1 [INFO] Check -12 and0 dead01! 1-1%");
+
+    vasqSetLoggerLevel(logger, VASQ_LL_WARNING);
+    ctx.buffer[0] = '\0';
+    build_message(logger);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "");
+    vasqLoggerFree(logger);
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "[%L] ", NULL), NULL);
+    build_message(logger);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "[INFO] Check -12 and0 dead01");
+    vasqLoggerFree(logger);
+}
+
+static int
+count_call(int *count)
+{
+    return (*count)++;
+}
+
+void
+test_logger_disabled_level(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger, *child;
+    vasqChildLogger child_storage;
+    int count = 0;
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%M", NULL), NULL);
+    SCR_ASSERT_PTR_NEQ(child = vasqChildLoggerInit(&child_storage, logger, "shard", "3"), NULL);
+
+    VASQ_DEBUG(logger, "%i", count_call(&count));
+    VASQ_DEBUG(child, "%i", count_call(&count));
+    VASQ_LOG_FIELDS(child, VASQ_LL_DEBUG, VASQ_FIELDS(VASQ_FIELD_INT("n", count_call(&count))), "Check");
+    SCR_ASSERT_EQ(count, 0);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "");
+    SCR_ASSERT(!vasqLevelEnabled(NULL, VASQ_LL_ALWAYS));
+
+    vasqSetLoggerLevel(child, VASQ_LL_DEBUG);
+    SCR_ASSERT(vasqLevelEnabled(child, VASQ_LL_DEBUG));
+    VASQ_DEBUG(child, "%i", count_call(&count));
+    SCR_ASSERT_EQ(count, 1);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0");
+
+    vasqSetLoggerLevel(logger, VASQ_LL_NONE);
+    VASQ_ALWAYS(logger, "%i", count_call(&count));
+    SCR_ASSERT_EQ(count, 1);
+
+    vasqLoggerFree(logger);
+}
+
+static void
+log_from_site(vasqLogger *logger)
+{
+    VASQ_DEBUG(logger, "Site");
+}
+
+static void
+find_site(void *user, const vasqCallSite *site)
+{
+    const vasqCallSite **found = user;
+
+    if (strcmp(site->function_name, "log_from_site") == 0) {
+        SCR_ASSERT_PTR_EQ(*found, NULL);
+        *found = site;
+    }
+}
+
+void
+test_logger_call_sites(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger;
+    const vasqCallSite *site = NULL;
+    vasqCallSiteFilter filter = {.file = "test_log*.c", .function = "log_from_site"};
+
+    vasqCallSitesForEach(find_site, &site);
+    SCR_ASSERT_PTR_NEQ(site, NULL);
+    SCR_ASSERT_EQ(site->level, VASQ_LL_DEBUG);
+    SCR_ASSERT_STR_EQ(site->format, "Site");
+    SCR_ASSERT_EQ(site->enabled, false);
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%M", NULL), NULL);
+    log_from_site(logger);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "");
+
+    SCR_ASSERT_EQ(vasqCallSitesSetState(&filter, VASQ_SITE_ENABLED), 1);
+    SCR_ASSERT_EQ(site->enabled, true);
+    log_from_site(logger);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Site");
+
+    *ctx.buffer = '\0';
+    filter.file = NULL;
+    filter.function = NULL;
+    filter.first_line = site->line_no;
+    filter.last_line = site->line_no;
+    SCR_ASSERT_GE(vasqCallSitesSetState(&filter, VASQ_SITE_DISABLED), 1);
+    vasqSetLoggerLevel(logger, VASQ_LL_DEBUG);
+    SCR_ASSERT_EQ(site->enabled, false);
+    log_from_site(logger);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "");
+
+    filter.file = "*/no_such_file.c";
+    SCR_ASSERT_EQ(vasqCallSitesSetState(&filter, VASQ_SITE_DEFAULT), 0);
+    SCR_ASSERT_GE(vasqCallSitesSetState(NULL, VASQ_SITE_DEFAULT), 1);
+    log_from_site(logger);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Site");
+
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_control(void)
+{
+    int fd;
+    struct test_ctx ctx;
+    char path[] = "/tmp/vasq_control_XXXXXX";
+    vasqLogger *logger;
+    vasqControlPage *page;
+    vasqControlRule *rule;
+    vasqLoggerOptions options = {.name = "tester"};
+
+    SCR_ASSERT_NEQ(fd = mkstemp(path), -1);
+    close(fd);
+    SCR_ASSERT_EQ(vasqControlOpen(path), 0);
+    SCR_ASSERT_EQ(vasqControlOpen(path), -1);
+    SCR_ASSERT_EQ(errno, EBUSY);
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%M", &options), NULL);
+    SCR_ASSERT_EQ(vasqControlRegister(logger), 0);
+
+    SCR_ASSERT_NEQ(fd = open(path, O_RDWR), -1);
+    page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    SCR_ASSERT_PTR_NEQ(page, MAP_FAILED);
+    SCR_ASSERT_EQ(page->magic, VASQ_CONTROL_MAGIC);
+    SCR_ASSERT_EQ(page->pid, getpid());
+    SCR_ASSERT_STR_EQ(page->loggers[0].name, "tester");
+    SCR_ASSERT_EQ(page->loggers[0].level, VASQ_LL_INFO);
+
+    // Nothing is applied until the next message is logged.
+    page->loggers[0].level = VASQ_LL_DEBUG;
+    page->loggers[0].pending = 1;
+    page->generation++;
+    SCR_ASSERT_EQ(vasqLoggerLevel(logger), VASQ_LL_INFO);
+    VASQ_INFO(logger, "Poll");
+    SCR_ASSERT_EQ(vasqLoggerLevel(logger), VASQ_LL_DEBUG);
+
+    // The inline check applies changes too.
+    page->loggers[0].level = VASQ_LL_TRACE;
+    page->loggers[0].pending = 1;
+    page->generation++;
+    SCR_ASSERT(vasqLevelEnabled(logger, VASQ_LL_TRACE));
+    SCR_ASSERT_EQ(vasqLoggerLevel(logger), VASQ_LL_TRACE);
+    vasqSetLoggerLevel(logger, VASQ_LL_DEBUG);
+    SCR_ASSERT_EQ(page->loggers[0].pending, 0);
+    log_from_site(logger);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Site");
+
+    rule = &page->rules[page->next_sequence % VASQ_CONTROL_RULES];
+    rule->state = VASQ_SITE_DISABLED;
+    strcpy(rule->function, "log_from_site");
+    rule->sequence = page->next_sequence++;
+    page->generation++;
+    VASQ_INFO(logger, "Poll");
+    log_from_site(logger);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Poll");
+    vasqCallSitesSetState(NULL, VASQ_SITE_DEFAULT);
+
+    vasqSetLoggerLevel(logger, VASQ_LL_WARNING);
+    SCR_ASSERT_EQ(page->loggers[0].level, VASQ_LL_WARNING);
+    vasqLoggerFree(logger);
+    SCR_ASSERT_STR_EQ(page->loggers[0].name, "");
+
+    vasqControlClose();
+    SCR_ASSERT_EQ(page->magic, 0);
+    page->generation++;
+    vasqControlPoll();
+    munmap(page, sizeof(*page));
+    SCR_ASSERT_EQ(vasqControlRegister(NULL), -1);
+    unlink(path);
+}
+
+static void
+append_to_ctx(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    struct test_ctx *ctx = user;
+    size_t length = strlen(ctx->buffer);
+
+    (void)level;
+
+    size = MIN(size, sizeof(ctx->buffer) - 1 - length);
+    memcpy(ctx->buffer + length, text, size);
+    ctx->buffer[length + size] = '\0';
+}
+
+static void
+log_rate_limited(vasqLogger *logger, int value)
+{
+    VASQ_LOG_RATE_LIMITED(logger, VASQ_LL_WARNING, 20, 2, "R%i", value);
+}
+
+void
+test_logger_throttle(void)
+{
+    struct test_ctx ctx = {0};
+    vasqHandler handler = {.func = append_to_ctx, .user = &ctx};
+    vasqLogger *logger;
+    struct timespec delay = {.tv_nsec = 100000000};
+
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_INFO, "%M;", &handler, NULL), NULL);
+
+    for (int k = 0; k < 5; k++) {
+        VASQ_LOG_ONCE(logger, VASQ_LL_INFO, "O%i", k);
+        VASQ_LOG_EVERY_N(logger, VASQ_LL_INFO, 2, "N%i", k);
+        VASQ_LOG_ONCE(logger, VASQ_LL_DEBUG, "D%i", k);
+    }
+    SCR_ASSERT_STR_EQ(ctx.buffer, "O0;N0;Suppressed 1 message;N2;Suppressed 1 message;N4;");
+
+    *ctx.buffer = '\0';
+    for (int k = 0; k < 8; k++) {
+        VASQ_LOG_EVERY_N(logger, VASQ_LL_INFO, 3, "E%i", k);
+    }
+    SCR_ASSERT_STR_EQ(ctx.buffer, "E0;Suppressed 2 messages;E3;Suppressed 2 messages;E6;");
+
+    *ctx.buffer = '\0';
+    for (int k = 0; k < 5; k++) {
+        log_rate_limited(logger, k);
+    }
+    SCR_ASSERT_STR_EQ(ctx.buffer, "R0;R1;");
+    nanosleep(&delay, NULL);
+    log_rate_limited(logger, 5);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "R0;R1;Suppressed 3 messages;R5;");
+
+    vasqLoggerFree(logger);
+}
+
+static void
+count_levels(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    unsigned int *counts = user;
+
+    (void)text;
+    (void)size;
+
+    counts[level]++;
+}
+
+void
+test_logger_sampling(void)
+{
+    unsigned int kept = 0, counts[VASQ_LL_TRACE + 1] = {0};
+    char key[16];
+    vasqHandler handler = {.func = count_levels, .user = counts};
+    vasqLogger *logger;
+
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_DEBUG, "%M", &handler, NULL), NULL);
+    SCR_ASSERT_EQ(vasqSetLoggerSampling(logger, VASQ_LL_DEBUG, 1.5), -1);
+    SCR_ASSERT_EQ(errno, EINVAL);
+    SCR_ASSERT_EQ(vasqSetLoggerSampling(logger, VASQ_LL_DEBUG, 0.5), 0);
+
+    for (int k = 0; k < 200; k++) {
+        unsigned int debug_count = counts[VASQ_LL_DEBUG];
+
+        snprintf(key, sizeof(key), "req-%i", k);
+        vasqSetSamplingKey(key, strlen(key));
+        VASQ_INFO(logger, "Info");
+        VASQ_DEBUG(logger, "Debug");
+        vasqLogStatement(logger, VASQ_LL_DEBUG, VASQ_CONTEXT_PARAMS, "Debug");
+        SCR_ASSERT_EQ(vasqLevelEnabled(logger, VASQ_LL_DEBUG), counts[VASQ_LL_DEBUG] > debug_count);
+        if (counts[VASQ_LL_DEBUG] > debug_count) {
+            SCR_ASSERT_EQ(counts[VASQ_LL_DEBUG], debug_count + 2);  // A request is kept or dropped whole.
+            kept++;
+        }
+    }
+    SCR_ASSERT_EQ(counts[VASQ_LL_INFO], 200);
+    SCR_ASSERT_GT(kept, 60);
+    SCR_ASSERT_LT(kept, 140);
+
+    SCR_ASSERT_EQ(vasqSetLoggerSampling(logger, VASQ_LL_INFO, 0), 0);
+    VASQ_INFO(logger, "Info");
+    SCR_ASSERT_EQ(counts[VASQ_LL_INFO], 200);
+    vasqSetSamplingKey(NULL, 0);
+    VASQ_INFO(logger, "Info");
+    SCR_ASSERT_EQ(counts[VASQ_LL_INFO], 201);
+
+    vasqLoggerFree(logger);
+}
+
+static void
+append_terminated(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    // Only a null-terminated batch is appended.
+    if (text[size] == '\0') {
+        append_to_ctx(user, level, text, size);
+    }
+}
+
+void
+test_logger_tail(void)
+{
+    struct test_ctx ctx = {0}, other_ctx = {0};
+    vasqHandler handler = {.func = append_to_ctx, .user = &ctx};
+    vasqHandler other_handler = {.func = append_terminated, .user = &other_ctx};
+    vasqLogger *logger, *other;
+    vasqLogBuilder builder;
+
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_DEBUG, "%M;", &handler, NULL), NULL);
+    SCR_ASSERT_EQ(vasqSetLoggerTail(logger, VASQ_LL_DEBUG, VASQ_LL_DEBUG), -1);
+    SCR_ASSERT_EQ(errno, EINVAL);
+    SCR_ASSERT_EQ(vasqSetLoggerTail(logger, VASQ_LL_DEBUG, VASQ_LL_ERROR), 0);
+
+    vasqTailStart();
+    VASQ_DEBUG(logger, "a");
+    VASQ_DEBUG(logger, "b");
+    VASQ_INFO(logger, "i");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "i;");
+    VASQ_ERROR(logger, "e");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "i;a;b;e;");
+    VASQ_DEBUG(logger, "c");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "i;a;b;e;c;");
+
+    *ctx.buffer = '\0';
+    vasqTailStart();
+    VASQ_DEBUG(logger, "d");
+    vasqTailStop();
+    vasqTailFlush();
+    VASQ_DEBUG(logger, "x");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "x;");
+
+    *ctx.buffer = '\0';
+    vasqTailStart();
+    for (int k = 0; k < VASQ_TAIL_MESSAGES + 10; k++) {
+        VASQ_DEBUG(logger, "%i", k);
+    }
+    SCR_ASSERT_STR_EQ(ctx.buffer, "");
+    vasqTailFlush();
+    SCR_ASSERT_PTR_EQ(strstr(ctx.buffer, "0;1;"), NULL);
+
+    // A batch is null-terminated even though the next one follows it.
+    *ctx.buffer = '\0';
+    *other_ctx.buffer = '\0';
+    SCR_ASSERT_PTR_NEQ(other = vasqLoggerCreate(VASQ_LL_DEBUG, "%M;", &other_handler, NULL), NULL);
+    SCR_ASSERT_EQ(vasqSetLoggerTail(other, VASQ_LL_DEBUG, VASQ_LL_ERROR), 0);
+    vasqTailStart();
+    VASQ_DEBUG(other, "f");
+    VASQ_DEBUG(other, "g");
+    VASQ_DEBUG(logger, "h");
+    vasqTailFlush();
+    SCR_ASSERT_STR_EQ(other_ctx.buffer, "f;g;");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "h;");
+
+    // Log builders and hex dumps are held back too.
+    *ctx.buffer = '\0';
+    vasqTailStart();
+    if (VASQ_LOG_BUILDER_BEGIN(&builder, logger, VASQ_LL_DEBUG)) {
+        vasqLogBuilderString(&builder, "built");
+        vasqLogBuilderCommit(&builder);
+    }
+    VASQ_HEXDUMP(logger, "dump", "ab", 2);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "");
+    VASQ_ERROR(logger, "e");
+    SCR_ASSERT_EQ(strncmp(ctx.buffer, "built;dump (2 bytes):", 21), 0);
+    SCR_ASSERT_PTR_NEQ(strstr(ctx.buffer, "\tab\ne;"), NULL);
+
+    vasqLoggerFree(other);
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_dedup(void)
+{
+    struct test_ctx ctx = {0};
+    vasqHandler handler = {.func = append_to_ctx, .user = &ctx};
+    vasqLoggerOptions options = {.flags = VASQ_LOGGER_FLAG_DEDUP};
+    vasqLogger *logger, *child;
+    vasqChildLogger child_logger;
+    vasqLogBuilder builder;
+
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_INFO, "%L %M;", &handler, &options), NULL);
+
+    for (int k = 0; k < 3; k++) {
+        VASQ_WARNING(logger, "Down %s", "db");
+    }
+    SCR_ASSERT_STR_EQ(ctx.buffer, "WARNING Down db;");
+    VASQ_INFO(logger, "Up");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "WARNING Down db;WARNING Last message repeated 2 times;INFO Up;");
+
+    *ctx.buffer = '\0';
+    for (int k = 0; k < 4; k++) {
+        VASQ_INFO(logger, "%i", k / 2);
+    }
+    SCR_ASSERT_STR_EQ(ctx.buffer, "INFO 0;INFO Last message repeated 1 time;INFO 1;");
+
+    *ctx.buffer = '\0';
+    vasqLoggerFree(logger);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "INFO Last message repeated 1 time;");
+
+    // The fields and the context are compared along with the message.
+    *ctx.buffer = '\0';
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_INFO, "%M [%C];", &handler, &options), NULL);
+    for (int k = 0; k < 4; k++) {
+        VASQ_LOG_FIELDS(logger, VASQ_LL_INFO, VASQ_FIELDS(VASQ_FIELD_INT("n", k / 2)), "Load");
+    }
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Load [n=0];Last message repeated 1 time [];Load [n=1];");
+    *ctx.buffer = '\0';
+    for (int k = 0; k < 2; k++) {
+        SCR_ASSERT_EQ(vasqContextPush("request", "%i", k), 0);
+        VASQ_INFO(logger, "Load");
+        vasqContextClear();
+    }
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Last message repeated 1 time [request=0];"
+                                  "Load [request=0];Load [request=1];");
+
+    // So are the fields of child loggers, even ones which reuse the same memory.
+    *ctx.buffer = '\0';
+    for (int k = 0; k < 2; k++) {
+        SCR_ASSERT_PTR_NEQ(child = vasqChildLoggerInit(&child_logger, logger, "shard", "%i", k), NULL);
+        VASQ_INFO(child, "Load");
+    }
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Load [shard=0];Load [shard=1];");
+
+    // Built messages and hex dumps are deduplicated too.
+    *ctx.buffer = '\0';
+    for (int k = 0; k < 3; k++) {
+        if (VASQ_LOG_BUILDER_BEGIN(&builder, logger, VASQ_LL_INFO)) {
+            vasqLogBuilderInt(&builder, k / 2);
+            vasqLogBuilderCommit(&builder);
+        }
+    }
+    SCR_ASSERT_STR_EQ(ctx.buffer, "0 [];Last message repeated 1 time [];1 [];");
+    vasqLoggerFree(logger);
+
+    *ctx.buffer = '\0';
+    options.flags |= VASQ_LOGGER_FLAG_HEX_DUMP_INFO;
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_INFO, "%M|", &handler, &options), NULL);
+    for (int k = 0; k < 3; k++) {
+        if (k == 2) {
+            SCR_ASSERT_EQ(strncmp(ctx.buffer, "dump (2 bytes):|", 16), 0);
+            SCR_ASSERT_PTR_EQ(strstr(ctx.buffer + 1, "dump"), NULL);
+            *ctx.buffer = '\0';
+        }
+        VASQ_HEXDUMP(logger, "dump", (k < 2) ? "ab" : "ac", 2);
+    }
+    SCR_ASSERT_EQ(strncmp(ctx.buffer, "Last message repeated 1 time|dump (2 bytes):|", 45), 0);
+    vasqLoggerFree(logger);
+
+    // The message is compared even if the format doesn't render it.
+    *ctx.buffer = '\0';
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_INFO, "%L;", &handler, &options), NULL);
+    VASQ_INFO(logger, "a");
+    VASQ_INFO(logger, "b");
+    VASQ_INFO(logger, "b");
+    VASQ_INFO(logger, "c");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "INFO;INFO;INFO;INFO;");
+    vasqLoggerFree(logger);
+}
+
+static double
+seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+slow_write_to_ctx(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    write_to_ctx(user, level, text, size);
+    while (seconds_since(&start) < 0.001) {
+    }
+}
+
+void
+test_logger_budget(void)
+{
+    struct test_ctx ctx;
+    struct timespec start;
+    vasqHandler handler = {.func = slow_write_to_ctx, .user = &ctx};
+    vasqLogger *logger;
+    vasqBudgetStats stats;
+    vasqLogBuilder builder;
+
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_DEBUG, "%M", &handler, NULL), NULL);
+    SCR_ASSERT_EQ(vasqSetLoggerBudget(logger, 10, VASQ_LL_NONE), -1);
+    SCR_ASSERT_EQ(vasqSetLoggerBudget(logger, 10, VASQ_LL_INFO), 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        VASQ_INFO(logger, "Busy");
+        SCR_ASSERT_EQ(vasqLoggerBudgetStats(logger, &stats), 0);
+    } while (stats.steps == 0 && seconds_since(&start) < 5);
+    SCR_ASSERT_EQ(stats.steps, 1);
+    SCR_ASSERT_EQ(stats.level, VASQ_LL_INFO);
+    SCR_ASSERT_EQ(stats.degradations, 1);
+    SCR_ASSERT_GT(stats.load, 100);
+    SCR_ASSERT_EQ(strncmp(ctx.buffer, "Logging used ", 13), 0);
+    SCR_ASSERT_PTR_NEQ(strstr(ctx.buffer, "lowered the level to INFO"), NULL);
+    SCR_ASSERT_EQ(vasqLoggerLevel(logger), VASQ_LL_INFO);
+
+    // The floor is never crossed.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (seconds_since(&start) < 0.6) {
+        VASQ_INFO(logger, "Busy");
+    }
+    SCR_ASSERT_EQ(vasqLoggerLevel(logger), VASQ_LL_INFO);
+
+    SCR_ASSERT_EQ(vasqSetLoggerBudget(logger, 0, VASQ_LL_INFO), 0);
+    SCR_ASSERT_EQ(vasqLoggerLevel(logger), VASQ_LL_DEBUG);
+
+    // Built messages and hex dumps are charged too.
+    SCR_ASSERT_EQ(vasqSetLoggerBudget(logger, 10, VASQ_LL_INFO), 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        if (VASQ_LOG_BUILDER_BEGIN(&builder, logger, VASQ_LL_DEBUG)) {
+            vasqLogBuilderString(&builder, "Busy");
+            vasqLogBuilderCommit(&builder);
+        }
+        VASQ_HEXDUMP(logger, "Busy", "", 0);
+        SCR_ASSERT_EQ(vasqLoggerBudgetStats(logger, &stats), 0);
+    } while (stats.steps == 0 && seconds_since(&start) < 5);
+    SCR_ASSERT_EQ(stats.steps, 1);
+    SCR_ASSERT_EQ(vasqLoggerLevel(logger), VASQ_LL_INFO);
+
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_fields(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger;
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%M [%C]", NULL), NULL);
+    VASQ_LOG_FIELDS(logger, VASQ_LL_INFO,
+                    VASQ_FIELDS(VASQ_FIELD_STR("state", "up"), VASQ_FIELD_INT("delta", -2),
+                                VASQ_FIELD_UINT("shard", 3), VASQ_FIELD_BOOL("ok", true)),
+                    "Check %i", 1);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Check 1 [state=up delta=-2 shard=3 ok=true]");
+
+    SCR_ASSERT_EQ(vasqContextPush("request", "7"), 0);
+    VASQ_LOG_FIELDS(logger, VASQ_LL_INFO, VASQ_FIELDS(VASQ_FIELD_BOOL("ok", false)), "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Check [request=7 ok=false]");
+    vasqContextClear();
+
+    vasqLoggerFree(logger);
+}
+
+struct json_ctx {
+    char buffer[1000];
+};
+
+static void
+write_to_json_ctx(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    struct json_ctx *ctx = user;
+
+    (void)level;
+
+    SCR_ASSERT_EQ(strlen(text), size);
+    SCR_ASSERT_LT(size, sizeof(ctx->buffer));
+    memcpy(ctx->buffer, text, size + 1);
+}
+
+static vasqLogger *
+create_json_logger(struct json_ctx *ctx, const char *format, vasqLoggerOptions *options)
+{
+    vasqHandler handler = {.func = write_to_json_ctx, .user = ctx};
+
+    options->flags |= VASQ_LOGGER_FLAG_JSON;
+    memset(ctx, 0, sizeof(*ctx));
+    return vasqLoggerCreate(VASQ_LL_DEBUG, format, &handler, options);
+}
+
+void
+test_logger_json(void)
+{
+    struct json_ctx ctx;
+    vasqLoggerOptions options = {.name = "db"};
+    vasqLogger *logger, *child;
+    vasqChildLogger child_storage;
+    unsigned int line;
+    char answer[sizeof(ctx.buffer)];
+
+    SCR_ASSERT_PTR_NEQ(logger = create_json_logger(&ctx, "[%L]%_ %N: %M (%l)%%\n", &options), NULL);
+    SCR_ASSERT_PTR_NEQ(child = vasqChildLoggerInit(&child_storage, logger, "table", "\"users\""), NULL);
+    SCR_ASSERT_EQ(vasqContextPush("request", "a\tb"), 0);
+
+    line = __LINE__ + 1;
+    VASQ_LOG_FIELDS(child, VASQ_LL_INFO,
+                    VASQ_FIELDS(VASQ_FIELD_INT("shard", -3), VASQ_FIELD_STR("path", "C:\\")),
+                    "A \"quoted\" message which is long enough for the vector loops\n%c", 1);
+    snprintf(answer, sizeof(answer),
+             "{\"level\":\"INFO\",\"logger\":\"db\",\"message\":\"A \\\"quoted\\\" message which is long "
+             "enough for the vector loops\\n\\u0001\",\"line\":%u,\"table\":\"\\\"users\\\"\","
+             "\"request\":\"a\\tb\",\"shard\":-3,\"path\":\"C:\\\\\"}\n",
+             line);
+    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
+
+    vasqContextClear();
+    vasqLoggerFree(logger);
+
+    // The fields are placed where %C appears.
+    SCR_ASSERT_PTR_NEQ(logger = create_json_logger(&ctx, "%C %M %x", &options), NULL);
+    VASQ_LOG_FIELDS(logger, VASQ_LL_INFO, VASQ_FIELDS(VASQ_FIELD_BOOL("ok", true)), "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "{\"ok\":true,\"message\":\"Check\",\"data0\":\"\"}\n");
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_json_truncated(void)
+{
+    struct json_ctx ctx;
+    vasqLoggerOptions options = {.max_message_size = JSON_TEST_SIZE};
+    vasqLogger *logger;
+    char message[200];
+    size_t length;
+
+    memset(message, '"', sizeof(message) - 1);
+    message[sizeof(message) - 1] = '\0';
+
+    SCR_ASSERT_PTR_NEQ(logger = create_json_logger(&ctx, "%L %M", &options), NULL);
+    VASQ_INFO(logger, "%s", message);
+    length = strlen(ctx.buffer);
+    SCR_ASSERT_LT(length, JSON_TEST_SIZE);
+    SCR_ASSERT_GT(length, JSON_TEST_SIZE - 4);
+    SCR_ASSERT_STR_EQ(ctx.buffer + length - 5, "\\\"\"}\n");
+    vasqLoggerFree(logger);
+
+    options.max_message_size = 16;
+    SCR_ASSERT_PTR_EQ(logger = create_json_logger(&ctx, "%M", &options), NULL);
+    SCR_ASSERT_EQ(errno, EINVAL);
+}
+
+void
+test_logger_json_builder(void)
+{
+    struct json_ctx ctx;
+    vasqLoggerOptions options = {0};
+    vasqLogger *logger;
+    vasqLogBuilder builder;
+
+    SCR_ASSERT_PTR_NEQ(logger = create_json_logger(&ctx, "%L %M %C", &options), NULL);
+    SCR_ASSERT_EQ(VASQ_LOG_BUILDER_BEGIN(&builder, logger, VASQ_LL_INFO), true);
+    vasqLogBuilderString(&builder, "Tab\t");
+    vasqLogBuilderInt(&builder, 5);
+    vasqLogBuilderCommit(&builder);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "{\"level\":\"INFO\",\"message\":\"Tab\\t5\"}\n");
+
+    VASQ_HEXDUMP(logger, "data", "ab", 2);
+    SCR_ASSERT_STR_EQ(ctx.buffer,
+                      "{\"level\":\"DEBUG\",\"message\":\"data (2 bytes):\\n\\t0000\\t61 62"
+                      "                                           "
+                      "\\tab\\n\"}\n");
+
+    vasqLoggerFree(logger);
+}
+
+VASQ_DEFINE_FORMAT(defined_format, VASQ_FMT_LITERAL("["), VASQ_FMT_LEVEL, VASQ_FMT_LITERAL("]"),
+                   VASQ_FMT_PADDING, VASQ_FMT_LITERAL(" "), VASQ_FMT_FILE, VASQ_FMT_LITERAL(":"),
+                   VASQ_FMT_FUNCTION, VASQ_FMT_LITERAL(" "), VASQ_FMT_DATA, VASQ_FMT_MESSAGE, VASQ_FMT_DATA,
+                   VASQ_FMT_MESSAGE, VASQ_FMT_LITERAL("%"))
+
+void
+test_logger_defined_format(void)
+{
+    struct test_ctx ctx;
+    vasqLoggerOptions options = {.processor = processor, .user = (void *)(intptr_t)1};
+    vasqLogger *logger;
+    char answer[sizeof(ctx.buffer)];
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "[%L]%_ %F:%f %x%M%x%%", &options), NULL);
+    VASQ_INFO(logger, "Check");
+    memcpy(answer, ctx.buffer, sizeof(answer));
+    vasqLoggerFree(logger);
+
+    options.formatter = defined_format;
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, NULL, &options), NULL);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
+
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_no_format(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger;
+
+    SCR_ASSERT_PTR_EQ(logger = create_logger(&ctx, VASQ_LL_INFO, NULL, NULL), NULL);
+    SCR_ASSERT_EQ(errno, EINVAL);
+}
+
+void
+test_logger_invalid_format(void)
+{
+    struct test_ctx ctx;
+
+    SCR_ASSERT_PTR_EQ(create_logger(&ctx, VASQ_LL_INFO, "%k", NULL), NULL);
+    SCR_ASSERT_EQ(errno, EINVAL);
+}
+
+void
+test_logger_percent(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger;
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%%", NULL), NULL);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "%");
+
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_literals(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger;
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "[%L] 100%% %M!%%", NULL), NULL);
+    VASQ_INFO(logger, "Check");
+    SCR_ASSERT_STR_EQ(ctx.buffer, "[INFO] 100% Check!%");
+
+    vasqLoggerFree(logger);
+}
+
+static void
+raw_handler(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    SCR_ASSERT_EQ(level, VASQ_LL_NONE);
+
+    write_to_ctx(user, level, text, size);
+}
+
+static vasqLogger *
+create_raw_logger(struct test_ctx *ctx)
+{
+    vasqHandler handler = {.func = raw_handler, .user = ctx};
+
+    return vasqLoggerCreate(VASQ_LL_INFO, "%L: %M", &handler, NULL);
+}
+
+void
+test_logger_raw(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger;
+
+    SCR_ASSERT_PTR_NEQ(logger = create_raw_logger(&ctx), NULL);
+    vasqRawLog(logger, "Check: %i", 5);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Check: 5");
+
+    vasqLoggerFree(logger);
+}
+
+static void
+do_vraw(vasqLogger *logger, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vasqVRawLog(logger, format, args);
+    va_end(args);
+}
+
+void
+test_logger_vraw(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger;
+
+    SCR_ASSERT_PTR_NEQ(logger = create_raw_logger(&ctx), NULL);
+    do_vraw(logger, "Check: %i", 5);
+    SCR_ASSERT_STR_EQ(ctx.buffer, "Check: 5");
+
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_perror(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger;
+    char answer[50];
+
+    snprintf(answer, sizeof(answer), "ERROR: Check: %s", strerror(EINVAL));
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%L: %M", NULL), NULL);
+    VASQ_PERROR(logger, "Check", EINVAL);
+    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
+
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_pwarning(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger;
+    char answer[50];
+
+    snprintf(answer, sizeof(answer), "WARNING: Check: %s", strerror(EINVAL));
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%L: %M", NULL), NULL);
+    VASQ_PWARNING(logger, "Check", EINVAL);
+    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
+
+    vasqLoggerFree(logger);
+}
+
+void
+test_logger_pcritical(void)
+{
+    struct test_ctx ctx;
+    vasqLogger *logger;
+    char answer[50];
+
+    snprintf(answer, sizeof(answer), "CRITICAL: Check: %s", strerror(EINVAL));
+
+    SCR_ASSERT_PTR_NEQ(logger = create_logger(&ctx, VASQ_LL_INFO, "%L: %M", NULL), NULL);
+    VASQ_PCRITICAL(logger, "Check", EINVAL);
+    SCR_ASSERT_STR_EQ(ctx.buffer, answer);
+
+    vasqLoggerFree(logger);
 }
 
 void
@@ -715,3 +2055,274 @@ test_logger_fd_handler_cloexec(void)
     close(fds[0]);
     close(fds[1]);
 }
+
+struct async_ctx {
+    struct test_ctx ctx;
+    pthread_t thread;
+    sigset_t mask;
+    bool cleaned_up;
+};
+
+static void
+async_append(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    struct async_ctx *async_ctx = user;
+
+    async_ctx->thread = pthread_self();
+    pthread_sigmask(SIG_BLOCK, NULL, &async_ctx->mask);
+    SCR_ASSERT_EQ(text[size], '\0');
+    append_to_ctx(&async_ctx->ctx, level, text, size);
+}
+
+static void
+async_cleanup(void *user)
+{
+    struct async_ctx *async_ctx = user;
+
+    async_ctx->cleaned_up = true;
+}
+
+void
+test_logger_async(void)
+{
+    pid_t child;
+    int status;
+    struct async_ctx async_ctx = {0};
+    vasqHandler handler = {.func = async_append, .cleanup = async_cleanup, .user = &async_ctx}, async;
+    vasqAsyncOptions options = {.size = 256};
+    vasqAsyncStats stats;
+    vasqLogger *logger;
+    char big[300];
+
+    SCR_ASSERT_EQ(vasqAsyncHandlerCreate(&handler, &options, &async), 0);
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_INFO, "%M;", &async, NULL), NULL);
+
+    VASQ_INFO(logger, "a");
+    VASQ_INFO(logger, "b");
+    VASQ_INFO(logger, "c");
+    SCR_ASSERT_EQ(vasqAsyncHandlerFlush(&async), 0);
+    SCR_ASSERT_STR_EQ(async_ctx.ctx.buffer, "a;b;c;");
+    SCR_ASSERT(!pthread_equal(async_ctx.thread, pthread_self()));
+    SCR_ASSERT(sigismember(&async_ctx.mask, SIGINT));
+    SCR_ASSERT(!sigismember(&async_ctx.mask, SIGTRAP));
+    SCR_ASSERT(!sigismember(&async_ctx.mask, SIGSEGV));
+
+    // Larger than the whole ring.
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    VASQ_INFO(logger, "%s", big);
+    SCR_ASSERT_EQ(vasqAsyncHandlerStats(&async, &stats), 0);
+    SCR_ASSERT_EQ(stats.written, 3);
+    SCR_ASSERT_EQ(stats.dropped, 1);
+    SCR_ASSERT_EQ(stats.dropped_messages[VASQ_LL_INFO], 1);
+    SCR_ASSERT_EQ(stats.dropped_bytes[VASQ_LL_INFO], 300);
+    SCR_ASSERT_EQ(vasqAsyncHandlerFlush(&async), 0);
+    SCR_ASSERT_STR_EQ(async_ctx.ctx.buffer, "a;b;c;1 message (300 bytes) dropped\n");
+
+    // Raw messages are counted as ALWAYS.
+    vasqRawLog(logger, "%s", big);
+    SCR_ASSERT_EQ(vasqAsyncHandlerStats(&async, &stats), 0);
+    SCR_ASSERT_EQ(stats.dropped, 2);
+    SCR_ASSERT_EQ(stats.dropped_messages[VASQ_LL_ALWAYS], 1);
+    SCR_ASSERT_EQ(stats.dropped_bytes[VASQ_LL_ALWAYS], sizeof(big) - 1);
+    SCR_ASSERT_EQ(stats.dropped_messages[VASQ_LL_INFO], 1);
+    SCR_ASSERT_EQ(stats.dropped_bytes[VASQ_LL_INFO], 300);
+    SCR_ASSERT_EQ(vasqAsyncHandlerFlush(&async), 0);
+
+    child = fork();
+    if (child < 0) {
+        SCR_FAIL("fork: %s", strerror(errno));
+    }
+    if (child == 0) {
+        // The writer thread doesn't exist in the child.
+        memset(&async_ctx.ctx, 0, sizeof(async_ctx.ctx));
+        VASQ_INFO(logger, "d");
+        if (strcmp(async_ctx.ctx.buffer, "d;") != 0 || !pthread_equal(async_ctx.thread, pthread_self())) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    if (waitpid(child, &status, 0) != child) {
+        SCR_FAIL("waitpid: %s", strerror(errno));
+    }
+    SCR_ASSERT(WIFEXITED(status));
+    SCR_ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    VASQ_INFO(logger, "e");
+    vasqLoggerFree(logger);
+    SCR_ASSERT_STR_EQ(async_ctx.ctx.buffer,
+                      "a;b;c;1 message (300 bytes) dropped\n1 message (299 bytes) dropped\ne;");
+    SCR_ASSERT(async_ctx.cleaned_up);
+
+    handler.func = NULL;
+    SCR_ASSERT_EQ(vasqAsyncHandlerCreate(&handler, NULL, &async), -1);
+    SCR_ASSERT_EQ(errno, EINVAL);
+    SCR_ASSERT_EQ(vasqAsyncHandlerFlush(&handler), -1);
+}
+
+struct gated_ctx {
+    struct test_ctx ctx;
+    pthread_mutex_t gate;
+    bool entered;
+};
+
+static void
+gated_append(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    struct gated_ctx *gated = user;
+
+    // Only the first message waits at the gate.
+    if (!__atomic_exchange_n(&gated->entered, true, __ATOMIC_ACQ_REL)) {
+        pthread_mutex_lock(&gated->gate);
+        pthread_mutex_unlock(&gated->gate);
+    }
+    append_to_ctx(&gated->ctx, level, text, size);
+}
+
+static void *
+open_gate(void *arg)
+{
+    struct gated_ctx *gated = arg;
+
+    usleep(50000);
+    pthread_mutex_unlock(&gated->gate);
+    return NULL;
+}
+
+static void *
+open_gate_after_drain(void *arg)
+{
+    struct gated_ctx *gated = arg;
+
+    usleep((VASQ_ASYNC_DRAIN_TIMEOUT + 200) * 1000);
+    pthread_mutex_unlock(&gated->gate);
+    return NULL;
+}
+
+/*
+    Creates a logger whose asynchronous handler's writer is stuck on the message "a" and whose ring (4
+    slots) holds "b" through "d".  Unless the policy is VASQ_ASYNC_DROP_OLDEST, the ring is now full since
+    "a" is still in it.
+*/
+static vasqLogger *
+create_gated_logger(struct gated_ctx *gated, const vasqAsyncOptions *options, vasqHandler *async)
+{
+    vasqHandler handler = {.func = gated_append, .user = gated};
+    vasqLogger *logger;
+
+    memset(gated, 0, sizeof(*gated));
+    pthread_mutex_init(&gated->gate, NULL);
+    pthread_mutex_lock(&gated->gate);
+
+    SCR_ASSERT_EQ(vasqAsyncHandlerCreate(&handler, options, async), 0);
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_DEBUG, "%M;", async, NULL), NULL);
+    VASQ_INFO(logger, "a");
+    while (!__atomic_load_n(&gated->entered, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    VASQ_INFO(logger, "b");
+    VASQ_INFO(logger, "c");
+    VASQ_INFO(logger, "d");
+    return logger;
+}
+
+void
+test_logger_async_policies(void)
+{
+    pthread_t thread;
+    struct gated_ctx gated;
+    vasqHandler async;
+    vasqAsyncOptions options = {.size = 256};
+    vasqAsyncStats stats;
+    vasqLogger *logger;
+
+    options.policy = VASQ_ASYNC_DROP_OLDEST;
+    logger = create_gated_logger(&gated, &options, &async);
+    VASQ_INFO(logger, "e");
+    VASQ_INFO(logger, "f");
+    VASQ_INFO(logger, "g");
+    pthread_mutex_unlock(&gated.gate);
+    SCR_ASSERT_EQ(vasqAsyncHandlerFlush(&async), 0);
+    SCR_ASSERT_STR_EQ(gated.ctx.buffer, "a;d;e;f;g;2 messages (4 bytes) dropped\n");
+    SCR_ASSERT_EQ(vasqAsyncHandlerStats(&async, &stats), 0);
+    SCR_ASSERT_EQ(stats.written, 5);
+    SCR_ASSERT_EQ(stats.dropped_messages[VASQ_LL_INFO], 2);
+    vasqLoggerFree(logger);
+    pthread_mutex_destroy(&gated.gate);
+
+    options.policy = VASQ_ASYNC_DROP_VERBOSE;
+    options.block_timeout = 10000;
+    options.drop_level = VASQ_LL_WARNING;
+    logger = create_gated_logger(&gated, &options, &async);
+    VASQ_DEBUG(logger, "x");
+    if (pthread_create(&thread, NULL, open_gate, &gated) != 0) {
+        SCR_FAIL("pthread_create failed");
+    }
+    VASQ_WARNING(logger, "w");  // Waits until the gate is opened.
+    SCR_ASSERT_EQ(vasqAsyncHandlerFlush(&async), 0);
+    // The drops may be reported before "w" is written.
+    SCR_ASSERT_PTR_EQ(strstr(gated.ctx.buffer, "a;b;c;d;"), gated.ctx.buffer);
+    SCR_ASSERT_PTR_NEQ(strstr(gated.ctx.buffer, "w;"), NULL);
+    SCR_ASSERT_PTR_NEQ(strstr(gated.ctx.buffer, "1 message (2 bytes) dropped\n"), NULL);
+    SCR_ASSERT_EQ(vasqAsyncHandlerStats(&async, &stats), 0);
+    SCR_ASSERT_EQ(stats.dropped_messages[VASQ_LL_DEBUG], 1);
+    SCR_ASSERT_EQ(stats.dropped_bytes[VASQ_LL_DEBUG], 2);
+    pthread_join(thread, NULL);
+    vasqLoggerFree(logger);
+    pthread_mutex_destroy(&gated.gate);
+
+    // Whatever is left once the drain timeout has passed is dropped.
+    options.policy = VASQ_ASYNC_DROP_NEWEST;
+    logger = create_gated_logger(&gated, &options, &async);
+    if (pthread_create(&thread, NULL, open_gate_after_drain, &gated) != 0) {
+        SCR_FAIL("pthread_create failed");
+    }
+    vasqLoggerFree(logger);
+    SCR_ASSERT_STR_EQ(gated.ctx.buffer, "a;3 messages (6 bytes) dropped\n");
+    pthread_join(thread, NULL);
+    pthread_mutex_destroy(&gated.gate);
+
+    options.policy = VASQ_ASYNC_DROP_VERBOSE + 1;
+    SCR_ASSERT_EQ(vasqAsyncHandlerCreate(&async, &options, &async), -1);
+    SCR_ASSERT_EQ(errno, EINVAL);
+}
+
+void
+test_logger_async_lanes(void)
+{
+    struct gated_ctx gated;
+    vasqHandler async;
+    vasqAsyncOptions options = {.size = 512,
+                                .flags = VASQ_ASYNC_FLAG_PRIORITY_LANE | VASQ_ASYNC_FLAG_SYNC_CRITICAL};
+    vasqAsyncStats stats;
+    vasqLogger *logger;
+    char big[200];
+
+    logger = create_gated_logger(&gated, &options, &async);
+    VASQ_ERROR(logger, "E");
+    VASQ_CRITICAL(logger, "C");  // Written right away.
+    // A raw message is neither written right away nor queued in the priority lane, so the full normal lane
+    // drops it.
+    vasqRawLog(logger, "R;");
+    SCR_ASSERT_STR_EQ(gated.ctx.buffer, "C;");
+    pthread_mutex_unlock(&gated.gate);
+    SCR_ASSERT_EQ(vasqAsyncHandlerFlush(&async), 0);
+    SCR_ASSERT_STR_EQ(gated.ctx.buffer, "C;a;E;b;c;d;1 message (2 bytes) dropped\n");
+    SCR_ASSERT_EQ(vasqAsyncHandlerStats(&async, &stats), 0);
+    SCR_ASSERT_EQ(stats.written, 6);
+    SCR_ASSERT_EQ(stats.dropped, 1);
+
+    // Too big for the priority lane (2 slots) but not for the normal one.
+    *gated.ctx.buffer = '\0';
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    VASQ_ERROR(logger, "%s", big);
+    SCR_ASSERT_EQ(vasqAsyncHandlerFlush(&async), 0);
+    SCR_ASSERT_EQ(*gated.ctx.buffer, 'x');
+    SCR_ASSERT_EQ(vasqAsyncHandlerStats(&async, &stats), 0);
+    SCR_ASSERT_EQ(stats.written, 7);
+    SCR_ASSERT_EQ(stats.dropped, 1);
+
+    vasqLoggerFree(logger);
+    pthread_mutex_destroy(&gated.gate);
+}
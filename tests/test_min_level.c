@@ -0,0 +1,53 @@
+#include <string.h>
+
+#define VASQ_MIN_LEVEL VASQ_LL_INFO
+
+#include <scrutiny/scrutiny.h>
+#include <vasq/logger.h>
+
+static void
+copy_message(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    char *buffer = user;
+
+    (void)level;
+
+    SCR_ASSERT_LT(size, 100);
+    memcpy(buffer, text, size + 1);
+}
+
+static int
+count_call(int *count)
+{
+    return (*count)++;
+}
+
+void
+test_logger_min_level(void)
+{
+    char buffer[100] = "";
+    int count = 0;
+    vasqHandler handler = {.func = copy_message, .user = buffer};
+    vasqLogger *logger;
+    vasqLogBuilder builder;
+
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_TRACE, "%L%_ %M", &handler, NULL), NULL);
+
+    VASQ_TRACE(logger, "%i", count_call(&count));
+    VASQ_DEBUG(logger, "%i", count_call(&count));
+    SCR_ASSERT(!VASQ_LOG_BUILDER_BEGIN(&builder, logger, VASQ_LL_DEBUG));
+    vasqLogBuilderCommit(&builder);
+    VASQ_HEXDUMP(logger, "Data", buffer, count_call(&count));
+    SCR_ASSERT_EQ(count, 0);
+    SCR_ASSERT_STR_EQ(buffer, "");
+
+    VASQ_INFO(logger, "%i", count_call(&count));
+    SCR_ASSERT_EQ(count, 1);
+    SCR_ASSERT_STR_EQ(buffer, "INFO     0");
+
+    // The functions aren't affected.
+    vasqLogStatement(logger, VASQ_LL_TRACE, VASQ_CONTEXT_PARAMS, "Check");
+    SCR_ASSERT_STR_EQ(buffer, "TRACE    Check");
+
+    vasqLoggerFree(logger);
+}
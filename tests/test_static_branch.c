@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define VASQ_STATIC_BRANCHES
+
+#include <scrutiny/scrutiny.h>
+#include <vasq/logger.h>
+
+static void
+copy_message(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    char *buffer = user;
+
+    (void)level;
+
+    SCR_ASSERT_LT(size, 100);
+    memcpy(buffer, text, size + 1);
+}
+
+static int
+count_call(int *count)
+{
+    return (*count)++;
+}
+
+static void
+log_messages(vasqLogger *logger, int *count)
+{
+    VASQ_INFO(logger, "Info %i", count_call(count));
+    VASQ_DEBUG(logger, "Debug %i", count_call(count));
+}
+
+static void
+check_entries(vasqLogLevel max_level)
+{
+    for (vasqJumpEntry *entry = __start_vasq_jump_table; entry < __stop_vasq_jump_table; entry++) {
+        SCR_ASSERT_EQ(entry->enabled, entry->site->level <= max_level);
+    }
+}
+
+void
+test_logger_static_branch(void)
+{
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+    char buffer[100] = "";
+    int count = 0;
+    vasqHandler handler = {.func = copy_message, .user = buffer};
+    vasqCallSiteFilter filter = {.function = "log_messages"};
+    vasqLogger *logger;
+
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_INFO, "%M", &handler, NULL), NULL);
+    SCR_ASSERT_GE(__stop_vasq_jump_table - __start_vasq_jump_table, 2);
+    check_entries(VASQ_LL_INFO);
+
+    log_messages(logger, &count);
+    SCR_ASSERT_EQ(count, 1);
+    SCR_ASSERT_STR_EQ(buffer, "Info 0");
+
+    vasqSetLoggerLevel(logger, VASQ_LL_DEBUG);
+    check_entries(VASQ_LL_DEBUG);
+    log_messages(logger, &count);
+    SCR_ASSERT_EQ(count, 3);
+    SCR_ASSERT_STR_EQ(buffer, "Debug 2");
+
+    vasqSetLoggerLevel(logger, VASQ_LL_NONE);
+    check_entries(VASQ_LL_NONE);
+    log_messages(logger, &count);
+    SCR_ASSERT_EQ(count, 3);
+
+    // An enabled call site's jump is restored regardless of the level.
+    vasqSetLoggerLevel(logger, VASQ_LL_INFO);
+    SCR_ASSERT_EQ(vasqCallSitesSetState(&filter, VASQ_SITE_ENABLED), 2);
+    check_entries(VASQ_LL_DEBUG);
+    log_messages(logger, &count);
+    SCR_ASSERT_EQ(count, 5);
+    SCR_ASSERT_STR_EQ(buffer, "Debug 4");
+    SCR_ASSERT_EQ(vasqCallSitesSetState(&filter, VASQ_SITE_DEFAULT), 2);
+    check_entries(VASQ_LL_INFO);
+
+    vasqLoggerFree(logger);
+#else
+    SCR_TEST_SKIP();
+#endif
+}
+
+struct spin_ctx {
+    vasqLogger *logger;
+    bool stop;
+    unsigned long messages;
+};
+
+static void
+count_message(void *user, vasqLogLevel level, const char *text, size_t size)
+{
+    (void)user;
+    (void)level;
+    (void)text;
+    (void)size;
+}
+
+static void
+log_spinning(vasqLogger *logger, unsigned long *messages)
+{
+    VASQ_INFO(logger, "Spin %lu", ++*messages);
+}
+
+static void *
+spin(void *arg)
+{
+    struct spin_ctx *ctx = arg;
+
+    while (!__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED)) {
+        log_spinning(ctx->logger, &ctx->messages);
+    }
+    return NULL;
+}
+
+void
+test_logger_patch_threads(void)
+{
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+    vasqHandler handler = {.func = count_message};
+    struct spin_ctx ctx[4] = {{0}};
+    pthread_t threads[4];
+    vasqLogger *logger;
+
+    SCR_ASSERT_PTR_NEQ(logger = vasqLoggerCreate(VASQ_LL_INFO, "%M", &handler, NULL), NULL);
+
+    // The jumps are rewritten while the other threads are executing them.
+    for (int k = 0; k < 4; k++) {
+        ctx[k].logger = logger;
+        SCR_ASSERT_EQ(pthread_create(&threads[k], NULL, spin, &ctx[k]), 0);
+    }
+    for (int k = 0; k < 200; k++) {
+        vasqSetLoggerLevel(logger, (k % 2 == 0) ? VASQ_LL_NONE : VASQ_LL_INFO);
+    }
+    for (int k = 0; k < 4; k++) {
+        __atomic_store_n(&ctx[k].stop, true, __ATOMIC_RELAXED);
+        pthread_join(threads[k], NULL);
+    }
+
+    check_entries(VASQ_LL_INFO);
+    vasqLoggerFree(logger);
+#else
+    SCR_TEST_SKIP();
+#endif
+}
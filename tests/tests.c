@@ -52,16 +52,51 @@
     M(logger_no_name)              \
     M(logger_epoch)                \
     M(logger_pretty_timestamp)     \
+    M(logger_time_consistent)      \
+    M(logger_time_zone)            \
+    M(logger_fake_clock)           \
+    M(logger_dst_transition)       \
+    M(logger_mixed_clocks)         \
+    M(logger_clock_sources)        \
     M(logger_hour)                 \
     M(logger_minute)               \
     M(logger_second)               \
     M(logger_file)                 \
+    M(logger_statement)            \
+    M(logger_call_site)            \
+    M(logger_dynamic_statement)    \
     M(logger_func)                 \
     M(logger_line)                 \
     M(logger_user_data)            \
+    M(logger_data_static)          \
+    M(logger_data_per_thread)      \
+    M(logger_data_versioned)       \
+    M(logger_context)              \
+    M(logger_child)                \
+    M(logger_builder)              \
+    M(logger_max_message_size)     \
+    M(logger_spill)                \
+    M(logger_nested)               \
+    M(logger_disabled_level)       \
+    M(logger_min_level)            \
+    M(logger_static_branch)        \
+    M(logger_patch_threads)        \
+    M(logger_call_sites)           \
+    M(logger_control)              \
+    M(logger_throttle)             \
+    M(logger_sampling)             \
+    M(logger_tail)                 \
+    M(logger_dedup)                \
+    M(logger_budget)               \
+    M(logger_fields)               \
+    M(logger_json)                 \
+    M(logger_json_truncated)       \
+    M(logger_json_builder)         \
+    M(logger_defined_format)       \
     M(logger_no_format)            \
     M(logger_invalid_format)       \
     M(logger_percent)              \
+    M(logger_literals)             \
     M(logger_raw)                  \
     M(logger_vraw)                 \
     M(logger_perror)               \
@@ -69,7 +104,10 @@
     M(logger_pcritical)            \
     M(logger_assert)               \
     M(logger_fd_handler)           \
-    M(logger_fd_handler_cloexec)
+    M(logger_fd_handler_cloexec)   \
+    M(logger_async)                \
+    M(logger_async_policies)       \
+    M(logger_async_lanes)
 
 #define DECL_TEST(func) void test_##func(void);
 #define ADD_TEST(func)  scrGroupAddTest(group, #func, test_##func, NULL);
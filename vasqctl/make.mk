@@ -0,0 +1,18 @@
+VASQCTL_BINARY := $(VASQCTL_DIR)/vasqctl
+VASQCTL_SOURCE_FILES := $(wildcard $(VASQCTL_DIR)/*.c)
+VASQCTL_OBJECT_FILES := $(patsubst %.c,%.o,$(VASQCTL_SOURCE_FILES))
+
+$(VASQCTL_DIR)/%.o: $(VASQCTL_DIR)/%.c $(VASQ_HEADER_FILES)
+	$(CC) $(CFLAGS) $(VASQ_INCLUDE_FLAGS) -c $< -o $@
+
+$(VASQCTL_BINARY): $(VASQCTL_OBJECT_FILES) $(VASQ_STATIC_LIBRARY)
+	$(CC) $(CFLAGS) $(VASQCTL_OBJECT_FILES) $(VASQ_STATIC_LIBRARY) -pthread -o $@
+
+vasqctl: $(VASQCTL_BINARY)
+
+vasqctl_clean:
+	@rm -f $(VASQCTL_BINARY) $(VASQCTL_OBJECT_FILES)
+
+.PHONY: vasqctl vasqctl_clean
+
+CLEAN_TARGETS += vasqctl_clean
@@ -0,0 +1,253 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vasq/control.h>
+#include <vasq/logger.h>
+
+static const char *level_names[] = {
+    "NONE", "ALWAYS", "CRITICAL", "ERROR", "WARNING", "INFO", "DEBUG", "TRACE",
+};
+static const char *state_names[] = {"default", "enable", "disable"};
+
+static void
+usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s FILE list\n"
+            "       %s FILE level NAME LEVEL\n"
+            "       %s FILE site default|enable|disable [file=GLOB] [function=NAME] [lines=FIRST[-LAST]]\n",
+            program, program, program);
+}
+
+static const char *
+levelName(int32_t level)
+{
+    if (level < VASQ_LL_NONE || level > VASQ_LL_TRACE) {
+        return "INVALID";
+    }
+    return level_names[level - VASQ_LL_NONE];
+}
+
+static int
+parseLevel(const char *text, int32_t *level)
+{
+    for (size_t k = 0; k < ARRAY_LENGTH(level_names); k++) {
+        if (strcasecmp(text, level_names[k]) == 0) {
+            *level = (int32_t)k + VASQ_LL_NONE;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static vasqControlPage *
+mapPage(const char *path, int *fd)
+{
+    struct stat info;
+    vasqControlPage *page;
+
+    *fd = open(path, O_RDWR | O_CLOEXEC);
+    if (*fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    if (fstat(*fd, &info) != 0 || (size_t)info.st_size < sizeof(*page)) {
+        fprintf(stderr, "%s: Not a control file\n", path);
+        goto error;
+    }
+
+    page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (page == MAP_FAILED) {
+        perror("mmap");
+        goto error;
+    }
+
+    if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != VASQ_CONTROL_MAGIC ||
+        page->version != VASQ_CONTROL_VERSION) {
+        fprintf(stderr, "%s: Not a control file or an unsupported version\n", path);
+        munmap(page, sizeof(*page));
+        goto error;
+    }
+
+    // Serializes the changes made by concurrent invocations.
+    flock(*fd, LOCK_EX);
+    return page;
+
+error:
+    close(*fd);
+    return NULL;
+}
+
+static void
+publish(vasqControlPage *page)
+{
+    __atomic_add_fetch(&page->generation, 1, __ATOMIC_RELEASE);
+}
+
+static int
+list(const vasqControlPage *page)
+{
+    uint32_t next_sequence = __atomic_load_n(&page->next_sequence, __ATOMIC_ACQUIRE);
+
+    printf("PID %u\n\n%-*s LEVEL\n", page->pid, VASQ_CONTROL_NAME_SIZE, "LOGGER");
+    for (unsigned int k = 0; k < VASQ_CONTROL_LOGGERS; k++) {
+        const vasqControlLogger *slot = &page->loggers[k];
+
+        if (slot->name[0]) {
+            printf("%-*.*s %s%s\n", VASQ_CONTROL_NAME_SIZE, VASQ_CONTROL_NAME_SIZE, slot->name,
+                   levelName(slot->level), slot->pending ? " (pending)" : "");
+        }
+    }
+
+    printf("\nRULES\n");
+    for (uint32_t sequence = (next_sequence > VASQ_CONTROL_RULES) ? next_sequence - VASQ_CONTROL_RULES : 1;
+         sequence < next_sequence; sequence++) {
+        const vasqControlRule *rule = &page->rules[sequence % VASQ_CONTROL_RULES];
+
+        if (rule->sequence == sequence && rule->state >= 0 &&
+            rule->state < (int32_t)ARRAY_LENGTH(state_names)) {
+            printf("%u: %s file=%.*s function=%.*s lines=%u-%u\n", sequence, state_names[rule->state],
+                   VASQ_CONTROL_PATTERN_SIZE, rule->file, VASQ_CONTROL_PATTERN_SIZE, rule->function,
+                   rule->first_line, rule->last_line);
+        }
+    }
+
+    return 0;
+}
+
+static int
+setLevel(vasqControlPage *page, const char *name, const char *level_name)
+{
+    int32_t level;
+
+    if (parseLevel(level_name, &level) != 0) {
+        fprintf(stderr, "Invalid level: %s\n", level_name);
+        return 1;
+    }
+
+    for (unsigned int k = 0; k < VASQ_CONTROL_LOGGERS; k++) {
+        vasqControlLogger *slot = &page->loggers[k];
+
+        if (slot->name[0] && strncmp(slot->name, name, sizeof(slot->name)) == 0) {
+            __atomic_store_n(&slot->level, level, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->pending, 1, __ATOMIC_RELEASE);
+            publish(page);
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "No logger named %s\n", name);
+    return 1;
+}
+
+static int
+addRule(vasqControlPage *page, int argc, char **argv)
+{
+    int32_t state = -1;
+    int k;
+    uint32_t sequence;
+    vasqControlRule *rule, new_rule = {0};
+
+    for (size_t j = 0; j < ARRAY_LENGTH(state_names); j++) {
+        if (strcmp(argv[0], state_names[j]) == 0) {
+            state = j;
+        }
+    }
+    if (state < 0) {
+        fprintf(stderr, "Invalid state: %s\n", argv[0]);
+        return 1;
+    }
+    new_rule.state = state;
+
+    for (k = 1; k < argc; k++) {
+        char *value = strchr(argv[k], '=');
+
+        if (!value) {
+            goto invalid;
+        }
+        *value++ = '\0';
+
+        if (strcmp(argv[k], "file") == 0 && strlen(value) < sizeof(new_rule.file)) {
+            strcpy(new_rule.file, value);
+        }
+        else if (strcmp(argv[k], "function") == 0 && strlen(value) < sizeof(new_rule.function)) {
+            strcpy(new_rule.function, value);
+        }
+        else if (strcmp(argv[k], "lines") == 0) {
+            char *end;
+
+            new_rule.first_line = strtoul(value, &end, 10);
+            if (*end == '-') {
+                new_rule.last_line = strtoul(end + 1, &end, 10);
+            }
+            else {
+                new_rule.last_line = new_rule.first_line;
+            }
+            if (*end) {
+                goto invalid;
+            }
+        }
+        else {
+            goto invalid;
+        }
+    }
+
+    sequence = __atomic_load_n(&page->next_sequence, __ATOMIC_RELAXED);
+    rule = &page->rules[sequence % VASQ_CONTROL_RULES];
+
+    // The process ignores the slot until its sequence number matches.
+    __atomic_store_n(&rule->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)rule + sizeof(rule->sequence), (char *)&new_rule + sizeof(new_rule.sequence),
+           sizeof(*rule) - sizeof(rule->sequence));
+    __atomic_store_n(&rule->sequence, sequence, __ATOMIC_RELEASE);
+    __atomic_store_n(&page->next_sequence, sequence + 1, __ATOMIC_RELEASE);
+    publish(page);
+    return 0;
+
+invalid:
+    fprintf(stderr, "Invalid argument: %s\n", argv[k]);
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    int fd, ret = 1;
+    vasqControlPage *page;
+
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    page = mapPage(argv[1], &fd);
+    if (!page) {
+        return 1;
+    }
+
+    if (strcmp(argv[2], "list") == 0 && argc == 3) {
+        ret = list(page);
+    }
+    else if (strcmp(argv[2], "level") == 0 && argc == 5) {
+        ret = setLevel(page, argv[3], argv[4]);
+    }
+    else if (strcmp(argv[2], "site") == 0 && argc >= 4) {
+        ret = addRule(page, argc - 3, argv + 3);
+    }
+    else {
+        usage(argv[0]);
+    }
+
+    munmap(page, sizeof(*page));
+    close(fd);
+    return ret;
+}